@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/* Build-time helper which compiles a grammar file into the format
+   read by smie_grammar_new_from_bytes(), so that the result can be
+   embedded into the library as a resource.  */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "smie-grammar.h"
+#include <stdlib.h>
+
+int
+main (int argc, char **argv)
+{
+  smie_grammar_t *grammar;
+  GBytes *bytes;
+  GError *error = NULL;
+
+  if (argc != 3)
+    {
+      g_printerr ("Usage: %s INPUT OUTPUT\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  grammar = smie_grammar_load (argv[1], &error);
+  if (!grammar)
+    {
+      g_printerr ("%s: %s\n", argv[1], error->message);
+      g_error_free (error);
+      return EXIT_FAILURE;
+    }
+
+  bytes = smie_grammar_serialize (grammar);
+  smie_grammar_unref (grammar);
+  if (!g_file_set_contents (argv[2],
+			    g_bytes_get_data (bytes, NULL),
+			    g_bytes_get_size (bytes),
+			    &error))
+    {
+      g_printerr ("%s: %s\n", argv[2], error->message);
+      g_error_free (error);
+      g_bytes_unref (bytes);
+      return EXIT_FAILURE;
+    }
+  g_bytes_unref (bytes);
+
+  return EXIT_SUCCESS;
+}
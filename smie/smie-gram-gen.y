@@ -21,6 +21,7 @@
 #include <config.h>
 #endif
 
+#include <string.h>
 #include "smie-private.h"
 #include "smie-gram-gen.h"
 static int yylex (YYSTYPE *lval,
@@ -38,24 +39,28 @@ static void yyerror (struct smie_grammar_parser_context_t *context,
   smie_prec_type_t pval;
   GList *lval;
   gchar *tval;
+  gint ival;
 }
 
 %token <tval> NONTERMINAL
 %token <tval> TERMINAL
 %token <tval> TERMINALVAR
+%token <ival> NUMBER
 %token PRECS
 %token <pval> LEFT RIGHT ASSOC NONASSOC
+%token RULES BASIC BEFORE AFTER LIST_INTRO CLOSE_ALL
 %type <sval> symbol terminal
 %type <lval> sentences symbols terminals
 %type <pval> prectype
 
 %%
 
-grammar: rules resolvers
+grammar: rules sections
 	;
 
-resolvers: %empty
-	| resolvers resolver
+sections: %empty
+	| sections resolver
+	| sections indent_rules
 	;
 
 resolver: precs
@@ -89,6 +94,58 @@ prectype: LEFT
 	| NONASSOC
 	;
 
+indent_rules: RULES '{'
+	{
+	  context->in_rules = TRUE;
+	}
+	indent_rule_list '}'
+	{
+	  context->in_rules = FALSE;
+	}
+	;
+
+indent_rule_list: indent_rule
+	| indent_rule_list indent_rule
+	;
+
+/* Like the rule functions, a negative offset leaves the indentation
+   undetermined.  */
+indent_rule: BASIC NUMBER ';'
+	{
+	  context->rules->basic = MAX ($2, -1);
+	}
+	| BEFORE NUMBER terminals ';'
+	{
+	  GList *l = $3;
+	  for (; l; l = l->next)
+	    g_hash_table_insert (context->rules->before, l->data,
+				 GINT_TO_POINTER (MAX ($2, -1)));
+	  g_list_free ($3);
+	}
+	| AFTER NUMBER terminals ';'
+	{
+	  GList *l = $3;
+	  for (; l; l = l->next)
+	    g_hash_table_insert (context->rules->after, l->data,
+				 GINT_TO_POINTER (MAX ($2, -1)));
+	  g_list_free ($3);
+	}
+	| LIST_INTRO terminals ';'
+	{
+	  GList *l = $2;
+	  for (; l; l = l->next)
+	    g_hash_table_add (context->rules->list_intros, l->data);
+	  g_list_free ($2);
+	}
+	| CLOSE_ALL terminals ';'
+	{
+	  GList *l = $2;
+	  for (; l; l = l->next)
+	    g_hash_table_add (context->rules->close_alls, l->data);
+	  g_list_free ($2);
+	}
+	;
+
 rules:	%empty
 	| rules rule
 	;
@@ -166,6 +223,19 @@ terminal:	TERMINAL
 
 %%
 
+/* Return TRUE if the input at CP starts with the keyword NAME, as a
+   whole word.  */
+static gboolean
+smie_gram_gen_has_keyword (const char *cp, const gchar *name)
+{
+  gsize length = strlen (name);
+
+  if (strncmp (cp, name, length) != 0)
+    return FALSE;
+  cp += length;
+  return !(*cp == '_' || *cp == '-' || g_ascii_isalnum (*cp));
+}
+
 static int
 yylex (YYSTYPE *lval, struct smie_grammar_parser_context_t *context,
        GError **error)
@@ -190,6 +260,44 @@ yylex (YYSTYPE *lval, struct smie_grammar_parser_context_t *context,
       return PRECS;
     }
 
+  if (smie_gram_gen_has_keyword (cp, "%rules"))
+    {
+      context->input = cp + 6;
+      return RULES;
+    }
+
+  if (context->in_rules)
+    {
+      static const struct
+      {
+	const gchar *name;
+	int token;
+      } keywords[] =
+	  {
+	    { "basic", BASIC },
+	    { "before", BEFORE },
+	    { "after", AFTER },
+	    { "list-intro", LIST_INTRO },
+	    { "close-all", CLOSE_ALL }
+	  };
+      gsize i;
+
+      for (i = 0; i < G_N_ELEMENTS (keywords); i++)
+	if (smie_gram_gen_has_keyword (cp, keywords[i].name))
+	  {
+	    context->input = cp + strlen (keywords[i].name);
+	    return keywords[i].token;
+	  }
+
+      if (g_ascii_isdigit (*cp) || (*cp == '-' && g_ascii_isdigit (cp[1])))
+	{
+	  gchar *end;
+	  lval->ival = g_ascii_strtoll (cp, &end, 10);
+	  context->input = end;
+	  return NUMBER;
+	}
+    }
+
   if (context->precs)
     {
       if (g_str_has_prefix (cp, "right"))
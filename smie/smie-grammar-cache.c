@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include "smie-grammar.h"
+#include "smie-private.h"
+
+static guint32
+smie_compiled_add_symbol (GHashTable *indices,
+			  GArray *symbols,
+			  GString *strings,
+			  const smie_symbol_t *symbol)
+{
+  struct smie_compiled_symbol_t record;
+  gpointer value;
+
+  if (g_hash_table_lookup_extended (indices, symbol, NULL, &value))
+    return GPOINTER_TO_UINT (value);
+
+  memset (&record, 0, sizeof (struct smie_compiled_symbol_t));
+  record.name = strings->len;
+  record.type = symbol->type;
+  record.before = -1;
+  record.after = -1;
+  g_string_append_len (strings, symbol->name, strlen (symbol->name) + 1);
+  g_array_append_val (symbols, record);
+  g_hash_table_insert (indices, (gpointer) symbol,
+		       GUINT_TO_POINTER (symbols->len - 1));
+  return symbols->len - 1;
+}
+
+static void
+smie_compiled_split_zones (guint32 *halves, guint64 zones)
+{
+  halves[0] = (guint32) zones;
+  halves[1] = zones >> 32;
+}
+
+static guint64
+smie_compiled_join_zones (const guint32 *halves)
+{
+  return halves[0] | ((guint64) halves[1] << 32);
+}
+
+/**
+ * smie_grammar_serialize:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Serialize @grammar into the compiled form, which can be loaded
+ * back with smie_grammar_new_from_bytes() without going through the
+ * BNF and PREC2 representations.
+ * Returns: (transfer full): a #GBytes object
+ */
+GBytes *
+smie_grammar_serialize (smie_grammar_t *grammar)
+{
+  GHashTable *indices = g_hash_table_new (g_direct_hash, g_direct_equal);
+  GArray *symbols = g_array_new (FALSE, FALSE,
+				 sizeof (struct smie_compiled_symbol_t));
+  GArray *pairs = g_array_new (FALSE, FALSE,
+			       sizeof (struct smie_compiled_pair_t));
+  GString *strings = g_string_new ("");
+  struct smie_compiled_header_t header;
+  GHashTableIter iter;
+  gpointer key, value;
+  GByteArray *result;
+  guint i;
+
+  g_return_val_if_fail (grammar, NULL);
+
+  g_hash_table_iter_init (&iter, grammar->levels);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      struct smie_level_t *level = value;
+      struct smie_compiled_symbol_t *record;
+      guint32 index;
+
+      index = smie_compiled_add_symbol (indices, symbols, strings, key);
+      record = &g_array_index (symbols, struct smie_compiled_symbol_t, index);
+      record->left_prec = level->left_prec;
+      record->right_prec = level->right_prec;
+      record->symbol_class = level->symbol_class;
+      record->flags |= SMIE_COMPILED_SYMBOL_HAS_LEVEL;
+      smie_compiled_split_zones (record->zones, level->zones.zones);
+      smie_compiled_split_zones (record->zones + 2, level->zones.left_zones);
+      smie_compiled_split_zones (record->zones + 4,
+				 level->zones.right_zones);
+    }
+
+  for (i = 0; i < grammar->pairs->len; i++)
+    {
+      const smie_symbol_t *opener, *closer;
+      smie_grammar_closer_iter_t closer_iter;
+
+      opener = g_ptr_array_index (grammar->pool->symbols, i);
+      smie_grammar_closer_iter_init (&closer_iter, grammar, opener);
+      while (smie_grammar_closer_iter_next (&closer_iter, &closer))
+	{
+	  struct smie_compiled_pair_t record;
+
+	  record.opener = smie_compiled_add_symbol (indices, symbols, strings,
+						    opener);
+	  record.closer = smie_compiled_add_symbol (indices, symbols, strings,
+						    closer);
+	  g_array_append_val (pairs, record);
+	}
+    }
+
+  for (i = 0; i < grammar->pool->symbols->len; i++)
+    {
+      const smie_symbol_t *symbol;
+      struct smie_compiled_symbol_t *record;
+      guint32 index;
+      gint before, after;
+      gboolean list_intro, close_all;
+
+      symbol = g_ptr_array_index (grammar->pool->symbols, i);
+      before = smie_grammar_get_before_offset (grammar, symbol);
+      after = smie_grammar_get_after_offset (grammar, symbol);
+      list_intro = smie_grammar_is_list_intro (grammar, symbol);
+      close_all = smie_grammar_is_close_all (grammar, symbol);
+      if (before < 0 && after < 0 && !list_intro && !close_all)
+	continue;
+
+      index = smie_compiled_add_symbol (indices, symbols, strings, symbol);
+      record = &g_array_index (symbols, struct smie_compiled_symbol_t, index);
+      record->before = before;
+      record->after = after;
+      if (list_intro)
+	record->flags |= SMIE_COMPILED_SYMBOL_LIST_INTRO;
+      if (close_all)
+	record->flags |= SMIE_COMPILED_SYMBOL_CLOSE_ALL;
+    }
+
+  /* Keep the records 4-byte aligned.  */
+  while (strings->len % 4 != 0)
+    g_string_append_c (strings, '\0');
+
+  memset (&header, 0, sizeof (struct smie_compiled_header_t));
+  memcpy (header.magic, SMIE_COMPILED_MAGIC, sizeof (header.magic));
+  header.format_version = SMIE_COMPILED_FORMAT_VERSION;
+  header.byte_order = SMIE_COMPILED_BYTE_ORDER;
+  header.n_symbols = symbols->len;
+  header.n_pairs = pairs->len;
+  header.strings_size = strings->len;
+  header.basic = smie_grammar_get_basic_offset (grammar);
+
+  result = g_byte_array_new ();
+  g_byte_array_append (result, (const guint8 *) &header,
+		       sizeof (struct smie_compiled_header_t));
+  g_byte_array_append (result, (const guint8 *) symbols->data,
+		       symbols->len * sizeof (struct smie_compiled_symbol_t));
+  g_byte_array_append (result, (const guint8 *) pairs->data,
+		       pairs->len * sizeof (struct smie_compiled_pair_t));
+  g_byte_array_append (result, (const guint8 *) strings->str, strings->len);
+
+  g_hash_table_unref (indices);
+  g_array_free (symbols, TRUE);
+  g_array_free (pairs, TRUE);
+  g_string_free (strings, TRUE);
+
+  return g_byte_array_free_to_bytes (result);
+}
+
+/**
+ * smie_grammar_new_from_bytes:
+ * @bytes: a #GBytes object holding a compiled grammar
+ * @error: return location of an error
+ *
+ * Load a grammar from the compiled form produced by
+ * smie_grammar_serialize().  The symbols are interned into a new pool
+ * and the lookup tables are rebuilt from @bytes, which is a linear
+ * pass over the data and skips the precedence computation of
+ * smie_prec2_to_grammar().  @bytes is not referenced after the call.
+ * Returns: (transfer full): a new #smie_grammar_t object
+ */
+smie_grammar_t *
+smie_grammar_new_from_bytes (GBytes *bytes, GError **error)
+{
+  const struct smie_compiled_header_t *header;
+  const struct smie_compiled_symbol_t *records;
+  const struct smie_compiled_pair_t *pairs;
+  const gchar *strings;
+  const smie_symbol_t **symbols;
+  smie_symbol_pool_t *pool;
+  smie_grammar_t *grammar;
+  struct smie_level_t *level;
+  const guint8 *data;
+  gsize size;
+  guint32 i;
+
+  g_return_val_if_fail (bytes, NULL);
+
+  data = g_bytes_get_data (bytes, &size);
+  if (size < sizeof (struct smie_compiled_header_t))
+    goto invalid;
+
+  header = (const struct smie_compiled_header_t *) data;
+  if (memcmp (header->magic, SMIE_COMPILED_MAGIC, sizeof (header->magic)) != 0
+      || header->format_version != SMIE_COMPILED_FORMAT_VERSION
+      || header->byte_order != SMIE_COMPILED_BYTE_ORDER)
+    goto invalid;
+
+  if (header->n_symbols > size / sizeof (struct smie_compiled_symbol_t)
+      || header->n_pairs > size / sizeof (struct smie_compiled_pair_t)
+      || size - sizeof (struct smie_compiled_header_t)
+      != header->n_symbols * sizeof (struct smie_compiled_symbol_t)
+      + header->n_pairs * sizeof (struct smie_compiled_pair_t)
+      + header->strings_size)
+    goto invalid;
+
+  records = (const struct smie_compiled_symbol_t *) (header + 1);
+  pairs = (const struct smie_compiled_pair_t *) (records + header->n_symbols);
+  strings = (const gchar *) (pairs + header->n_pairs);
+
+  if (header->strings_size > 0 && strings[header->strings_size - 1] != '\0')
+    goto invalid;
+
+  for (i = 0; i < header->n_symbols; i++)
+    if (records[i].name >= header->strings_size
+	|| records[i].type > SMIE_SYMBOL_NON_TERMINAL
+	|| records[i].symbol_class > SMIE_SYMBOL_CLASS_CLOSER)
+      goto invalid;
+
+  for (i = 0; i < header->n_pairs; i++)
+    if (pairs[i].opener >= header->n_symbols
+	|| pairs[i].closer >= header->n_symbols)
+      goto invalid;
+
+  pool = smie_symbol_pool_alloc ();
+  grammar = smie_grammar_alloc (pool);
+  smie_symbol_pool_unref (pool);
+
+  symbols = g_new0 (const smie_symbol_t *, header->n_symbols);
+  for (i = 0; i < header->n_symbols; i++)
+    {
+      const struct smie_compiled_symbol_t *record = &records[i];
+      symbols[i] = smie_symbol_intern (pool,
+				       strings + record->name,
+				       record->type);
+      if (record->flags & SMIE_COMPILED_SYMBOL_HAS_LEVEL)
+	{
+	  smie_grammar_add_level (grammar,
+				  symbols[i],
+				  record->left_prec,
+				  record->right_prec);
+	  smie_grammar_set_symbol_class (grammar,
+					 symbols[i],
+					 record->symbol_class);
+	  level = g_hash_table_lookup (grammar->levels, symbols[i]);
+	  level->zones.zones = smie_compiled_join_zones (record->zones);
+	  level->zones.left_zones
+	    = smie_compiled_join_zones (record->zones + 2);
+	  level->zones.right_zones
+	    = smie_compiled_join_zones (record->zones + 4);
+	}
+      if (record->before >= 0)
+	smie_grammar_set_before_offset (grammar, symbols[i], record->before);
+      if (record->after >= 0)
+	smie_grammar_set_after_offset (grammar, symbols[i], record->after);
+      if (record->flags & SMIE_COMPILED_SYMBOL_LIST_INTRO)
+	smie_grammar_add_list_intro (grammar, symbols[i]);
+      if (record->flags & SMIE_COMPILED_SYMBOL_CLOSE_ALL)
+	smie_grammar_add_close_all (grammar, symbols[i]);
+    }
+  smie_grammar_set_basic_offset (grammar, header->basic);
+
+  for (i = 0; i < header->n_pairs; i++)
+    smie_grammar_add_pair (grammar,
+			   symbols[pairs[i].opener],
+			   symbols[pairs[i].closer]);
+  g_free (symbols);
+
+  return grammar;
+
+ invalid:
+  g_set_error_literal (error, SMIE_ERROR, SMIE_ERROR_FORMAT,
+		       "invalid compiled grammar");
+  return NULL;
+}
+
+static gchar *
+smie_grammar_cache_filename (const gchar *input, const gchar *cache_dir)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  gchar *basename, *filename;
+  gchar *format_version;
+
+  /* The compiled form depends on the grammar text, the library
+     version, and the layout of the compiled tables.  */
+  format_version = g_strdup_printf ("%d", SMIE_COMPILED_FORMAT_VERSION);
+  g_checksum_update (checksum, (const guchar *) input, -1);
+  g_checksum_update (checksum, (const guchar *) "", 1);
+  g_checksum_update (checksum, (const guchar *) PACKAGE_VERSION, -1);
+  g_checksum_update (checksum, (const guchar *) "", 1);
+  g_checksum_update (checksum, (const guchar *) format_version, -1);
+  g_free (format_version);
+
+  basename = g_strconcat (g_checksum_get_string (checksum), ".smiec", NULL);
+  g_checksum_free (checksum);
+
+  filename = g_build_filename (cache_dir, basename, NULL);
+  g_free (basename);
+  return filename;
+}
+
+static smie_grammar_t *
+smie_grammar_cache_lookup (const gchar *filename)
+{
+  GMappedFile *mapped_file;
+  GBytes *bytes;
+  smie_grammar_t *grammar;
+
+  mapped_file = g_mapped_file_new (filename, FALSE, NULL);
+  if (!mapped_file)
+    return NULL;
+
+  bytes = g_bytes_new_with_free_func (g_mapped_file_get_contents (mapped_file),
+				      g_mapped_file_get_length (mapped_file),
+				      (GDestroyNotify) g_mapped_file_unref,
+				      mapped_file);
+  grammar = smie_grammar_new_from_bytes (bytes, NULL);
+  g_bytes_unref (bytes);
+  return grammar;
+}
+
+/**
+ * smie_grammar_load_cached:
+ * @input: a string representation of a grammar
+ * @cache_dir: (nullable): a directory to store compiled grammars
+ * @error: return location of an error
+ *
+ * Load a grammar from a string, as smie_prec2_grammar_load() and
+ * smie_prec2_to_grammar() do, but reuse the compiled grammar from
+ * @cache_dir if it has already been built from the same @input by
+ * the same library version.  Otherwise the compiled grammar is
+ * written to @cache_dir, so that later calls, possibly from other
+ * processes, can skip the grammar construction.
+ *
+ * If @cache_dir is %NULL, the "smie" subdirectory of
+ * g_get_user_cache_dir() is used.  Failing to write the cache is
+ * not an error.
+ * Returns: (transfer full): a new #smie_grammar_t object
+ */
+smie_grammar_t *
+smie_grammar_load_cached (const gchar *input,
+			  const gchar *cache_dir,
+			  GError **error)
+{
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *grammar;
+  gchar *default_cache_dir = NULL;
+  gchar *filename;
+  GBytes *bytes;
+
+  g_return_val_if_fail (input, NULL);
+
+  if (!cache_dir)
+    cache_dir = default_cache_dir = g_build_filename (g_get_user_cache_dir (),
+						      "smie",
+						      NULL);
+
+  filename = smie_grammar_cache_filename (input, cache_dir);
+  grammar = smie_grammar_cache_lookup (filename);
+  if (grammar)
+    goto out;
+
+  prec2 = smie_prec2_grammar_load (input, error);
+  if (!prec2)
+    goto out;
+
+  grammar = smie_prec2_to_grammar (prec2, error);
+  smie_prec2_grammar_free (prec2);
+  if (!grammar)
+    goto out;
+
+  /* g_file_set_contents() writes to a temporary file and atomically
+     renames it, so concurrent writers never expose a partial file.  */
+  bytes = smie_grammar_serialize (grammar);
+  if (g_mkdir_with_parents (cache_dir, 0755) == 0)
+    g_file_set_contents (filename,
+			 g_bytes_get_data (bytes, NULL),
+			 g_bytes_get_size (bytes),
+			 NULL);
+  g_bytes_unref (bytes);
+
+ out:
+  g_free (filename);
+  g_free (default_cache_dir);
+  return grammar;
+}
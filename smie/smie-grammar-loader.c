@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "smie-grammar.h"
+#include "smie-private.h"
+#include <string.h>
+
+static smie_grammar_t *
+smie_grammar_load_internal (const gchar *filename,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+  GMappedFile *mapped_file;
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *grammar;
+  gchar *input;
+
+  mapped_file = g_mapped_file_new (filename, FALSE, error);
+  if (!mapped_file)
+    return NULL;
+
+  /* The parser expects a NUL-terminated string, which a mapped file
+     is not guaranteed to be.  */
+  input = g_strndup (g_mapped_file_get_contents (mapped_file),
+		     g_mapped_file_get_length (mapped_file));
+  g_mapped_file_unref (mapped_file);
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_free (input);
+      return NULL;
+    }
+
+  prec2 = smie_prec2_grammar_load (input, error);
+  g_free (input);
+  if (!prec2)
+    return NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      smie_prec2_grammar_free (prec2);
+      return NULL;
+    }
+
+  grammar = smie_prec2_to_grammar (prec2, error);
+  smie_prec2_grammar_free (prec2);
+  return grammar;
+}
+
+/**
+ * smie_grammar_load:
+ * @filename: the name of a grammar file
+ * @error: return location of an error
+ *
+ * Read a grammar file and compile it into a #smie_grammar_t.
+ * Returns: (transfer full): a new #smie_grammar_t object, or %NULL
+ *   on error
+ */
+smie_grammar_t *
+smie_grammar_load (const gchar *filename, GError **error)
+{
+  g_return_val_if_fail (filename, NULL);
+
+  return smie_grammar_load_internal (filename, NULL, error);
+}
+
+static void
+smie_grammar_load_thread (GTask *task,
+			  gpointer source_object,
+			  gpointer task_data,
+			  GCancellable *cancellable)
+{
+  const gchar *filename = task_data;
+  smie_grammar_t *grammar;
+  GError *error;
+
+  error = NULL;
+  grammar = smie_grammar_load_internal (filename, cancellable, &error);
+  if (!grammar)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_task_return_pointer (task, grammar, (GDestroyNotify) smie_grammar_unref);
+}
+
+/**
+ * smie_grammar_load_async:
+ * @filename: the name of a grammar file
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the grammar is loaded
+ * @user_data: the data to pass to @callback
+ *
+ * Load a grammar file in a worker thread.  Reading the file, parsing
+ * it, converting it to a PREC2 grammar, and assigning the precedence
+ * levels all happen off the calling thread.  The operation can be
+ * cancelled through @cancellable between those steps.
+ *
+ * When the operation is finished, @callback will be called in the
+ * thread-default main context of the calling thread.  Call
+ * smie_grammar_load_finish() from @callback to get the result.
+ */
+void
+smie_grammar_load_async (const gchar *filename,
+			 GCancellable *cancellable,
+			 GAsyncReadyCallback callback,
+			 gpointer user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (filename);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, smie_grammar_load_async);
+  g_task_set_task_data (task, g_strdup (filename), g_free);
+  g_task_run_in_thread (task, smie_grammar_load_thread);
+  g_object_unref (task);
+}
+
+/**
+ * smie_grammar_load_finish:
+ * @result: a #GAsyncResult
+ * @error: return location of an error
+ *
+ * Finish an operation started with smie_grammar_load_async().
+ * Returns: (transfer full): a new #smie_grammar_t object, or %NULL
+ *   on error
+ */
+smie_grammar_t *
+smie_grammar_load_finish (GAsyncResult *result, GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * smie_grammar_new_from_resource:
+ * @name: the name of a built-in grammar, or a resource path
+ * @error: return location of an error
+ *
+ * Load a precompiled grammar from a #GResource.  If @name starts with
+ * a slash, it is taken as the path of a resource holding a grammar
+ * compiled by smie_grammar_serialize().  Otherwise it names one of
+ * the grammars built into the library, such as "sh" or "c"; see
+ * smie_grammar_list_builtin().
+ *
+ * The built-in grammars are embedded in the library, so no file I/O
+ * is involved, and the compiled form is loaded with
+ * smie_grammar_new_from_bytes(), which skips the grammar construction.
+ * Each resource is loaded only once per process: later calls return
+ * the same grammar, which must therefore not be modified.
+ * Returns: (transfer full): a #smie_grammar_t object, or %NULL on
+ *   error
+ */
+smie_grammar_t *
+smie_grammar_new_from_resource (const gchar *name, GError **error)
+{
+  static GMutex lock;
+  static GHashTable *loaded;
+  smie_grammar_t *grammar;
+  GBytes *bytes;
+  gchar *path;
+
+  g_return_val_if_fail (name, NULL);
+
+  if (*name == '/')
+    path = g_strdup (name);
+  else
+    path = g_strconcat (SMIE_GRAMMAR_RESOURCE_PATH, name, ".smiec", NULL);
+
+  g_mutex_lock (&lock);
+  if (!loaded)
+    loaded = g_hash_table_new_full (g_str_hash, g_str_equal,
+				    g_free,
+				    (GDestroyNotify) smie_grammar_unref);
+
+  grammar = g_hash_table_lookup (loaded, path);
+  if (grammar)
+    {
+      g_free (path);
+      goto out;
+    }
+
+  bytes = g_resources_lookup_data (path, G_RESOURCE_LOOKUP_FLAGS_NONE, error);
+  if (!bytes)
+    {
+      g_free (path);
+      g_mutex_unlock (&lock);
+      return NULL;
+    }
+
+  grammar = smie_grammar_new_from_bytes (bytes, error);
+  g_bytes_unref (bytes);
+  if (!grammar)
+    {
+      g_free (path);
+      g_mutex_unlock (&lock);
+      return NULL;
+    }
+  g_hash_table_insert (loaded, path, grammar);
+
+ out:
+  smie_grammar_ref (grammar);
+  g_mutex_unlock (&lock);
+  return grammar;
+}
+
+/**
+ * smie_grammar_list_builtin:
+ *
+ * List the names of the grammars built into the library, which can be
+ * passed to smie_grammar_new_from_resource().
+ * Returns: (transfer full): a %NULL-terminated array of names
+ */
+gchar **
+smie_grammar_list_builtin (void)
+{
+  gchar **children;
+  GPtrArray *result;
+  gsize i;
+
+  result = g_ptr_array_new ();
+  children = g_resources_enumerate_children (SMIE_GRAMMAR_RESOURCE_PATH,
+					     G_RESOURCE_LOOKUP_FLAGS_NONE,
+					     NULL);
+  for (i = 0; children && children[i]; i++)
+    if (g_str_has_suffix (children[i], ".smiec"))
+      g_ptr_array_add (result,
+		       g_strndup (children[i],
+				  strlen (children[i]) - strlen (".smiec")));
+  g_strfreev (children);
+  g_ptr_array_add (result, NULL);
+
+  return (gchar **) g_ptr_array_free (result, FALSE);
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "smie-indenter.h"
+#include "smie-private.h"
+
+struct _smie_grammar_monitor_t
+{
+  volatile gint ref_count;
+
+  gchar *filename;
+  smie_grammar_t *grammar;
+  GList *indenters;
+
+  GFileMonitor *file_monitor;
+  GCancellable *cancellable;
+
+  smie_grammar_monitor_func_t func;
+  gpointer user_data;
+  GDestroyNotify destroy;
+};
+
+static void
+smie_grammar_monitor_load_ready (GObject *source_object,
+				 GAsyncResult *result,
+				 gpointer user_data)
+{
+  smie_grammar_monitor_t *monitor = user_data;
+  smie_grammar_t *grammar;
+  GError *error = NULL;
+  GList *l;
+
+  grammar = smie_grammar_load_finish (result, &error);
+
+  /* Ignore the result if a newer reload superseded this one.  */
+  if (g_task_get_cancellable (G_TASK (result)) != monitor->cancellable)
+    {
+      if (grammar)
+	smie_grammar_unref (grammar);
+      else
+	g_error_free (error);
+      smie_grammar_monitor_unref (monitor);
+      return;
+    }
+
+  g_clear_object (&monitor->cancellable);
+  if (!grammar)
+    {
+      if (monitor->func)
+	monitor->func (monitor, error, monitor->user_data);
+      g_error_free (error);
+      smie_grammar_monitor_unref (monitor);
+      return;
+    }
+
+  smie_grammar_unref (monitor->grammar);
+  monitor->grammar = grammar;
+  for (l = monitor->indenters; l; l = l->next)
+    smie_indenter_set_grammar (l->data, grammar);
+
+  if (monitor->func)
+    monitor->func (monitor, NULL, monitor->user_data);
+  smie_grammar_monitor_unref (monitor);
+}
+
+static void
+smie_grammar_monitor_changed (GFileMonitor *file_monitor,
+			      GFile *file,
+			      GFile *other_file,
+			      GFileMonitorEvent event_type,
+			      gpointer user_data)
+{
+  smie_grammar_monitor_t *monitor = user_data;
+
+  /* Editors often save by renaming a temporary file over the
+     original, which is reported as a creation.  */
+  if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
+      || event_type == G_FILE_MONITOR_EVENT_CREATED)
+    smie_grammar_monitor_reload (monitor);
+}
+
+/**
+ * smie_grammar_monitor_new:
+ * @filename: the name of a grammar file
+ * @error: return location of an error
+ *
+ * Load a grammar file and watch it for changes.  Whenever the file
+ * changes, it is recompiled in a worker thread and the new grammar is
+ * published to all the indenters added with
+ * smie_grammar_monitor_add_indenter().
+ *
+ * Changes are delivered in the thread-default main context of the
+ * calling thread.
+ * Returns: a new #smie_grammar_monitor_t object, or %NULL on error
+ */
+smie_grammar_monitor_t *
+smie_grammar_monitor_new (const gchar *filename, GError **error)
+{
+  smie_grammar_monitor_t *result;
+  smie_grammar_t *grammar;
+  GFile *file;
+
+  g_return_val_if_fail (filename, NULL);
+
+  grammar = smie_grammar_load (filename, error);
+  if (!grammar)
+    return NULL;
+
+  result = g_new0 (smie_grammar_monitor_t, 1);
+  result->ref_count = 1;
+  result->filename = g_strdup (filename);
+  result->grammar = grammar;
+
+  file = g_file_new_for_path (filename);
+  result->file_monitor = g_file_monitor_file (file,
+					       G_FILE_MONITOR_NONE,
+					       NULL,
+					       error);
+  g_object_unref (file);
+  if (!result->file_monitor)
+    {
+      smie_grammar_monitor_unref (result);
+      return NULL;
+    }
+  g_signal_connect (result->file_monitor, "changed",
+		    G_CALLBACK (smie_grammar_monitor_changed), result);
+
+  return result;
+}
+
+static void
+smie_grammar_monitor_free (smie_grammar_monitor_t *monitor)
+{
+  if (monitor->file_monitor)
+    {
+      g_signal_handlers_disconnect_by_data (monitor->file_monitor, monitor);
+      g_file_monitor_cancel (monitor->file_monitor);
+      g_object_unref (monitor->file_monitor);
+    }
+  g_list_free_full (monitor->indenters,
+		    (GDestroyNotify) smie_indenter_unref);
+  smie_grammar_unref (monitor->grammar);
+  if (monitor->destroy)
+    monitor->destroy (monitor->user_data);
+  g_free (monitor->filename);
+  g_free (monitor);
+}
+
+/**
+ * smie_grammar_monitor_ref:
+ * @monitor: a #smie_grammar_monitor_t object
+ *
+ * Increment reference count of @monitor.
+ * Returns: @monitor
+ */
+smie_grammar_monitor_t *
+smie_grammar_monitor_ref (smie_grammar_monitor_t *monitor)
+{
+  g_return_val_if_fail (monitor, NULL);
+  g_return_val_if_fail (monitor->ref_count > 0, NULL);
+  g_atomic_int_inc (&monitor->ref_count);
+  return monitor;
+}
+
+/**
+ * smie_grammar_monitor_unref:
+ * @monitor: a #smie_grammar_monitor_t object
+ *
+ * Decrement reference count of @monitor.  If the count reaches zero,
+ * the file is no longer watched and the memory allocated for
+ * @monitor will be released.  Indenters added to @monitor keep using
+ * the grammar they were last given.
+ */
+void
+smie_grammar_monitor_unref (smie_grammar_monitor_t *monitor)
+{
+  g_return_if_fail (monitor);
+  g_return_if_fail (monitor->ref_count > 0);
+  if (g_atomic_int_dec_and_test (&monitor->ref_count))
+    smie_grammar_monitor_free (monitor);
+}
+
+/**
+ * smie_grammar_monitor_get_grammar:
+ * @monitor: a #smie_grammar_monitor_t object
+ *
+ * Get the most recently compiled grammar.
+ * Returns: (transfer full): a #smie_grammar_t object
+ */
+smie_grammar_t *
+smie_grammar_monitor_get_grammar (smie_grammar_monitor_t *monitor)
+{
+  g_return_val_if_fail (monitor, NULL);
+
+  return smie_grammar_ref (monitor->grammar);
+}
+
+/**
+ * smie_grammar_monitor_add_indenter:
+ * @monitor: a #smie_grammar_monitor_t object
+ * @indenter: a #smie_indenter_t object
+ *
+ * Let @indenter follow the grammar of @monitor.  @indenter is
+ * switched to the current grammar immediately and to each new grammar
+ * as soon as it is compiled.
+ */
+void
+smie_grammar_monitor_add_indenter (smie_grammar_monitor_t *monitor,
+				   smie_indenter_t *indenter)
+{
+  g_return_if_fail (monitor);
+  g_return_if_fail (indenter);
+
+  smie_indenter_set_grammar (indenter, monitor->grammar);
+  monitor->indenters = g_list_prepend (monitor->indenters,
+				       smie_indenter_ref (indenter));
+}
+
+/**
+ * smie_grammar_monitor_remove_indenter:
+ * @monitor: a #smie_grammar_monitor_t object
+ * @indenter: a #smie_indenter_t object
+ *
+ * Stop publishing new grammars to @indenter.
+ */
+void
+smie_grammar_monitor_remove_indenter (smie_grammar_monitor_t *monitor,
+				      smie_indenter_t *indenter)
+{
+  GList *link;
+
+  g_return_if_fail (monitor);
+  g_return_if_fail (indenter);
+
+  link = g_list_find (monitor->indenters, indenter);
+  if (link)
+    {
+      monitor->indenters = g_list_delete_link (monitor->indenters, link);
+      smie_indenter_unref (indenter);
+    }
+}
+
+/**
+ * smie_grammar_monitor_set_func:
+ * @monitor: a #smie_grammar_monitor_t object
+ * @func: (nullable): a #smie_grammar_monitor_func_t
+ * @user_data: the data to pass to @func
+ * @destroy: (nullable): a function to release @user_data
+ *
+ * Set a function called after each reload attempt.
+ */
+void
+smie_grammar_monitor_set_func (smie_grammar_monitor_t *monitor,
+			       smie_grammar_monitor_func_t func,
+			       gpointer user_data,
+			       GDestroyNotify destroy)
+{
+  g_return_if_fail (monitor);
+
+  if (monitor->destroy)
+    monitor->destroy (monitor->user_data);
+  monitor->func = func;
+  monitor->user_data = user_data;
+  monitor->destroy = destroy;
+}
+
+/**
+ * smie_grammar_monitor_reload:
+ * @monitor: a #smie_grammar_monitor_t object
+ *
+ * Recompile the grammar file in a worker thread, as if it had
+ * changed.  A reload still in progress is cancelled.
+ */
+void
+smie_grammar_monitor_reload (smie_grammar_monitor_t *monitor)
+{
+  g_return_if_fail (monitor);
+
+  if (monitor->cancellable)
+    g_cancellable_cancel (monitor->cancellable);
+  g_clear_object (&monitor->cancellable);
+
+  monitor->cancellable = g_cancellable_new ();
+  smie_grammar_load_async (monitor->filename,
+			   monitor->cancellable,
+			   smie_grammar_monitor_load_ready,
+			   smie_grammar_monitor_ref (monitor));
+}
@@ -58,6 +58,11 @@
  * constructed with smie_prec2_grammar_alloc() and
  * smie_prec2_grammar_add_rule().
  *
+ * The final grammar can be saved in a compiled form with
+ * smie_grammar_serialize() and loaded back with
+ * smie_grammar_new_from_bytes().  smie_grammar_load_cached() uses it
+ * to keep compiled grammars in a cache directory.
+ *
  * A PREC2 grammar can also be loaded from a file through
  * smie_prec2_grammar_load().  The file is in the following form (in
  * the RFC2234 format):
@@ -134,7 +139,8 @@ smie_symbol_equal (gconstpointer a, gconstpointer b)
  * @type: a #smie_symbol_type_t object
  *
  * Get a symbol instance from @pool, if any.  Otherwise a new symbol
- * will be allocated in @pool.
+ * will be allocated in @pool.  As this may modify @pool, it must not
+ * be called while a grammar using @pool is shared among threads.
  * Returns: (transfer none): a #smie_symbol_t
  */
 const smie_symbol_t *
@@ -153,7 +159,9 @@ smie_symbol_intern (smie_symbol_pool_t *pool,
       result = g_new0 (smie_symbol_t, 1);
       result->name = g_strdup (name);
       result->type = type;
+      result->id = pool->symbols->len;
       g_hash_table_add (pool->allocated, result);
+      g_ptr_array_add (pool->symbols, result);
     }
   return result;
 }
@@ -180,6 +188,7 @@ smie_symbol_pool_alloc (void)
 					     smie_symbol_equal,
 					     (GDestroyNotify) smie_symbol_free,
 					     NULL);
+  result->symbols = g_ptr_array_new ();
   return result;
 }
 
@@ -192,6 +201,7 @@ smie_symbol_pool_alloc (void)
 void
 smie_symbol_pool_free (smie_symbol_pool_t *pool)
 {
+  g_ptr_array_unref (pool->symbols);
   g_hash_table_unref (pool->allocated);
   g_free (pool);
 }
@@ -346,6 +356,32 @@ smie_prec2_equal (gconstpointer a, gconstpointer b)
     && smie_symbol_equal (ap->right, bp->right);
 }
 
+static struct smie_rules_t *
+smie_rules_alloc (void)
+{
+  struct smie_rules_t *result = g_new0 (struct smie_rules_t, 1);
+  result->basic = -1;
+  result->before = g_hash_table_new (smie_symbol_hash, smie_symbol_equal);
+  result->after = g_hash_table_new (smie_symbol_hash, smie_symbol_equal);
+  result->list_intros = g_hash_table_new (smie_symbol_hash,
+					  smie_symbol_equal);
+  result->close_alls = g_hash_table_new (smie_symbol_hash, smie_symbol_equal);
+  return result;
+}
+
+static void
+smie_rules_free (struct smie_rules_t *rules)
+{
+  if (rules)
+    {
+      g_hash_table_unref (rules->before);
+      g_hash_table_unref (rules->after);
+      g_hash_table_unref (rules->list_intros);
+      g_hash_table_unref (rules->close_alls);
+      g_free (rules);
+    }
+}
+
 /**
  * smie_prec2_grammar_alloc:
  * @pool: a #smie_symbol_pool_t object
@@ -368,6 +404,10 @@ smie_prec2_grammar_alloc (smie_symbol_pool_t *pool)
 					 g_free,
 					 NULL);
   result->ends = g_hash_table_new (smie_symbol_hash, smie_symbol_equal);
+  result->zones = g_hash_table_new_full (smie_symbol_hash,
+					 smie_symbol_equal,
+					 NULL,
+					 g_free);
   return result;
 }
 
@@ -385,6 +425,8 @@ smie_prec2_grammar_free (smie_prec2_grammar_t *prec2)
   g_hash_table_unref (prec2->classes);
   g_hash_table_unref (prec2->pairs);
   g_hash_table_unref (prec2->ends);
+  g_hash_table_unref (prec2->zones);
+  smie_rules_free (prec2->rules);
   g_free (prec2);
 }
 
@@ -494,17 +536,23 @@ smie_prec2_grammar_load (const gchar *input, GError **error)
   memset (&context, 0, sizeof (struct smie_grammar_parser_context_t));
   context.input = input;
   context.bnf = smie_bnf_grammar_alloc (pool);
+  context.rules = smie_rules_alloc ();
   smie_symbol_pool_unref (pool);
   if (yyparse (&context, error) != 0)
     {
       smie_bnf_grammar_free (context.bnf);
       g_list_free_full (context.resolvers,
 			(GDestroyNotify) smie_precs_grammar_free);
+      smie_rules_free (context.rules);
       return NULL;
     }
 
   prec2 = smie_bnf_to_prec2 (context.bnf, context.resolvers, error);
   smie_bnf_grammar_free (context.bnf);
+  if (prec2)
+    prec2->rules = context.rules;
+  else
+    smie_rules_free (context.rules);
   return prec2;
 }
 
@@ -644,6 +692,44 @@ smie_prec2_merge_precs (smie_prec2_grammar_t *prec2,
     }
 }
 
+static gboolean
+smie_bitset_contains (const struct smie_bitset_t *bitset, guint id)
+{
+  guint index = id / SMIE_BITSET_WORD_BITS;
+  return index < bitset->n_words
+    && (bitset->words[index] & (1UL << (id % SMIE_BITSET_WORD_BITS))) != 0;
+}
+
+static gboolean
+smie_bitset_add (struct smie_bitset_t *bitset, guint id)
+{
+  guint index = id / SMIE_BITSET_WORD_BITS;
+  gulong mask = 1UL << (id % SMIE_BITSET_WORD_BITS);
+
+  if (index >= bitset->n_words)
+    {
+      bitset->words = g_renew (gulong, bitset->words, index + 1);
+      memset (bitset->words + bitset->n_words, 0,
+	      (index + 1 - bitset->n_words) * sizeof (gulong));
+      bitset->n_words = index + 1;
+    }
+
+  if (bitset->words[index] & mask)
+    return FALSE;
+  bitset->words[index] |= mask;
+  return TRUE;
+}
+
+static void
+smie_bitset_free (struct smie_bitset_t *bitset)
+{
+  if (bitset)
+    {
+      g_free (bitset->words);
+      g_free (bitset);
+    }
+}
+
 /**
  * smie_grammar_alloc:
  * @pool: a #smie_symbol_pool_t object
@@ -655,30 +741,80 @@ smie_grammar_t *
 smie_grammar_alloc (smie_symbol_pool_t *pool)
 {
   smie_grammar_t *result = g_new0 (smie_grammar_t, 1);
+  result->ref_count = 1;
   result->pool = smie_symbol_pool_ref (pool);
   result->levels = g_hash_table_new_full (smie_symbol_hash,
 					  smie_symbol_equal,
 					  NULL,
 					  g_free);
+  result->pairs = g_ptr_array_new_with_free_func
+    ((GDestroyNotify) smie_bitset_free);
+  result->before = g_array_new (FALSE, FALSE, sizeof (gint));
+  result->after = g_array_new (FALSE, FALSE, sizeof (gint));
+  result->basic = -1;
   return result;
 }
 
+static void
+smie_grammar_finalize (smie_grammar_t *grammar)
+{
+  smie_symbol_pool_unref (grammar->pool);
+  g_hash_table_unref (grammar->levels);
+  g_ptr_array_unref (grammar->pairs);
+  g_free (grammar->ends.words);
+  g_array_unref (grammar->before);
+  g_array_unref (grammar->after);
+  g_free (grammar->list_intros.words);
+  g_free (grammar->close_alls.words);
+  g_free (grammar);
+}
+
+/**
+ * smie_grammar_ref:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Increment reference count of @grammar.  A grammar is immutable once
+ * it is handed to an indenter, so it can be shared among threads.
+ * The indenter looks up the keywords it reads without interning them,
+ * so the symbol pool of @grammar is not modified either.
+ * Returns: @grammar
+ */
+smie_grammar_t *
+smie_grammar_ref (smie_grammar_t *grammar)
+{
+  g_return_val_if_fail (grammar, NULL);
+  g_return_val_if_fail (grammar->ref_count > 0, NULL);
+  g_atomic_int_inc (&grammar->ref_count);
+  return grammar;
+}
+
+/**
+ * smie_grammar_unref:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Decrement reference count of @grammar.  If the count reaches zero,
+ * the memory allocated for @grammar will be released.
+ */
+void
+smie_grammar_unref (smie_grammar_t *grammar)
+{
+  g_return_if_fail (grammar);
+  g_return_if_fail (grammar->ref_count > 0);
+  if (g_atomic_int_dec_and_test (&grammar->ref_count))
+    smie_grammar_finalize (grammar);
+}
+
 /**
  * smie_grammar_free:
  * @grammar: a #smie_grammar_t object
  *
- * Release all memory allocated for a grammar.
+ * Release a reference to a grammar.  This is the same as
+ * smie_grammar_unref().
  */
 void
 smie_grammar_free (smie_grammar_t *grammar)
 {
-  smie_symbol_pool_unref (grammar->pool);
-  g_hash_table_unref (grammar->levels);
-  if (grammar->pairs)
-    g_hash_table_unref (grammar->pairs);
-  if (grammar->ends)
-    g_hash_table_unref (grammar->ends);
-  g_free (grammar);
+  smie_grammar_unref (grammar);
 }
 
 /**
@@ -789,6 +925,160 @@ smie_bnf_grammar_build_op_set (smie_bnf_grammar_t *bnf,
   return op;
 }
 
+/* Return the non-terminals at the edge of the symbol at L, from EDGES
+   indexed by INDICES, or all of them if L is not a non-terminal, which
+   is the case at the ends of a rule.  */
+static guint64
+smie_zone_edges (GList *l, GHashTable *indices, const guint64 *edges)
+{
+  smie_symbol_t *symbol;
+
+  if (!l)
+    return G_MAXUINT64;
+  symbol = l->data;
+  if (symbol->type != SMIE_SYMBOL_NON_TERMINAL)
+    return G_MAXUINT64;
+  return edges[GPOINTER_TO_INT (g_hash_table_lookup (indices, symbol)) - 1];
+}
+
+/* Record in PREC2 the zones of each keyword, that is, the non-terminals
+   which can derive a construct the keyword belongs to, and those which
+   can end right before it and start right after it.  A keyword which
+   cannot be inside the operand of a pending keyword ends the scan
+   there, whatever its precedence, so that statement separators stop a
+   scan looking for the other end of a bracket, for instance.  Nothing
+   is recorded if there are 64 non-terminals or more, since a mask with
+   all bits set stands for the unknown edges of smie_zone_edges().  */
+static void
+smie_bnf_grammar_build_zones (smie_bnf_grammar_t *bnf,
+			      smie_prec2_grammar_t *prec2)
+{
+  GHashTable *indices = g_hash_table_new (smie_symbol_hash,
+					  smie_symbol_equal);
+  guint64 *firsts, *lasts;
+  GHashTableIter iter;
+  gpointer key, value;
+  gint change_count;
+  guint i, n_indices;
+
+  /* Number the non-terminals from 1.  */
+  g_hash_table_iter_init (&iter, bnf->rules);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      struct smie_rule_list_t *rules = value;
+      GList *l;
+
+      for (l = rules->rules; l; l = l->next)
+	{
+	  struct smie_rule_t *rule = l->data;
+	  GList *l1;
+
+	  for (l1 = rule->symbols; l1; l1 = l1->next)
+	    {
+	      smie_symbol_t *a = l1->data;
+	      if (a->type == SMIE_SYMBOL_NON_TERMINAL
+		  && !g_hash_table_contains (indices, a))
+		g_hash_table_insert (indices, a,
+				     GINT_TO_POINTER (g_hash_table_size
+						      (indices) + 1));
+	    }
+	}
+    }
+
+  n_indices = g_hash_table_size (indices);
+  if (n_indices >= 64)
+    {
+      g_hash_table_unref (indices);
+      return;
+    }
+
+  /* Find the non-terminals which can start and end each one,
+     including itself.  */
+  firsts = g_new0 (guint64, n_indices);
+  lasts = g_new0 (guint64, n_indices);
+  for (i = 0; i < n_indices; i++)
+    firsts[i] = lasts[i] = G_GUINT64_CONSTANT (1) << i;
+
+  do
+    {
+      change_count = 0;
+      g_hash_table_iter_init (&iter, bnf->rules);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+	{
+	  struct smie_rule_list_t *rules = value;
+	  gint index = GPOINTER_TO_INT (g_hash_table_lookup (indices, key));
+	  GList *l;
+
+	  for (l = rules->rules; l; l = l->next)
+	    {
+	      struct smie_rule_t *rule = l->data;
+	      GList *first = rule->symbols->next;
+	      guint64 mask;
+
+	      if (!first)
+		continue;
+
+	      mask = firsts[index - 1]
+		| smie_zone_edges (first, indices, firsts);
+	      if (mask != G_MAXUINT64 && mask != firsts[index - 1])
+		{
+		  firsts[index - 1] = mask;
+		  change_count++;
+		}
+
+	      mask = lasts[index - 1]
+		| smie_zone_edges (g_list_last (first), indices, lasts);
+	      if (mask != G_MAXUINT64 && mask != lasts[index - 1])
+		{
+		  lasts[index - 1] = mask;
+		  change_count++;
+		}
+	    }
+	}
+    }
+  while (change_count > 0);
+
+  g_hash_table_iter_init (&iter, bnf->rules);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      struct smie_rule_list_t *rules = value;
+      gint index = GPOINTER_TO_INT (g_hash_table_lookup (indices, key));
+      GList *l;
+
+      for (l = rules->rules; l; l = l->next)
+	{
+	  struct smie_rule_t *rule = l->data;
+	  GList *l1, *prev;
+
+	  for (l1 = rule->symbols->next; l1; l1 = l1->next)
+	    {
+	      smie_symbol_t *a = l1->data;
+	      struct smie_zones_t *zones;
+
+	      if (a->type != SMIE_SYMBOL_TERMINAL)
+		continue;
+
+	      zones = g_hash_table_lookup (prec2->zones, a);
+	      if (!zones)
+		{
+		  zones = g_new0 (struct smie_zones_t, 1);
+		  g_hash_table_insert (prec2->zones, a, zones);
+		}
+	      zones->zones |= G_GUINT64_CONSTANT (1) << (index - 1);
+	      /* The first element of a rule is its left-hand side.  */
+	      prev = l1->prev != rule->symbols ? l1->prev : NULL;
+	      zones->left_zones |= smie_zone_edges (prev, indices, lasts);
+	      zones->right_zones |= smie_zone_edges (l1->next, indices,
+						     firsts);
+	    }
+	}
+    }
+
+  g_free (firsts);
+  g_free (lasts);
+  g_hash_table_unref (indices);
+}
+
 #ifdef DEBUG
 static void
 smie_debug_dump_op_set (GHashTable *op, const char *name)
@@ -976,6 +1266,8 @@ smie_bnf_to_prec2 (smie_bnf_grammar_t *bnf,
 	}
     }
 
+  smie_bnf_grammar_build_zones (bnf, prec2);
+
   if (override)
     smie_prec2_grammar_free (override);
   g_hash_table_unref (first_op);
@@ -1373,6 +1665,11 @@ smie_prec2_to_grammar (smie_prec2_grammar_t *prec2,
 					    NULL,
 					    &value))
 	    level->symbol_class = GPOINTER_TO_INT (value);
+	  if (g_hash_table_lookup_extended (prec2->zones,
+					    (gpointer) func->symbol,
+					    NULL,
+					    &value))
+	    level->zones = *(struct smie_zones_t *) value;
 	  g_hash_table_insert (grammar->levels, (gpointer) func->symbol, level);
 	}
       switch (func->type)
@@ -1385,8 +1682,30 @@ smie_prec2_to_grammar (smie_prec2_grammar_t *prec2,
 	  break;
 	}
     }
-  grammar->pairs = g_hash_table_ref (prec2->pairs);
-  grammar->ends = g_hash_table_ref (prec2->ends);
+  g_hash_table_iter_init (&iter, prec2->pairs);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      struct smie_prec2_t *p2 = key;
+      smie_grammar_add_pair (grammar, p2->left, p2->right);
+    }
+
+  if (prec2->rules)
+    {
+      smie_grammar_set_basic_offset (grammar, prec2->rules->basic);
+      g_hash_table_iter_init (&iter, prec2->rules->before);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+	smie_grammar_set_before_offset (grammar, key,
+					GPOINTER_TO_INT (value));
+      g_hash_table_iter_init (&iter, prec2->rules->after);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+	smie_grammar_set_after_offset (grammar, key, GPOINTER_TO_INT (value));
+      g_hash_table_iter_init (&iter, prec2->rules->list_intros);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+	smie_grammar_add_list_intro (grammar, key);
+      g_hash_table_iter_init (&iter, prec2->rules->close_alls);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+	smie_grammar_add_close_all (grammar, key);
+    }
  out:
   g_hash_table_unref (assigned);
   g_hash_table_unref (allocated);
@@ -1453,28 +1772,99 @@ smie_grammar_set_symbol_class (smie_grammar_t *grammar,
 }
 
 /**
- * smie_grammar_has_pair:
+ * smie_grammar_is_sync_token:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Check if @symbol is a sync token, that is, a keyword which cannot
+ * appear inside an operand of some other keyword, according to the BNF
+ * grammar @grammar was derived from.  An S-expression scan which reads
+ * such a keyword while pending on a keyword that cannot enclose it
+ * stops there, rather than looking further for the other end of a
+ * construct.  Statement separators are typically sync tokens, since a
+ * bracketed list of expressions cannot contain them.
+ * Returns: %TRUE if @symbol is a sync token, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_is_sync_token (smie_grammar_t *grammar,
+			    const smie_symbol_t *symbol)
+{
+  struct smie_level_t *level
+    = g_hash_table_lookup (grammar->levels, (gpointer) symbol);
+  GHashTableIter iter;
+  gpointer value;
+
+  if (!level)
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, grammar->levels);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      const struct smie_level_t *level2 = value;
+      if (SMIE_ZONES_DISJOINT (level->zones.zones,
+			       level2->zones.left_zones)
+	  || SMIE_ZONES_DISJOINT (level->zones.zones,
+				  level2->zones.right_zones))
+	return TRUE;
+    }
+  return FALSE;
+}
+
+/**
+ * smie_grammar_add_pair:
  * @grammar: a #smie_grammar_t object
  * @opener_symbol: an opener #smie_symbol_t object
  * @closer_symbol: a closer #smie_symbol_t object
  *
- * Add an open/close pair into a PRECS grammar.
+ * Add an open/close pair into a grammar.  Both symbols must belong to
+ * the symbol pool of @grammar.
  * Returns: %TRUE if the pair is not defined already, %FALSE otherwise.
  */
 gboolean
-smie_grammar_has_pair (smie_grammar_t *grammar,
+smie_grammar_add_pair (smie_grammar_t *grammar,
 		       const smie_symbol_t *opener_symbol,
 		       const smie_symbol_t *closer_symbol)
 {
-  struct smie_prec2_t p2;
-  if (!grammar->pairs)
-    return FALSE;
-  else
+  struct smie_bitset_t *closers;
+
+  if (opener_symbol->id >= grammar->pairs->len)
+    g_ptr_array_set_size (grammar->pairs, opener_symbol->id + 1);
+
+  closers = g_ptr_array_index (grammar->pairs, opener_symbol->id);
+  if (!closers)
     {
-      p2.left = opener_symbol;
-      p2.right = closer_symbol;
-      return g_hash_table_contains (grammar->pairs, &p2);
+      closers = g_new0 (struct smie_bitset_t, 1);
+      g_ptr_array_index (grammar->pairs, opener_symbol->id) = closers;
     }
+
+  if (!smie_bitset_add (closers, closer_symbol->id))
+    return FALSE;
+
+  smie_bitset_add (&grammar->ends, closer_symbol->id);
+  return TRUE;
+}
+
+/**
+ * smie_grammar_has_pair:
+ * @grammar: a #smie_grammar_t object
+ * @opener_symbol: an opener #smie_symbol_t object
+ * @closer_symbol: a closer #smie_symbol_t object
+ *
+ * Check if @opener_symbol and @closer_symbol form a pair.
+ * Returns: %TRUE if they do, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_has_pair (smie_grammar_t *grammar,
+		       const smie_symbol_t *opener_symbol,
+		       const smie_symbol_t *closer_symbol)
+{
+  const struct smie_bitset_t *closers;
+
+  if (opener_symbol->id >= grammar->pairs->len)
+    return FALSE;
+
+  closers = g_ptr_array_index (grammar->pairs, opener_symbol->id);
+  return closers && smie_bitset_contains (closers, closer_symbol->id);
 }
 
 /**
@@ -1489,8 +1879,104 @@ gboolean
 smie_grammar_is_pair_end (smie_grammar_t *grammar,
 			  const smie_symbol_t *closer_symbol)
 {
-  return grammar->ends
-    && g_hash_table_contains (grammar->ends, (gpointer) closer_symbol);
+  return smie_bitset_contains (&grammar->ends, closer_symbol->id);
+}
+
+struct smie_grammar_closer_real_iter_t
+{
+  smie_grammar_t *grammar;
+  const struct smie_bitset_t *closers;
+  gint position;
+};
+
+G_STATIC_ASSERT (sizeof (struct smie_grammar_closer_real_iter_t)
+		 <= sizeof (smie_grammar_closer_iter_t));
+
+/**
+ * smie_grammar_closer_iter_init:
+ * @iter: an uninitialized #smie_grammar_closer_iter_t
+ * @grammar: a #smie_grammar_t object
+ * @opener_symbol: an opener #smie_symbol_t object
+ *
+ * Initialize @iter to enumerate the closers paired with
+ * @opener_symbol.  @grammar must not be modified during the
+ * iteration.
+ *
+ * |[
+ * smie_grammar_closer_iter_t iter;
+ * const smie_symbol_t *closer;
+ *
+ * smie_grammar_closer_iter_init (&iter, grammar, opener);
+ * while (smie_grammar_closer_iter_next (&iter, &closer))
+ *   {
+ *     // do something with closer
+ *   }
+ * ]|
+ */
+void
+smie_grammar_closer_iter_init (smie_grammar_closer_iter_t *iter,
+			       smie_grammar_t *grammar,
+			       const smie_symbol_t *opener_symbol)
+{
+  struct smie_grammar_closer_real_iter_t *ri
+    = (struct smie_grammar_closer_real_iter_t *) iter;
+
+  g_return_if_fail (iter);
+  g_return_if_fail (grammar);
+  g_return_if_fail (opener_symbol);
+
+  ri->grammar = grammar;
+  ri->closers = opener_symbol->id < grammar->pairs->len
+    ? g_ptr_array_index (grammar->pairs, opener_symbol->id)
+    : NULL;
+  ri->position = -1;
+}
+
+/**
+ * smie_grammar_closer_iter_next:
+ * @iter: a #smie_grammar_closer_iter_t
+ * @closer_symbol: (out) (optional): return location of a closer
+ *
+ * Advance @iter to the next closer.
+ * Returns: %FALSE if there are no more closers, %TRUE otherwise
+ */
+gboolean
+smie_grammar_closer_iter_next (smie_grammar_closer_iter_t *iter,
+			       const smie_symbol_t **closer_symbol)
+{
+  struct smie_grammar_closer_real_iter_t *ri
+    = (struct smie_grammar_closer_real_iter_t *) iter;
+  guint position, index;
+
+  g_return_val_if_fail (iter, FALSE);
+
+  if (!ri->closers)
+    return FALSE;
+
+  position = ri->position + 1;
+  for (index = position / SMIE_BITSET_WORD_BITS;
+       index < ri->closers->n_words;
+       index++)
+    {
+      gint bit;
+
+      if (index == position / SMIE_BITSET_WORD_BITS)
+	bit = g_bit_nth_lsf (ri->closers->words[index],
+			     (gint) (position % SMIE_BITSET_WORD_BITS) - 1);
+      else
+	bit = g_bit_nth_lsf (ri->closers->words[index], -1);
+      if (bit >= 0)
+	{
+	  ri->position = index * SMIE_BITSET_WORD_BITS + bit;
+	  if (closer_symbol)
+	    *closer_symbol = g_ptr_array_index (ri->grammar->pool->symbols,
+						ri->position);
+	  return TRUE;
+	}
+    }
+
+  ri->closers = NULL;
+  return FALSE;
 }
 
 /**
@@ -1544,24 +2030,201 @@ smie_grammar_get_right_prec (smie_grammar_t *grammar,
   return level->right_prec;
 }
 
-typedef gboolean (*smie_select_function_t) (struct smie_level_t *, gint *);
+/**
+ * smie_grammar_get_basic_offset:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Get the basic indentation step given in the %rules section of the
+ * grammar.
+ * Returns: the basic indentation step, or -1 if unspecified
+ */
+gint
+smie_grammar_get_basic_offset (smie_grammar_t *grammar)
+{
+  return grammar->basic;
+}
 
-static gboolean
-smie_select_left (struct smie_level_t *level, gint *precp)
+/**
+ * smie_grammar_set_basic_offset:
+ * @grammar: a #smie_grammar_t object
+ * @offset: the basic indentation step, or -1
+ *
+ * Set the basic indentation step.  See
+ * smie_grammar_get_basic_offset().
+ */
+void
+smie_grammar_set_basic_offset (smie_grammar_t *grammar, gint offset)
 {
-  *precp = level->left_prec;
-  return level->symbol_class == SMIE_SYMBOL_CLASS_OPENER;
+  grammar->basic = offset;
 }
 
-static gboolean
-smie_select_right (struct smie_level_t *level, gint *precp)
+static gint
+smie_grammar_get_offset (GArray *offsets, const smie_symbol_t *symbol)
+{
+  return symbol->id < offsets->len
+    ? g_array_index (offsets, gint, symbol->id)
+    : -1;
+}
+
+static void
+smie_grammar_set_offset (GArray *offsets,
+			 const smie_symbol_t *symbol,
+			 gint offset)
+{
+  while (offsets->len <= symbol->id)
+    {
+      gint undetermined = -1;
+      g_array_append_val (offsets, undetermined);
+    }
+  g_array_index (offsets, gint, symbol->id) = offset;
+}
+
+/**
+ * smie_grammar_get_before_offset:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Get the offset to use to indent @symbol itself, given with
+ * "before" in the %rules section of the grammar.
+ * Returns: the offset, or -1 if undetermined
+ */
+gint
+smie_grammar_get_before_offset (smie_grammar_t *grammar,
+				const smie_symbol_t *symbol)
+{
+  return smie_grammar_get_offset (grammar->before, symbol);
+}
+
+/**
+ * smie_grammar_set_before_offset:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ * @offset: the offset, or -1
+ *
+ * Set the offset to use to indent @symbol itself.  @symbol must
+ * belong to the symbol pool of @grammar.
+ */
+void
+smie_grammar_set_before_offset (smie_grammar_t *grammar,
+				const smie_symbol_t *symbol,
+				gint offset)
+{
+  smie_grammar_set_offset (grammar->before, symbol, offset);
+}
+
+/**
+ * smie_grammar_get_after_offset:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Get the offset to use for indentation after @symbol, given with
+ * "after" in the %rules section of the grammar.
+ * Returns: the offset, or -1 if undetermined
+ */
+gint
+smie_grammar_get_after_offset (smie_grammar_t *grammar,
+			       const smie_symbol_t *symbol)
+{
+  return smie_grammar_get_offset (grammar->after, symbol);
+}
+
+/**
+ * smie_grammar_set_after_offset:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ * @offset: the offset, or -1
+ *
+ * Set the offset to use for indentation after @symbol.  @symbol must
+ * belong to the symbol pool of @grammar.
+ */
+void
+smie_grammar_set_after_offset (smie_grammar_t *grammar,
+			       const smie_symbol_t *symbol,
+			       gint offset)
+{
+  smie_grammar_set_offset (grammar->after, symbol, offset);
+}
+
+/**
+ * smie_grammar_is_list_intro:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Check if @symbol is followed by a list of expressions, as given with
+ * "list-intro" in the %rules section of the grammar.
+ * Returns: %TRUE if @symbol introduces a list, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_is_list_intro (smie_grammar_t *grammar,
+			    const smie_symbol_t *symbol)
+{
+  return smie_bitset_contains (&grammar->list_intros, symbol->id);
+}
+
+/**
+ * smie_grammar_add_list_intro:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Mark @symbol as followed by a list of expressions.  See
+ * smie_grammar_is_list_intro().
+ * Returns: %TRUE if @symbol is not marked already, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_add_list_intro (smie_grammar_t *grammar,
+			     const smie_symbol_t *symbol)
+{
+  return smie_bitset_add (&grammar->list_intros, symbol->id);
+}
+
+/**
+ * smie_grammar_is_close_all:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Check if @symbol should be aligned with the opener of the last
+ * closer on the same line, as given with "close-all" in the %rules
+ * section of the grammar.
+ * Returns: %TRUE if @symbol closes all, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_is_close_all (smie_grammar_t *grammar,
+			   const smie_symbol_t *symbol)
+{
+  return smie_bitset_contains (&grammar->close_alls, symbol->id);
+}
+
+/**
+ * smie_grammar_add_close_all:
+ * @grammar: a #smie_grammar_t object
+ * @symbol: a #smie_symbol_t object
+ *
+ * Mark @symbol as closing all.  See smie_grammar_is_close_all().
+ * Returns: %TRUE if @symbol is not marked already, %FALSE otherwise.
+ */
+gboolean
+smie_grammar_add_close_all (smie_grammar_t *grammar,
+			    const smie_symbol_t *symbol)
+{
+  return smie_bitset_add (&grammar->close_alls, symbol->id);
+}
+
+static gboolean
+smie_select_left (const struct smie_level_t *level, gint *precp)
+{
+  *precp = level->left_prec;
+  return level->symbol_class == SMIE_SYMBOL_CLASS_OPENER;
+}
+
+static gboolean
+smie_select_right (const struct smie_level_t *level, gint *precp)
 {
   *precp = level->right_prec;
   return level->symbol_class == SMIE_SYMBOL_CLASS_CLOSER;
 }
 
 static gboolean
-smie_is_associative (struct smie_level_t *level)
+smie_is_associative (const struct smie_level_t *level)
 {
   gint prec_value, prec_value2;
   smie_select_left (level, &prec_value);
@@ -1569,80 +2232,353 @@ smie_is_associative (struct smie_level_t *level)
   return prec_value == prec_value2;
 }
 
+static void
+smie_level_stack_init (struct smie_level_stack_t *stack)
+{
+  stack->levels = stack->inline_levels;
+  stack->length = 0;
+  stack->allocated = SMIE_LEVEL_STACK_INLINE_SIZE;
+}
+
+static void
+smie_level_stack_clear (struct smie_level_stack_t *stack)
+{
+  if (stack->levels != stack->inline_levels)
+    g_free (stack->levels);
+  smie_level_stack_init (stack);
+}
+
+static void
+smie_level_stack_push (struct smie_level_stack_t *stack,
+		       const struct smie_level_t *level)
+{
+  if (stack->length == stack->allocated)
+    {
+      gsize allocated = stack->allocated * 2;
+      if (stack->levels == stack->inline_levels)
+	{
+	  stack->levels = g_new (const struct smie_level_t *, allocated);
+	  memcpy (stack->levels, stack->inline_levels,
+		  stack->length * sizeof (const struct smie_level_t *));
+	}
+      else
+	stack->levels = g_renew (const struct smie_level_t *, stack->levels,
+				 allocated);
+      stack->allocated = allocated;
+    }
+  stack->levels[stack->length++] = level;
+}
+
+static const struct smie_level_t *
+smie_level_stack_peek (struct smie_level_stack_t *stack)
+{
+  return stack->length > 0 ? stack->levels[stack->length - 1] : NULL;
+}
+
+static void
+smie_level_stack_pop (struct smie_level_stack_t *stack)
+{
+  g_assert (stack->length > 0);
+  stack->length--;
+}
+
+/* Tokens shorter than this are looked up without allocation, when
+   read as slices.  */
+#define SMIE_TOKEN_BUFFER_SIZE 64
+
+/* Source of tokens for smie_next_sexp, which is either of the two
+   callback types.  If GET_OFFSET is set, OFFSET tracks the position
+   just before the last token read, in buffer order.  */
+struct smie_token_reader_t
+{
+  smie_next_token_function_t next_token;
+  smie_next_token_slice_function_t next_token_slice;
+  smie_get_offset_function_t get_offset;
+  gboolean backward;
+  gpointer context;
+  gint offset;
+  smie_scan_budget_t *budget;
+};
+
+/* Reading the clock for each token would be noticeable in the scan
+   loop; check the deadline only once in a while.  */
+#define SMIE_SCAN_BUDGET_CLOCK_INTERVAL 64
+
+/**
+ * smie_scan_budget_consume:
+ * @budget: a #smie_scan_budget_t
+ *
+ * Account for reading a token, for code which reads tokens itself
+ * rather than through the bounded scans.  Once @budget has run out,
+ * @budget->exhausted is set.
+ * Returns: %FALSE if @budget has run out
+ */
+gboolean
+smie_scan_budget_consume (smie_scan_budget_t *budget)
+{
+  g_return_val_if_fail (budget, FALSE);
+
+  if (budget->exhausted)
+    return FALSE;
+
+  if ((budget->max_tokens > 0 && budget->n_tokens >= budget->max_tokens)
+      || (budget->deadline > 0
+	  && budget->n_tokens % SMIE_SCAN_BUDGET_CLOCK_INTERVAL == 0
+	  && g_get_monotonic_time () >= budget->deadline)
+      || (budget->cancellable
+	  && g_cancellable_is_cancelled (budget->cancellable)))
+    {
+      budget->exhausted = TRUE;
+      return FALSE;
+    }
+
+  budget->n_tokens++;
+  return TRUE;
+}
+
 static gboolean
-smie_next_sexp (smie_grammar_t *grammar,
-		smie_next_token_function_t next_token_func,
-		const smie_symbol_t *read_symbol,
-		gpointer context,
-		smie_select_function_t op_forward,
-		smie_select_function_t op_backward)
+smie_token_reader_lookup (smie_grammar_t *grammar,
+			  const gchar *name,
+			  const smie_symbol_t **symbolp,
+			  const struct smie_level_t **levelp)
+{
+  smie_symbol_t symbol;
+
+  symbol.name = (gchar *) name;
+  symbol.type = SMIE_SYMBOL_TERMINAL;
+  return g_hash_table_lookup_extended (grammar->levels, &symbol,
+				       (gpointer *) symbolp,
+				       (gpointer *) levelp);
+}
+
+/* Read the next token and look up its symbol and precedence level,
+   storing them (or %NULL if it is not a keyword) in SYMBOLP and
+   LEVELP.  Return %FALSE at the end of buffer or when the budget of
+   READER has run out.  */
+static gboolean
+smie_token_reader_next_level (struct smie_token_reader_t *reader,
+			      smie_grammar_t *grammar,
+			      const smie_symbol_t **symbolp,
+			      const struct smie_level_t **levelp)
+{
+  if (reader->budget && !smie_scan_budget_consume (reader->budget))
+    return FALSE;
+
+  if (reader->get_offset && !reader->backward)
+    reader->offset = reader->get_offset (reader->context);
+
+  *symbolp = NULL;
+  *levelp = NULL;
+  if (reader->next_token_slice)
+    {
+      gchar buffer[SMIE_TOKEN_BUFFER_SIZE];
+      const gchar *token;
+      gsize length;
+
+      if (!reader->next_token_slice (reader->context, &token, &length))
+	return FALSE;
+
+      if (length < sizeof (buffer))
+	{
+	  memcpy (buffer, token, length);
+	  buffer[length] = '\0';
+	  smie_token_reader_lookup (grammar, buffer, symbolp, levelp);
+	}
+      else
+	{
+	  gchar *name = g_strndup (token, length);
+	  smie_token_reader_lookup (grammar, name, symbolp, levelp);
+	  g_free (name);
+	}
+    }
+  else
+    {
+      gchar *name = reader->next_token (reader->context);
+      if (!name)
+	return FALSE;
+      smie_token_reader_lookup (grammar, name, symbolp, levelp);
+      g_free (name);
+    }
+
+  if (reader->get_offset && reader->backward)
+    reader->offset = reader->get_offset (reader->context);
+  return TRUE;
+}
+
+static void
+smie_sexp_state_init (struct smie_sexp_state_t *state,
+		      smie_grammar_t *grammar,
+		      const smie_symbol_t *read_symbol,
+		      smie_select_function_t op_forward,
+		      smie_select_function_t op_backward)
 {
-  gchar *token;
-  GList *stack = NULL;
+  state->op_forward = op_forward;
+  state->op_backward = op_backward;
+  state->backward = op_forward == smie_select_left;
+  state->bottom = NULL;
+  smie_level_stack_init (&state->stack);
 
   if (read_symbol)
     {
-      struct smie_level_t *level;
-      level = g_hash_table_lookup (grammar->levels, read_symbol);
+      const struct smie_level_t *level
+	= g_hash_table_lookup (grammar->levels, read_symbol);
       if (level)
-	stack = g_list_prepend (stack, level);
+	smie_level_stack_push (&state->stack, level);
     }
+}
 
-  while ((token = next_token_func (context)) != NULL)
+/* Check if LEVEL, read by a scan in the given direction, cannot be
+   inside the operand of LEVEL2, the innermost keyword pending.  */
+static gboolean
+smie_level_is_outside (const struct smie_level_t *level,
+		       const struct smie_level_t *level2,
+		       gboolean backward)
+{
+  return SMIE_ZONES_DISJOINT (level->zones.zones,
+			      backward
+			      ? level2->zones.left_zones
+			      : level2->zones.right_zones);
+}
+
+/* Same as smie_level_is_outside() for LEVEL2 at the top of the stack
+   of STATE.  */
+static gboolean
+smie_sexp_state_is_outside (struct smie_sexp_state_t *state,
+			    const struct smie_level_t *level,
+			    const struct smie_level_t *level2)
+{
+  if (state->stack.length == 1 && state->bottom)
+    level2 = state->bottom;
+  return smie_level_is_outside (level, level2, state->backward);
+}
+
+static void
+smie_sexp_state_clear (struct smie_sexp_state_t *state)
+{
+  smie_level_stack_clear (&state->stack);
+}
+
+/* Feed the level of a keyword to the scan.  Return %TRUE if the
+   keyword ends the S-expression, in which case RESULTP tells whether
+   we skipped a paren-like pair and PAIREDP whether the keyword closed
+   it as the other end of a pair.
+
+   A keyword which cannot be inside the operand of the innermost
+   keyword pending also ends the S-expression, since the construct
+   around that keyword cannot extend beyond it.  */
+static gboolean
+smie_sexp_state_step (struct smie_sexp_state_t *state,
+		      const struct smie_level_t *level,
+		      gboolean *resultp,
+		      gboolean *pairedp)
+{
+  smie_select_function_t op_forward = state->op_forward;
+  smie_select_function_t op_backward = state->op_backward;
+  struct smie_level_stack_t *stack = &state->stack;
+  const struct smie_level_t *level2;
+  gint prec_value, prec_value2;
+
+  *resultp = FALSE;
+  *pairedp = FALSE;
+
+  if (op_backward (level, &prec_value))
     {
-      smie_symbol_t symbol;
-      struct smie_level_t *level;
-      gint prec_value;
-
-      symbol.name = token;
-      symbol.type = SMIE_SYMBOL_TERMINAL;
-      level = g_hash_table_lookup (grammar->levels, &symbol);
-      g_free (token);
-      if (!level)
-	continue;
-      else if (op_backward (level, &prec_value))
-	stack = g_list_prepend (stack, level);
-      else
+      level2 = smie_level_stack_peek (stack);
+      if (level2)
 	{
-	  while (stack)
-	    {
-	      struct smie_level_t *level2 = stack->data;
-	      gint prec_value2;
-	      op_forward (level, &prec_value);
-	      op_backward (level2, &prec_value2);
-	      if (prec_value >= prec_value2)
-		break;
-	      stack = g_list_delete_link (stack, stack);
-	    }
-	  if (!stack)
+	  op_forward (level, &prec_value);
+	  op_backward (level2, &prec_value2);
+	  if (prec_value != prec_value2
+	      && smie_sexp_state_is_outside (state, level, level2))
 	    return TRUE;
-	  else
+	}
+      else
+	state->bottom = NULL;
+      smie_level_stack_push (stack, level);
+      return FALSE;
+    }
+
+  while ((level2 = smie_level_stack_peek (stack)) != NULL)
+    {
+      op_forward (level, &prec_value);
+      op_backward (level2, &prec_value2);
+      if (prec_value >= prec_value2)
+	break;
+      smie_level_stack_pop (stack);
+    }
+  if (!level2)
+    {
+      *resultp = TRUE;
+      return TRUE;
+    }
+
+  op_forward (level, &prec_value);
+  op_backward (level2, &prec_value2);
+  if (prec_value == prec_value2)
+    smie_level_stack_pop (stack);
+  else if (smie_sexp_state_is_outside (state, level, level2))
+    return TRUE;
+  if (stack->length > 0)
+    {
+      if (!op_forward (level, &prec_value))
+	smie_level_stack_push (stack, level);
+    }
+  else if (op_forward (level, &prec_value))
+    {
+      *resultp = TRUE;
+      *pairedp = TRUE;
+      return TRUE;
+    }
+  else if (!smie_is_associative (level))
+    {
+      smie_level_stack_push (stack, level);
+      state->bottom = NULL;
+    }
+  else if (smie_is_associative (level2))
+    return TRUE;
+  else
+    {
+      smie_level_stack_push (stack, level2);
+      state->bottom = level;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+smie_next_sexp (smie_grammar_t *grammar,
+		struct smie_token_reader_t *reader,
+		const smie_symbol_t *read_symbol,
+		smie_select_function_t op_forward,
+		smie_select_function_t op_backward,
+		smie_sexp_result_t *sexp_result)
+{
+  const smie_symbol_t *symbol;
+  const struct smie_level_t *level;
+  struct smie_sexp_state_t state;
+  gboolean result = FALSE, paired;
+
+  smie_sexp_state_init (&state, grammar, read_symbol,
+			op_forward, op_backward);
+  if (sexp_result)
+    memset (sexp_result, 0, sizeof (smie_sexp_result_t));
+
+  while (smie_token_reader_next_level (reader, grammar, &symbol, &level))
+    {
+      if (level && smie_sexp_state_step (&state, level, &result, &paired))
+	{
+	  if (sexp_result)
 	    {
-	      struct smie_level_t *level2 = stack->data;
-	      gint prec_value2;
-	      op_forward (level, &prec_value);
-	      op_backward (level2, &prec_value2);
-	      if (prec_value == prec_value2)
-		stack = g_list_delete_link (stack, stack);
-	      if (stack)
-		{
-		  if (!op_forward (level, &prec_value))
-		    stack = g_list_prepend (stack, level);
-		}
-	      else if (op_forward (level, &prec_value))
-		return TRUE;
-	      else if (!smie_is_associative (level))
-		stack = g_list_prepend (NULL, level);
-	      else if (smie_is_associative (level2))
-		return FALSE;
-	      else
-		stack = g_list_prepend (NULL, level2);
+	      sexp_result->symbol = symbol;
+	      sexp_result->offset = reader->offset;
+	      sexp_result->paired = paired;
 	    }
+	  break;
 	}
     }
 
-  g_list_free (stack);
-  return FALSE;
+  smie_sexp_state_clear (&state);
+  return result;
 }
 
 /**
@@ -1663,12 +2599,11 @@ smie_forward_sexp (smie_grammar_t *grammar,
 		   const smie_symbol_t *symbol,
 		   gpointer context)
 {
-  return smie_next_sexp (grammar,
-			 next_token_func,
-			 symbol,
-			 context,
-			 smie_select_right,
-			 smie_select_left);
+  struct smie_token_reader_t reader = { next_token_func, NULL, NULL,
+					FALSE, context, 0, NULL };
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_right, smie_select_left, NULL);
 }
 
 /**
@@ -1689,12 +2624,61 @@ smie_backward_sexp (smie_grammar_t *grammar,
 		    const smie_symbol_t *symbol,
 		    gpointer context)
 {
-  return smie_next_sexp (grammar,
-			 next_token_func,
-			 symbol,
-			 context,
-			 smie_select_left,
-			 smie_select_right);
+  struct smie_token_reader_t reader = { next_token_func, NULL, NULL,
+					FALSE, context, 0, NULL };
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_left, smie_select_right, NULL);
+}
+
+/**
+ * smie_forward_sexp_slice:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_slice_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: the context pointer
+ *
+ * Same as smie_forward_sexp(), but read tokens as borrowed slices.
+ * This does not allocate memory unless the nesting is deep or a token
+ * is very long.
+ *
+ * Returns: %TRUE if we skipped a paren-like pair, %FALSE otherwise.
+ */
+gboolean
+smie_forward_sexp_slice (smie_grammar_t *grammar,
+			 smie_next_token_slice_function_t next_token_func,
+			 const smie_symbol_t *symbol,
+			 gpointer context)
+{
+  struct smie_token_reader_t reader = { NULL, next_token_func, NULL,
+					FALSE, context, 0, NULL };
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_right, smie_select_left, NULL);
+}
+
+/**
+ * smie_backward_sexp_slice:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_slice_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: a context pointer
+ *
+ * Same as smie_backward_sexp(), but read tokens as borrowed slices.
+ *
+ * Returns: %TRUE if we skipped a paren-like pair, %FALSE otherwise
+ */
+gboolean
+smie_backward_sexp_slice (smie_grammar_t *grammar,
+			  smie_next_token_slice_function_t next_token_func,
+			  const smie_symbol_t *symbol,
+			  gpointer context)
+{
+  struct smie_token_reader_t reader = { NULL, next_token_func, NULL,
+					FALSE, context, 0, NULL };
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_left, smie_select_right, NULL);
 }
 
 /**
@@ -1708,3 +2692,587 @@ smie_error_quark (void)
 {
   return g_quark_from_static_string ("smie-error-quark");
 }
+
+/**
+ * smie_forward_sexp_full:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_function_t function
+ * @get_offset_func: a #smie_get_offset_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: the context pointer
+ * @result: (out caller-allocates): return location of the result
+ *
+ * Same as smie_forward_sexp(), but also report in @result the
+ * keyword the scan stopped at, so that the caller need not read it
+ * again.
+ *
+ * Returns: %TRUE if we skipped a paren-like pair, %FALSE otherwise.
+ */
+gboolean
+smie_forward_sexp_full (smie_grammar_t *grammar,
+			smie_next_token_function_t next_token_func,
+			smie_get_offset_function_t get_offset_func,
+			const smie_symbol_t *symbol,
+			gpointer context,
+			smie_sexp_result_t *result)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, FALSE, context, 0,
+					NULL };
+
+  g_return_val_if_fail (result, FALSE);
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_right, smie_select_left, result);
+}
+
+/**
+ * smie_backward_sexp_full:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_function_t function
+ * @get_offset_func: a #smie_get_offset_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: a context pointer
+ * @result: (out caller-allocates): return location of the result
+ *
+ * Same as smie_backward_sexp(), but also report in @result the
+ * keyword the scan stopped at.  The cursor is then placed just before
+ * that keyword, at @result->offset.
+ *
+ * Returns: %TRUE if we skipped a paren-like pair, %FALSE otherwise
+ */
+gboolean
+smie_backward_sexp_full (smie_grammar_t *grammar,
+			 smie_next_token_function_t next_token_func,
+			 smie_get_offset_function_t get_offset_func,
+			 const smie_symbol_t *symbol,
+			 gpointer context,
+			 smie_sexp_result_t *result)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, TRUE, context, 0,
+					NULL };
+
+  g_return_val_if_fail (result, FALSE);
+
+  return smie_next_sexp (grammar, &reader, symbol,
+			 smie_select_left, smie_select_right, result);
+}
+
+/**
+ * smie_scan_budget_init:
+ * @budget: a #smie_scan_budget_t
+ * @max_tokens: the maximum number of tokens to read, or 0
+ * @deadline: the monotonic time at which to give up, or 0
+ *
+ * Initialize @budget, to be passed to smie_forward_sexp_bounded(),
+ * smie_backward_sexp_bounded() or smie_indenter_calculate_bounded().
+ * @deadline is compared with g_get_monotonic_time().  A budget may be
+ * shared by several scans, in which case the limits apply to all of
+ * them together.
+ */
+void
+smie_scan_budget_init (smie_scan_budget_t *budget,
+		       guint max_tokens,
+		       gint64 deadline)
+{
+  g_return_if_fail (budget);
+
+  budget->max_tokens = max_tokens;
+  budget->deadline = deadline;
+  budget->n_tokens = 0;
+  budget->exhausted = FALSE;
+  budget->cancellable = NULL;
+}
+
+static smie_sexp_status_t
+smie_next_sexp_bounded (smie_grammar_t *grammar,
+			struct smie_token_reader_t *reader,
+			const smie_symbol_t *read_symbol,
+			smie_select_function_t op_forward,
+			smie_select_function_t op_backward,
+			smie_sexp_result_t *sexp_result)
+{
+  gboolean paired;
+
+  paired = smie_next_sexp (grammar, reader, read_symbol,
+			   op_forward, op_backward, sexp_result);
+  if (reader->budget->exhausted)
+    {
+      if (sexp_result)
+	memset (sexp_result, 0, sizeof (smie_sexp_result_t));
+      return SMIE_SEXP_STATUS_GAVE_UP;
+    }
+  return paired ? SMIE_SEXP_STATUS_PAIRED : SMIE_SEXP_STATUS_SKIPPED;
+}
+
+/**
+ * smie_forward_sexp_bounded:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_function_t function
+ * @get_offset_func: (nullable): a #smie_get_offset_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: the context pointer
+ * @budget: a #smie_scan_budget_t
+ * @result: (out caller-allocates) (optional): return location of the
+ *   result, which requires @get_offset_func
+ *
+ * Same as smie_forward_sexp_full(), but read at most as many tokens
+ * as @budget allows.  If the budget runs out, the cursor is left
+ * where the scan stopped, which is not meaningful.
+ *
+ * Returns: %SMIE_SEXP_STATUS_GAVE_UP if @budget ran out, otherwise
+ *   whether we skipped a paren-like pair
+ */
+smie_sexp_status_t
+smie_forward_sexp_bounded (smie_grammar_t *grammar,
+			   smie_next_token_function_t next_token_func,
+			   smie_get_offset_function_t get_offset_func,
+			   const smie_symbol_t *symbol,
+			   gpointer context,
+			   smie_scan_budget_t *budget,
+			   smie_sexp_result_t *result)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, FALSE, context, 0,
+					budget };
+
+  g_return_val_if_fail (budget, SMIE_SEXP_STATUS_GAVE_UP);
+  g_return_val_if_fail (!result || get_offset_func,
+			SMIE_SEXP_STATUS_GAVE_UP);
+
+  return smie_next_sexp_bounded (grammar, &reader, symbol,
+				 smie_select_right, smie_select_left,
+				 result);
+}
+
+/**
+ * smie_backward_sexp_bounded:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_function_t function
+ * @get_offset_func: (nullable): a #smie_get_offset_function_t function
+ * @symbol: (nullable): a #smie_symbol_t object
+ * @context: the context pointer
+ * @budget: a #smie_scan_budget_t
+ * @result: (out caller-allocates) (optional): return location of the
+ *   result, which requires @get_offset_func
+ *
+ * Same as smie_backward_sexp_full(), but read at most as many tokens
+ * as @budget allows.
+ *
+ * Returns: %SMIE_SEXP_STATUS_GAVE_UP if @budget ran out, otherwise
+ *   whether we skipped a paren-like pair
+ */
+smie_sexp_status_t
+smie_backward_sexp_bounded (smie_grammar_t *grammar,
+			    smie_next_token_function_t next_token_func,
+			    smie_get_offset_function_t get_offset_func,
+			    const smie_symbol_t *symbol,
+			    gpointer context,
+			    smie_scan_budget_t *budget,
+			    smie_sexp_result_t *result)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, TRUE, context, 0,
+					budget };
+
+  g_return_val_if_fail (budget, SMIE_SEXP_STATUS_GAVE_UP);
+  g_return_val_if_fail (!result || get_offset_func,
+			SMIE_SEXP_STATUS_GAVE_UP);
+
+  return smie_next_sexp_bounded (grammar, &reader, symbol,
+				 smie_select_left, smie_select_right,
+				 result);
+}
+
+/**
+ * smie_sexp_scanner_new:
+ * @grammar: a #smie_grammar_t object
+ * @backward: %TRUE to skip backward
+ * @symbol: (nullable): a #smie_symbol_t object
+ *
+ * Create a scanner which skips an S-expression in several steps, for
+ * example from an idle handler, so that matching keywords far apart
+ * never blocks the main loop for long.  @symbol has the same meaning
+ * as in smie_forward_sexp().  Drive the scan with
+ * smie_sexp_scanner_run().
+ * Returns: a new #smie_sexp_scanner_t object
+ */
+smie_sexp_scanner_t *
+smie_sexp_scanner_new (smie_grammar_t *grammar,
+		       gboolean backward,
+		       const smie_symbol_t *symbol)
+{
+  smie_sexp_scanner_t *result;
+
+  g_return_val_if_fail (grammar, NULL);
+
+  result = g_new0 (smie_sexp_scanner_t, 1);
+  result->grammar = smie_grammar_ref (grammar);
+  result->backward = backward;
+  result->offset = -1;
+  if (backward)
+    smie_sexp_state_init (&result->state, grammar, symbol,
+			  smie_select_left, smie_select_right);
+  else
+    smie_sexp_state_init (&result->state, grammar, symbol,
+			  smie_select_right, smie_select_left);
+  return result;
+}
+
+/**
+ * smie_sexp_scanner_free:
+ * @scanner: a #smie_sexp_scanner_t object
+ *
+ * Free the memory allocated for @scanner.
+ */
+void
+smie_sexp_scanner_free (smie_sexp_scanner_t *scanner)
+{
+  g_return_if_fail (scanner);
+
+  smie_sexp_state_clear (&scanner->state);
+  smie_grammar_unref (scanner->grammar);
+  g_free (scanner);
+}
+
+/**
+ * smie_sexp_scanner_run:
+ * @scanner: a #smie_sexp_scanner_t object
+ * @next_token_func: a #smie_next_token_function_t function, moving in
+ *   the direction of @scanner
+ * @get_offset_func: a #smie_get_offset_function_t function
+ * @context: the context pointer
+ * @budget: (nullable): a #smie_scan_budget_t
+ * @result: (out caller-allocates) (optional): return location of the
+ *   result
+ *
+ * Continue the scan from the cursor until the end of the
+ * S-expression, or until @budget runs out.  In the latter case,
+ * %SMIE_SEXP_STATUS_GAVE_UP is returned and the scan can be resumed by
+ * calling this function again with a new budget, after placing the
+ * cursor at smie_sexp_scanner_get_offset().  The buffer must not be
+ * modified in between.
+ *
+ * Once the scan is complete, further calls return the same status
+ * and result without reading tokens.
+ * Returns: the status of the scan
+ */
+smie_sexp_status_t
+smie_sexp_scanner_run (smie_sexp_scanner_t *scanner,
+		       smie_next_token_function_t next_token_func,
+		       smie_get_offset_function_t get_offset_func,
+		       gpointer context,
+		       smie_scan_budget_t *budget,
+		       smie_sexp_result_t *result)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, scanner->backward,
+					context, 0, budget };
+  const smie_symbol_t *symbol;
+  const struct smie_level_t *level;
+  gboolean paired;
+
+  g_return_val_if_fail (scanner, SMIE_SEXP_STATUS_GAVE_UP);
+  g_return_val_if_fail (get_offset_func, SMIE_SEXP_STATUS_GAVE_UP);
+
+  if (!scanner->finished)
+    {
+      scanner->status = SMIE_SEXP_STATUS_SKIPPED;
+      while (smie_token_reader_next_level (&reader, scanner->grammar,
+					   &symbol, &level))
+	{
+	  gboolean pair;
+
+	  if (level && smie_sexp_state_step (&scanner->state, level,
+					     &pair, &paired))
+	    {
+	      if (pair)
+		scanner->status = SMIE_SEXP_STATUS_PAIRED;
+	      scanner->result.symbol = symbol;
+	      scanner->result.offset = reader.offset;
+	      scanner->result.paired = paired;
+	      break;
+	    }
+	}
+
+      scanner->offset = get_offset_func (context);
+      if (budget && budget->exhausted)
+	{
+	  if (result)
+	    memset (result, 0, sizeof (smie_sexp_result_t));
+	  return SMIE_SEXP_STATUS_GAVE_UP;
+	}
+
+      scanner->finished = TRUE;
+      smie_sexp_state_clear (&scanner->state);
+    }
+
+  if (result)
+    *result = scanner->result;
+  return scanner->status;
+}
+
+/**
+ * smie_sexp_scanner_get_offset:
+ * @scanner: a #smie_sexp_scanner_t object
+ *
+ * Get the position where the last call to smie_sexp_scanner_run()
+ * stopped, which is where the scan resumes if it gave up, and the end
+ * of the S-expression otherwise.
+ * Returns: an offset, or -1 if the scan has not started
+ */
+gint
+smie_sexp_scanner_get_offset (smie_sexp_scanner_t *scanner)
+{
+  g_return_val_if_fail (scanner, -1);
+
+  return scanner->offset;
+}
+
+/* A query of smie_forward_sexp_batch() whose S-expression has not
+   ended yet.  The query only sees the entries of the shared stack
+   from FLOOR up, and the entry at FLOOR is replaced by BOTTOM if it is
+   not %NULL.  */
+struct smie_sexp_query_t
+{
+  gsize index;
+  gsize floor;
+  const struct smie_level_t *bottom;
+};
+
+/* Same as smie_sexp_state_step() for a forward scan, but only looking
+   at the part of STACK which belongs to QUERY.  If the keyword ends
+   the S-expression, STACK is left as the enclosing queries expect to
+   find it, so that they can be stepped with the same keyword.
+   OUTSIDEP tells that the keyword cannot be inside the innermost
+   keyword pending, which ends the enclosing queries as well, even if
+   QUERY goes on because the keyword is the first one it reads.  */
+static gboolean
+smie_sexp_query_step (struct smie_sexp_query_t *query,
+		      struct smie_level_stack_t *stack,
+		      const struct smie_level_t *level,
+		      gboolean *pairedp,
+		      gboolean *outsidep)
+{
+  const struct smie_level_t *level2 = NULL;
+  gint prec_value, prec_value2;
+
+  *pairedp = FALSE;
+  *outsidep = FALSE;
+
+  if (smie_select_left (level, &prec_value))
+    {
+      if (stack->length == query->floor)
+	{
+	  query->bottom = NULL;
+	  if (query->floor > 0)
+	    {
+	      level2 = stack->levels[query->floor - 1];
+	      smie_select_right (level, &prec_value);
+	      smie_select_left (level2, &prec_value2);
+	      *outsidep = prec_value != prec_value2
+		&& smie_level_is_outside (level, level2, FALSE);
+	    }
+	}
+      else
+	{
+	  level2 = stack->levels[stack->length - 1];
+	  smie_select_right (level, &prec_value);
+	  smie_select_left (stack->length - 1 == query->floor && query->bottom
+			    ? query->bottom
+			    : level2,
+			    &prec_value2);
+	  if (prec_value != prec_value2
+	      && smie_level_is_outside (level, level2, FALSE))
+	    goto outside;
+	}
+      smie_level_stack_push (stack, level);
+      return FALSE;
+    }
+
+  smie_select_right (level, &prec_value);
+  while (stack->length > query->floor)
+    {
+      level2 = stack->levels[stack->length - 1];
+      if (stack->length - 1 == query->floor && query->bottom)
+	level2 = query->bottom;
+      smie_select_left (level2, &prec_value2);
+      if (prec_value >= prec_value2)
+	break;
+      smie_level_stack_pop (stack);
+      level2 = NULL;
+    }
+  if (!level2)
+    return TRUE;
+
+  if (prec_value == prec_value2)
+    {
+      if (stack->length - 1 == query->floor)
+	{
+	  /* The keyword continues the outermost construct.  Unlike
+	     enclosing queries, we may keep LEVEL2 rather than LEVEL,
+	     which have the same precedence but differ in
+	     associativity.  */
+	  if (smie_select_right (level, &prec_value))
+	    {
+	      *pairedp = TRUE;
+	      return TRUE;
+	    }
+	  if (smie_is_associative (level) && smie_is_associative (level2))
+	    return TRUE;
+	  smie_level_stack_pop (stack);
+	  smie_level_stack_push (stack, level);
+	  query->bottom = smie_is_associative (level) ? level2 : NULL;
+	  return FALSE;
+	}
+      smie_level_stack_pop (stack);
+    }
+  else if (smie_level_is_outside (level, stack->levels[stack->length - 1],
+				  FALSE))
+    goto outside;
+  if (!smie_select_right (level, &prec_value))
+    smie_level_stack_push (stack, level);
+  return FALSE;
+
+ outside:
+  *outsidep = TRUE;
+  return TRUE;
+}
+
+/**
+ * smie_forward_sexp_batch:
+ * @grammar: a #smie_grammar_t object
+ * @next_token_func: a #smie_next_token_function_t function
+ * @get_offset_func: a #smie_get_offset_function_t function
+ * @context: the context pointer
+ * @offsets: (array length=n_offsets): start offsets, in ascending order
+ * @n_offsets: the length of @offsets
+ * @results: (array length=n_offsets) (out caller-allocates): return
+ *   location of the results
+ *
+ * Skip over an S-expression forward from each of @offsets, as
+ * smie_forward_sexp_full() does with a %NULL symbol, and store where
+ * each scan stopped in the corresponding element of @results.  If a
+ * scan reaches the end of buffer, the symbol of its result is %NULL
+ * and the offset is the end of buffer.
+ *
+ * The buffer is read only once, from the cursor, which must be at or
+ * before the first offset, and the scans share a single stack of
+ * precedence levels.  This is much cheaper than separate scans when
+ * there are many of them, for example one per keyword of the buffer.
+ * The offsets should be at token boundaries.
+ */
+void
+smie_forward_sexp_batch (smie_grammar_t *grammar,
+			 smie_next_token_function_t next_token_func,
+			 smie_get_offset_function_t get_offset_func,
+			 gpointer context,
+			 const gint *offsets,
+			 gsize n_offsets,
+			 smie_sexp_result_t *results)
+{
+  struct smie_token_reader_t reader = { next_token_func, NULL,
+					get_offset_func, FALSE, context, 0,
+					NULL };
+  struct smie_level_stack_t stack;
+  GArray *queries;
+  const smie_symbol_t *symbol;
+  const struct smie_level_t *level;
+  gsize i = 0, j;
+  gint offset;
+  gboolean paired, outside;
+
+  g_return_if_fail (grammar);
+  g_return_if_fail (next_token_func);
+  g_return_if_fail (get_offset_func);
+  g_return_if_fail (offsets || n_offsets == 0);
+  g_return_if_fail (results || n_offsets == 0);
+
+  smie_level_stack_init (&stack);
+  queries = g_array_new (FALSE, FALSE, sizeof (struct smie_sexp_query_t));
+
+  while ((i < n_offsets || queries->len > 0)
+	 && smie_token_reader_next_level (&reader, grammar, &symbol, &level))
+    {
+      /* Start the queries which include this token.  */
+      offset = get_offset_func (context);
+      for (; i < n_offsets && offsets[i] < offset; i++)
+	{
+	  struct smie_sexp_query_t query;
+
+	  query.index = i;
+	  query.floor = stack.length;
+	  query.bottom = NULL;
+	  g_array_append_val (queries, query);
+	}
+
+      if (!level)
+	continue;
+
+      /* Step the queries from the innermost one, until one of them
+	 goes on.  */
+      outside = FALSE;
+      while (queries->len > 0)
+	{
+	  struct smie_sexp_query_t *query
+	    = &g_array_index (queries, struct smie_sexp_query_t,
+			      queries->len - 1);
+
+	  if (!outside
+	      && !smie_sexp_query_step (query, &stack, level, &paired,
+					&outside))
+	    {
+	      /* End the queries which own the keyword pending.  */
+	      if (outside)
+		{
+		  for (j = 0; j < queries->len; j++)
+		    {
+		      struct smie_sexp_query_t *query1
+			= &g_array_index (queries, struct smie_sexp_query_t,
+					  j);
+		      if (query1->floor == query->floor)
+			break;
+		      results[query1->index].symbol = symbol;
+		      results[query1->index].offset
+			= MAX (reader.offset, offsets[query1->index]);
+		      results[query1->index].paired = FALSE;
+		    }
+		  g_array_remove_range (queries, 0, j);
+		}
+	      break;
+	    }
+
+	  results[query->index].symbol = symbol;
+	  results[query->index].offset = MAX (reader.offset,
+					      offsets[query->index]);
+	  results[query->index].paired = paired;
+	  g_array_set_size (queries, queries->len - 1);
+	}
+
+      /* Nothing below the outermost query is ever looked at.  */
+      if (queries->len == 0)
+	stack.length = 0;
+    }
+
+  /* The remaining scans reached the end of buffer.  */
+  offset = get_offset_func (context);
+  for (j = 0; j < queries->len; j++)
+    {
+      smie_sexp_result_t *result
+	= &results[g_array_index (queries, struct smie_sexp_query_t,
+				  j).index];
+      result->symbol = NULL;
+      result->offset = offset;
+      result->paired = FALSE;
+    }
+  for (; i < n_offsets; i++)
+    {
+      results[i].symbol = NULL;
+      results[i].offset = offset;
+      results[i].paired = FALSE;
+    }
+
+  g_array_free (queries, TRUE);
+  smie_level_stack_clear (&stack);
+}
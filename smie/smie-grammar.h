@@ -18,7 +18,7 @@
 #ifndef __SMIE_GRAMMAR_H__
 #define __SMIE_GRAMMAR_H__ 1
 
-#include <glib.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -64,6 +64,22 @@ typedef struct _smie_precs_grammar_t smie_precs_grammar_t;
  */
 typedef struct _smie_grammar_t smie_grammar_t;
 
+/**
+ * smie_grammar_closer_iter_t:
+ *
+ * An iterator over the closers paired with an opener.  The structure
+ * is opaque and should be allocated on the stack.
+ */
+typedef struct _smie_grammar_closer_iter_t smie_grammar_closer_iter_t;
+
+struct _smie_grammar_closer_iter_t
+{
+  /*< private >*/
+  gpointer dummy1;
+  gpointer dummy2;
+  gint dummy3;
+};
+
 /**
  * smie_symbol_type_t:
  * @SMIE_SYMBOL_TERMINAL: a terminal symbol
@@ -144,7 +160,8 @@ GQuark smie_error_quark (void);
 
 enum smie_error_code_t
   {
-    SMIE_ERROR_GRAMMAR
+    SMIE_ERROR_GRAMMAR,
+    SMIE_ERROR_FORMAT
   };
 
 smie_bnf_grammar_t *smie_bnf_grammar_alloc (smie_symbol_pool_t *pool);
@@ -177,6 +194,8 @@ smie_prec2_grammar_t *smie_prec2_grammar_load (const gchar *input,
 
 smie_grammar_t *smie_grammar_alloc (smie_symbol_pool_t *pool);
 void smie_grammar_free (smie_grammar_t *grammar);
+smie_grammar_t *smie_grammar_ref (smie_grammar_t *grammar);
+void smie_grammar_unref (smie_grammar_t *grammar);
 gboolean smie_grammar_add_level (smie_grammar_t *grammar,
 				 const smie_symbol_t *symbol,
 				 gint left_prec,
@@ -186,18 +205,48 @@ smie_symbol_class_t smie_grammar_get_symbol_class (smie_grammar_t *grammar,
 void smie_grammar_set_symbol_class (smie_grammar_t *grammar,
 				    const smie_symbol_t *symbol,
 				    smie_symbol_class_t symbol_class);
+gboolean smie_grammar_is_sync_token (smie_grammar_t *grammar,
+				     const smie_symbol_t *symbol);
 smie_symbol_pool_t *smie_grammar_get_symbol_pool (smie_grammar_t *grammar);
+gboolean smie_grammar_add_pair (smie_grammar_t *grammar,
+				const smie_symbol_t *opener_symbol,
+				const smie_symbol_t *closer_symbol);
 gboolean smie_grammar_has_pair (smie_grammar_t *grammar,
 				const smie_symbol_t *opener_symbol,
 				const smie_symbol_t *closer_symbol);
 gboolean smie_grammar_is_pair_end (smie_grammar_t *grammar,
 				   const smie_symbol_t *closer_symbol);
+void smie_grammar_closer_iter_init (smie_grammar_closer_iter_t *iter,
+				    smie_grammar_t *grammar,
+				    const smie_symbol_t *opener_symbol);
+gboolean smie_grammar_closer_iter_next (smie_grammar_closer_iter_t *iter,
+					const smie_symbol_t **closer_symbol);
 gboolean smie_grammar_is_keyword (smie_grammar_t *grammar,
 				  const smie_symbol_t *symbol);
 gint smie_grammar_get_left_prec (smie_grammar_t *grammar,
 				 const smie_symbol_t *symbol);
 gint smie_grammar_get_right_prec (smie_grammar_t *grammar,
 				  const smie_symbol_t *symbol);
+gint smie_grammar_get_basic_offset (smie_grammar_t *grammar);
+void smie_grammar_set_basic_offset (smie_grammar_t *grammar, gint offset);
+gint smie_grammar_get_before_offset (smie_grammar_t *grammar,
+				     const smie_symbol_t *symbol);
+void smie_grammar_set_before_offset (smie_grammar_t *grammar,
+				     const smie_symbol_t *symbol,
+				     gint offset);
+gint smie_grammar_get_after_offset (smie_grammar_t *grammar,
+				    const smie_symbol_t *symbol);
+void smie_grammar_set_after_offset (smie_grammar_t *grammar,
+				    const smie_symbol_t *symbol,
+				    gint offset);
+gboolean smie_grammar_is_list_intro (smie_grammar_t *grammar,
+				     const smie_symbol_t *symbol);
+gboolean smie_grammar_add_list_intro (smie_grammar_t *grammar,
+				      const smie_symbol_t *symbol);
+gboolean smie_grammar_is_close_all (smie_grammar_t *grammar,
+				    const smie_symbol_t *symbol);
+gboolean smie_grammar_add_close_all (smie_grammar_t *grammar,
+				     const smie_symbol_t *symbol);
 
 smie_prec2_grammar_t *smie_bnf_to_prec2 (smie_bnf_grammar_t *bnf,
 					 GList *resolvers,
@@ -205,6 +254,25 @@ smie_prec2_grammar_t *smie_bnf_to_prec2 (smie_bnf_grammar_t *bnf,
 smie_grammar_t *smie_prec2_to_grammar (smie_prec2_grammar_t *prec2,
 				       GError **error);
 
+GBytes *smie_grammar_serialize (smie_grammar_t *grammar);
+smie_grammar_t *smie_grammar_new_from_bytes (GBytes *bytes,
+					     GError **error);
+smie_grammar_t *smie_grammar_new_from_resource (const gchar *name,
+						GError **error);
+gchar **smie_grammar_list_builtin (void);
+smie_grammar_t *smie_grammar_load_cached (const gchar *input,
+					  const gchar *cache_dir,
+					  GError **error);
+
+smie_grammar_t *smie_grammar_load (const gchar *filename,
+				   GError **error);
+void smie_grammar_load_async (const gchar *filename,
+			      GCancellable *cancellable,
+			      GAsyncReadyCallback callback,
+			      gpointer user_data);
+smie_grammar_t *smie_grammar_load_finish (GAsyncResult *result,
+					  GError **error);
+
 /**
  * smie_next_token_function_t:
  * @context: a context pointer
@@ -219,6 +287,115 @@ smie_grammar_t *smie_prec2_to_grammar (smie_prec2_grammar_t *prec2,
  */
 typedef gchar * (*smie_next_token_function_t) (gpointer context);
 
+/**
+ * smie_next_token_slice_function_t:
+ * @context: a context pointer
+ * @token: (out) (transfer none): return location of the token
+ * @length: (out): return location of the length of @token in bytes
+ *
+ * Specify the type of function passed to smie_forward_sexp_slice()
+ * and smie_backward_sexp_slice().  It behaves like
+ * #smie_next_token_function_t, but instead of returning a newly
+ * allocated string, it points @token to the token text, which need
+ * not be NUL-terminated and only has to stay valid until the next
+ * call.
+ *
+ * Returns: %TRUE if a token was read, %FALSE at the end of buffer
+ */
+typedef gboolean (*smie_next_token_slice_function_t) (gpointer context,
+						      const gchar **token,
+						      gsize *length);
+
+/**
+ * smie_get_offset_function_t:
+ * @context: a context pointer
+ *
+ * Specify the type of function passed to smie_forward_sexp_full() and
+ * smie_backward_sexp_full() to get the current cursor position.
+ *
+ * Returns: the offset of the cursor
+ */
+typedef gint (*smie_get_offset_function_t) (gpointer context);
+
+/**
+ * smie_skip_function_t:
+ * @context: a context pointer
+ *
+ * Specify the type of function passed to smie_pair_index_scan() to
+ * move the cursor past whitespace and comments, so that it is placed
+ * on the first character of the next token.
+ *
+ * Returns: %TRUE if the cursor moves, otherwise %FALSE
+ */
+typedef gboolean (*smie_skip_function_t) (gpointer context);
+
+typedef struct _smie_sexp_result_t smie_sexp_result_t;
+
+/**
+ * smie_sexp_result_t:
+ * @symbol: the keyword the scan stopped at, or %NULL if it reached the
+ *   end of buffer
+ * @offset: the position just before @symbol, in buffer order
+ * @paired: %TRUE if @symbol closed the S-expression as the other end
+ *   of a pair
+ *
+ * Details of where smie_forward_sexp_full() or
+ * smie_backward_sexp_full() stopped.
+ */
+struct _smie_sexp_result_t
+{
+  const smie_symbol_t *symbol;
+  gint offset;
+  gboolean paired;
+};
+
+typedef struct _smie_scan_budget_t smie_scan_budget_t;
+
+/**
+ * smie_scan_budget_t:
+ * @max_tokens: the maximum number of tokens to read, or 0 for no limit
+ * @deadline: the value of g_get_monotonic_time() after which scanning
+ *   gives up, or 0 for no limit
+ * @n_tokens: the number of tokens read so far
+ * @exhausted: %TRUE if a scan gave up because the budget ran out
+ * @cancellable: (nullable): a #GCancellable which also makes scans
+ *   give up, once cancelled
+ *
+ * Limits on the work done by scans, so that editors can bound the
+ * time spent on each keystroke.  Initialize it with
+ * smie_scan_budget_init().
+ */
+struct _smie_scan_budget_t
+{
+  guint max_tokens;
+  gint64 deadline;
+  guint n_tokens;
+  gboolean exhausted;
+  GCancellable *cancellable;
+};
+
+/**
+ * smie_sexp_status_t:
+ * @SMIE_SEXP_STATUS_SKIPPED: skipped an S-expression which is not a
+ *   paren-like pair
+ * @SMIE_SEXP_STATUS_PAIRED: skipped a paren-like pair
+ * @SMIE_SEXP_STATUS_GAVE_UP: the scan budget ran out before the end of
+ *   the S-expression was found
+ *
+ * Outcome of a bounded scan.
+ */
+typedef enum
+  {
+    SMIE_SEXP_STATUS_SKIPPED,
+    SMIE_SEXP_STATUS_PAIRED,
+    SMIE_SEXP_STATUS_GAVE_UP
+  } smie_sexp_status_t;
+
+void smie_scan_budget_init (smie_scan_budget_t *budget,
+			    guint max_tokens,
+			    gint64 deadline);
+gboolean smie_scan_budget_consume (smie_scan_budget_t *budget);
+
 gboolean smie_forward_sexp (smie_grammar_t *grammar,
 			    smie_next_token_function_t next_token_func,
 			    const smie_symbol_t *symbol,
@@ -229,6 +406,132 @@ gboolean smie_backward_sexp (smie_grammar_t *grammar,
 			     const smie_symbol_t *symbol,
 			     gpointer context);
 
+gboolean smie_forward_sexp_full (smie_grammar_t *grammar,
+				 smie_next_token_function_t next_token_func,
+				 smie_get_offset_function_t get_offset_func,
+				 const smie_symbol_t *symbol,
+				 gpointer context,
+				 smie_sexp_result_t *result);
+
+gboolean smie_backward_sexp_full (smie_grammar_t *grammar,
+				  smie_next_token_function_t next_token_func,
+				  smie_get_offset_function_t get_offset_func,
+				  const smie_symbol_t *symbol,
+				  gpointer context,
+				  smie_sexp_result_t *result);
+
+smie_sexp_status_t smie_forward_sexp_bounded
+  (smie_grammar_t *grammar,
+   smie_next_token_function_t next_token_func,
+   smie_get_offset_function_t get_offset_func,
+   const smie_symbol_t *symbol,
+   gpointer context,
+   smie_scan_budget_t *budget,
+   smie_sexp_result_t *result);
+
+smie_sexp_status_t smie_backward_sexp_bounded
+  (smie_grammar_t *grammar,
+   smie_next_token_function_t next_token_func,
+   smie_get_offset_function_t get_offset_func,
+   const smie_symbol_t *symbol,
+   gpointer context,
+   smie_scan_budget_t *budget,
+   smie_sexp_result_t *result);
+
+/**
+ * smie_sexp_scanner_t:
+ *
+ * The state of an S-expression scan which can be suspended and
+ * resumed.
+ */
+typedef struct _smie_sexp_scanner_t smie_sexp_scanner_t;
+
+smie_sexp_scanner_t *smie_sexp_scanner_new (smie_grammar_t *grammar,
+					    gboolean backward,
+					    const smie_symbol_t *symbol);
+void smie_sexp_scanner_free (smie_sexp_scanner_t *scanner);
+smie_sexp_status_t smie_sexp_scanner_run
+  (smie_sexp_scanner_t *scanner,
+   smie_next_token_function_t next_token_func,
+   smie_get_offset_function_t get_offset_func,
+   gpointer context,
+   smie_scan_budget_t *budget,
+   smie_sexp_result_t *result);
+gint smie_sexp_scanner_get_offset (smie_sexp_scanner_t *scanner);
+
+void smie_forward_sexp_batch (smie_grammar_t *grammar,
+			      smie_next_token_function_t next_token_func,
+			      smie_get_offset_function_t get_offset_func,
+			      gpointer context,
+			      const gint *offsets,
+			      gsize n_offsets,
+			      smie_sexp_result_t *results);
+
+gboolean smie_forward_sexp_slice
+  (smie_grammar_t *grammar,
+   smie_next_token_slice_function_t next_token_func,
+   const smie_symbol_t *symbol,
+   gpointer context);
+
+gboolean smie_backward_sexp_slice
+  (smie_grammar_t *grammar,
+   smie_next_token_slice_function_t next_token_func,
+   const smie_symbol_t *symbol,
+   gpointer context);
+
+/**
+ * smie_pair_index_t:
+ *
+ * An index of the keywords of a buffer.
+ */
+typedef struct _smie_pair_index_t smie_pair_index_t;
+
+smie_pair_index_t *smie_pair_index_new (smie_grammar_t *grammar);
+void smie_pair_index_free (smie_pair_index_t *index);
+void smie_pair_index_scan (smie_pair_index_t *index,
+			   smie_next_token_function_t next_token_func,
+			   smie_skip_function_t skip_func,
+			   smie_get_offset_function_t get_offset_func,
+			   gpointer context);
+gint smie_pair_index_invalidate (smie_pair_index_t *index,
+				 gint offset,
+				 gint removed,
+				 gint inserted);
+gint smie_pair_index_find_match (smie_pair_index_t *index,
+				 gint offset);
+gint smie_pair_index_find_opener (smie_pair_index_t *index,
+				  gint offset);
+gint smie_pair_index_get_depth (smie_pair_index_t *index,
+				gint offset);
+gint smie_pair_index_get_min_depth (smie_pair_index_t *index,
+				    gint start,
+				    gint end);
+gint smie_pair_index_find_parent (smie_pair_index_t *index,
+				  gint offset);
+
+/**
+ * smie_keyword_matcher_t:
+ *
+ * A matcher which finds the keywords of a grammar in a flat buffer.
+ */
+typedef struct _smie_keyword_matcher_t smie_keyword_matcher_t;
+
+smie_keyword_matcher_t *smie_keyword_matcher_new (smie_grammar_t *grammar);
+void smie_keyword_matcher_free (smie_keyword_matcher_t *matcher);
+void smie_keyword_matcher_add_comment (smie_keyword_matcher_t *matcher,
+				       const gchar *start,
+				       const gchar *end);
+void smie_keyword_matcher_add_string (smie_keyword_matcher_t *matcher,
+				      const gchar *start,
+				      const gchar *end,
+				      gchar escape);
+gboolean smie_keyword_matcher_next (smie_keyword_matcher_t *matcher,
+				    const gchar *text,
+				    gsize length,
+				    gsize *offset,
+				    const smie_symbol_t **symbol,
+				    gsize *match_length);
+
 G_END_DECLS
 
 #endif	/* __SMIE_GRAMMAR_H__ */
@@ -33,6 +33,12 @@
  *
  * The GtkSourceView adapter provides a basic #smie_cursor_functions_t
  * implementation defined using #GtkTextIter and #GtkSourceBuffer.
+ *
+ * Since a #GtkSourceBuffer can only be read from the thread which owns
+ * it, the adapter also provides #smie_gtk_source_snapshot_t, a copy of
+ * the buffer taken at some point, which supports
+ * smie_indenter_calculate_async() and
+ * smie_indenter_calculate_region_parallel().
  */
 
 static gboolean
@@ -298,6 +304,29 @@ smie_gtk_source_buffer_pop_context (gpointer data)
   context->stack = g_list_delete_link (context->stack, context->stack);
 }
 
+static void
+smie_gtk_source_buffer_set_offset (gpointer data, gint offset)
+{
+  smie_gtk_source_buffer_context_t *context = data;
+  gtk_text_buffer_get_iter_at_offset (GTK_TEXT_BUFFER (context->buffer),
+				      &context->iter,
+				      offset);
+}
+
+static smie_cursor_mark_t
+smie_gtk_source_buffer_save (gpointer data)
+{
+  smie_gtk_source_buffer_context_t *context = data;
+  return gtk_text_iter_get_offset (&context->iter);
+}
+
+static void
+smie_gtk_source_buffer_restore (gpointer data, smie_cursor_mark_t mark)
+{
+  smie_gtk_source_buffer_context_t *context = data;
+  gtk_text_iter_set_offset (&context->iter, (gint) mark);
+}
+
 smie_cursor_functions_t smie_gtk_source_buffer_cursor_functions =
   {
     smie_gtk_source_buffer_forward_char,
@@ -318,5 +347,553 @@ smie_cursor_functions_t smie_gtk_source_buffer_cursor_functions =
     smie_gtk_source_buffer_get_line_offset,
     smie_gtk_source_buffer_get_char,
     smie_gtk_source_buffer_push_context,
-    smie_gtk_source_buffer_pop_context
+    smie_gtk_source_buffer_pop_context,
+    smie_gtk_source_buffer_set_offset,
+    NULL,
+    NULL,
+    NULL,
+    smie_gtk_source_buffer_save,
+    smie_gtk_source_buffer_restore
+  };
+
+/* A range of characters in a comment or a string.  */
+struct smie_gtk_source_range_t
+{
+  gint start;
+  gint end;
+  guint8 flag;
+};
+
+/* Text shared by a snapshot and its copies.  Only SLICE and RANGES are
+   taken from the buffer, on the thread which owns it; CHARS and
+   CLASSES are derived from them the first time the text is read,
+   usually on a worker thread.  */
+struct smie_gtk_source_text_t
+{
+  volatile gint ref_count;
+  gchar *slice;
+  GArray *ranges;
+  volatile gsize decoded;
+  gunichar *chars;
+  guint8 *classes;
+  gint length;
+};
+
+#define SMIE_GTK_SOURCE_CLASS_COMMENT (1 << 0)
+#define SMIE_GTK_SOURCE_CLASS_STRING (1 << 1)
+
+struct _smie_gtk_source_snapshot_t
+{
+  struct smie_gtk_source_text_t *text;
+  gint offset;
+  GList *stack;
+};
+
+static void
+smie_gtk_source_text_add_ranges (struct smie_gtk_source_text_t *text,
+				 GtkSourceBuffer *buffer,
+				 const gchar *context_class,
+				 guint8 flag)
+{
+  GtkTextIter iter;
+  struct smie_gtk_source_range_t range;
+  gint start = 0;
+
+  gtk_text_buffer_get_start_iter (GTK_TEXT_BUFFER (buffer), &iter);
+  for (;;)
+    {
+      gboolean inside, more;
+      gint end;
+
+      inside = gtk_source_buffer_iter_has_context_class (buffer,
+							 &iter,
+							 context_class);
+      more = gtk_source_buffer_iter_forward_to_context_class_toggle
+	(buffer, &iter, context_class);
+      end = more ? gtk_text_iter_get_offset (&iter) : text->length;
+      if (inside && start < end)
+	{
+	  range.start = start;
+	  range.end = end;
+	  range.flag = flag;
+	  g_array_append_val (text->ranges, range);
+	}
+      start = end;
+      if (!more)
+	break;
+    }
+}
+
+static struct smie_gtk_source_text_t *
+smie_gtk_source_text_new (GtkSourceBuffer *buffer)
+{
+  struct smie_gtk_source_text_t *text;
+  GtkTextIter start_iter, end_iter;
+
+  text = g_new0 (struct smie_gtk_source_text_t, 1);
+  text->ref_count = 1;
+
+  /* Unlike gtk_text_buffer_get_text(), the slice has a character for
+     each offset in the buffer, including images and widgets.  */
+  gtk_text_buffer_get_bounds (GTK_TEXT_BUFFER (buffer),
+			      &start_iter, &end_iter);
+  text->slice = gtk_text_buffer_get_slice (GTK_TEXT_BUFFER (buffer),
+					   &start_iter, &end_iter, TRUE);
+  text->length = gtk_text_buffer_get_char_count (GTK_TEXT_BUFFER (buffer));
+
+  text->ranges = g_array_new (FALSE, FALSE,
+			      sizeof (struct smie_gtk_source_range_t));
+  smie_gtk_source_text_add_ranges (text, buffer, "comment",
+				   SMIE_GTK_SOURCE_CLASS_COMMENT);
+  smie_gtk_source_text_add_ranges (text, buffer, "string",
+				   SMIE_GTK_SOURCE_CLASS_STRING);
+  return text;
+}
+
+/* Return TEXT, after deriving the characters and their classes from
+   the slice, if not done yet.  */
+static struct smie_gtk_source_text_t *
+smie_gtk_source_text_decode (struct smie_gtk_source_text_t *text)
+{
+  if (g_once_init_enter (&text->decoded))
+    {
+      guint i;
+
+      text->chars = g_utf8_to_ucs4_fast (text->slice, -1, NULL);
+      text->classes = g_new0 (guint8, text->length);
+      for (i = 0; i < text->ranges->len; i++)
+	{
+	  struct smie_gtk_source_range_t *range
+	    = &g_array_index (text->ranges, struct smie_gtk_source_range_t, i);
+	  gint offset;
+
+	  for (offset = range->start; offset < range->end; offset++)
+	    text->classes[offset] |= range->flag;
+	}
+      g_free (text->slice);
+      text->slice = NULL;
+      g_array_free (text->ranges, TRUE);
+      text->ranges = NULL;
+      g_once_init_leave (&text->decoded, 1);
+    }
+  return text;
+}
+
+static void
+smie_gtk_source_text_unref (struct smie_gtk_source_text_t *text)
+{
+  if (g_atomic_int_dec_and_test (&text->ref_count))
+    {
+      g_free (text->slice);
+      if (text->ranges)
+	g_array_free (text->ranges, TRUE);
+      g_free (text->chars);
+      g_free (text->classes);
+      g_free (text);
+    }
+}
+
+/**
+ * smie_gtk_source_snapshot_new:
+ * @buffer: a source buffer
+ * @iter: a position in @buffer
+ *
+ * Copy the text of @buffer, and place the cursor at @iter.  Comments
+ * and strings are taken from the syntax highlighting of @buffer at
+ * the time of the call.  Only a plain copy of the text is made here;
+ * it is decoded when the snapshot is first read, so that the cost
+ * falls on the thread calculating the indentation.
+ * Returns: (transfer full): a new #smie_gtk_source_snapshot_t
+ */
+smie_gtk_source_snapshot_t *
+smie_gtk_source_snapshot_new (GtkSourceBuffer *buffer,
+			      const GtkTextIter *iter)
+{
+  smie_gtk_source_snapshot_t *snapshot;
+
+  g_return_val_if_fail (GTK_SOURCE_IS_BUFFER (buffer), NULL);
+  g_return_val_if_fail (iter, NULL);
+
+  snapshot = g_new0 (smie_gtk_source_snapshot_t, 1);
+  snapshot->text = smie_gtk_source_text_new (buffer);
+  snapshot->offset = gtk_text_iter_get_offset (iter);
+  return snapshot;
+}
+
+/**
+ * smie_gtk_source_snapshot_free:
+ * @snapshot: a #smie_gtk_source_snapshot_t
+ *
+ * Free @snapshot.
+ */
+void
+smie_gtk_source_snapshot_free (smie_gtk_source_snapshot_t *snapshot)
+{
+  g_return_if_fail (snapshot);
+
+  smie_gtk_source_text_unref (snapshot->text);
+  g_list_free (snapshot->stack);
+  g_free (snapshot);
+}
+
+#define SMIE_GTK_SOURCE_TEXT(snapshot)				\
+  smie_gtk_source_text_decode ((snapshot)->text)
+
+#define SMIE_GTK_SOURCE_CHAR(snapshot, offset)			\
+  ((offset) < (snapshot)->text->length					\
+   ? SMIE_GTK_SOURCE_TEXT (snapshot)->chars[(offset)] : 0)
+
+#define SMIE_GTK_SOURCE_HAS_CLASS(snapshot, offset, flag)		\
+  ((offset) < (snapshot)->text->length					\
+   && (SMIE_GTK_SOURCE_TEXT (snapshot)->classes[(offset)] & (flag)) != 0)
+
+#define SMIE_GTK_SOURCE_IS_COMMENT(snapshot, offset)			\
+  SMIE_GTK_SOURCE_HAS_CLASS (snapshot, offset, SMIE_GTK_SOURCE_CLASS_COMMENT)
+
+#define SMIE_GTK_SOURCE_IS_STRING(snapshot, offset)			\
+  SMIE_GTK_SOURCE_HAS_CLASS (snapshot, offset, SMIE_GTK_SOURCE_CLASS_STRING)
+
+/* Whether the character at OFFSET ends a normal token.  */
+static gboolean
+smie_gtk_source_snapshot_is_delimiter (smie_gtk_source_snapshot_t *snapshot,
+				       gint offset)
+{
+  gunichar uc = SMIE_GTK_SOURCE_CHAR (snapshot, offset);
+  return SMIE_GTK_SOURCE_IS_COMMENT (snapshot, offset)
+    || SMIE_GTK_SOURCE_IS_STRING (snapshot, offset)
+    || g_unichar_ispunct (uc)
+    || g_unichar_isspace (uc);
+}
+
+static gchar *
+smie_gtk_source_snapshot_slice (smie_gtk_source_snapshot_t *snapshot,
+				gint start,
+				gint end)
+{
+  return g_ucs4_to_utf8 (SMIE_GTK_SOURCE_TEXT (snapshot)->chars + start,
+			 end - start,
+			 NULL, NULL, NULL);
+}
+
+static gboolean
+smie_gtk_source_snapshot_starts_line (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset == 0
+    || SMIE_GTK_SOURCE_CHAR (snapshot, snapshot->offset - 1) == '\n';
+}
+
+static gboolean
+smie_gtk_source_snapshot_ends_line (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset == snapshot->text->length
+    || SMIE_GTK_SOURCE_CHAR (snapshot, snapshot->offset) == '\n';
+}
+
+static gboolean
+smie_gtk_source_snapshot_forward_char (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  if (snapshot->offset == snapshot->text->length)
+    return FALSE;
+  snapshot->offset++;
+  return snapshot->offset < snapshot->text->length;
+}
+
+static gboolean
+smie_gtk_source_snapshot_backward_char (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  if (snapshot->offset == 0)
+    return FALSE;
+  snapshot->offset--;
+  return TRUE;
+}
+
+static gboolean
+smie_gtk_source_snapshot_forward_to_line_end (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  /* If we are already on the EOL, do nothing.  */
+  if (smie_gtk_source_snapshot_ends_line (data))
+    return FALSE;
+  while (!smie_gtk_source_snapshot_ends_line (data))
+    snapshot->offset++;
+  return TRUE;
+}
+
+static gboolean
+smie_gtk_source_snapshot_backward_to_line_start (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint offset = snapshot->offset;
+  while (!smie_gtk_source_snapshot_starts_line (data))
+    snapshot->offset--;
+  return snapshot->offset != offset;
+}
+
+static gboolean
+smie_gtk_source_snapshot_forward_line (gpointer data)
+{
+  smie_gtk_source_snapshot_forward_to_line_end (data);
+  return smie_gtk_source_snapshot_forward_char (data);
+}
+
+static gboolean
+smie_gtk_source_snapshot_backward_line (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+
+  /* As gtk_text_iter_backward_line(), snap to the start of the first
+     line.  */
+  if (snapshot->offset == 0)
+    return FALSE;
+  smie_gtk_source_snapshot_backward_to_line_start (data);
+  if (snapshot->offset > 0)
+    {
+      snapshot->offset--;
+      smie_gtk_source_snapshot_backward_to_line_start (data);
+    }
+  return TRUE;
+}
+
+static gboolean
+smie_gtk_source_snapshot_forward_comment (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint offset = snapshot->offset;
+
+  while (snapshot->offset < snapshot->text->length
+	 && (SMIE_GTK_SOURCE_IS_COMMENT (snapshot, snapshot->offset)
+	     || g_unichar_isspace (SMIE_GTK_SOURCE_CHAR (snapshot,
+							 snapshot->offset))))
+    snapshot->offset++;
+  return snapshot->offset != offset;
+}
+
+static gboolean
+smie_gtk_source_snapshot_backward_comment (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint offset = snapshot->offset;
+
+  while (snapshot->offset > 0
+	 && (SMIE_GTK_SOURCE_IS_COMMENT (snapshot, snapshot->offset)
+	     || g_unichar_isspace (SMIE_GTK_SOURCE_CHAR (snapshot,
+							 snapshot->offset))))
+    snapshot->offset--;
+  return snapshot->offset != offset;
+}
+
+static gchar *
+smie_gtk_source_snapshot_forward_token (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint length = snapshot->text->length;
+  gint start;
+
+  /* Skip comments and whitespaces.  */
+  smie_gtk_source_snapshot_forward_comment (data);
+  if (snapshot->offset == length)
+    return NULL;
+
+  start = snapshot->offset;
+  if (SMIE_GTK_SOURCE_IS_STRING (snapshot, snapshot->offset))
+    {
+      /* Read a string literal.  */
+      while (snapshot->offset < length
+	     && SMIE_GTK_SOURCE_IS_STRING (snapshot, snapshot->offset))
+	snapshot->offset++;
+    }
+  else if (g_unichar_ispunct (SMIE_GTK_SOURCE_CHAR (snapshot,
+						     snapshot->offset)))
+    {
+      /* Read a punctuation.  */
+      while (snapshot->offset < length
+	     && g_unichar_ispunct (SMIE_GTK_SOURCE_CHAR (snapshot,
+							 snapshot->offset)))
+	snapshot->offset++;
+    }
+  else
+    {
+      /* Read a normal token.  */
+      while (snapshot->offset < length
+	     && !smie_gtk_source_snapshot_is_delimiter (snapshot,
+							snapshot->offset))
+	snapshot->offset++;
+    }
+
+  return smie_gtk_source_snapshot_slice (snapshot, start, snapshot->offset);
+}
+
+static gchar *
+smie_gtk_source_snapshot_backward_token (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint start, end;
+
+  if (snapshot->offset == 0)
+    return NULL;
+
+  /* Skip comments and whitespaces.  */
+  snapshot->offset--;
+  smie_gtk_source_snapshot_backward_comment (data);
+
+  end = snapshot->offset;
+  if (SMIE_GTK_SOURCE_IS_STRING (snapshot, snapshot->offset))
+    {
+      /* Read a string literal.  */
+      while (snapshot->offset > 0
+	     && SMIE_GTK_SOURCE_IS_STRING (snapshot, snapshot->offset))
+	snapshot->offset--;
+    }
+  else if (g_unichar_ispunct (SMIE_GTK_SOURCE_CHAR (snapshot,
+						     snapshot->offset)))
+    {
+      /* Read a punctuation.  */
+      while (snapshot->offset > 0
+	     && g_unichar_ispunct (SMIE_GTK_SOURCE_CHAR (snapshot,
+							 snapshot->offset)))
+	snapshot->offset--;
+    }
+  else
+    {
+      /* Read a normal token.  */
+      while (snapshot->offset > 0
+	     && !smie_gtk_source_snapshot_is_delimiter (snapshot,
+							snapshot->offset))
+	snapshot->offset--;
+    }
+
+  start = snapshot->offset;
+  if (start > 0)
+    start++;
+  return smie_gtk_source_snapshot_slice (snapshot, start, end + 1);
+}
+
+static gboolean
+smie_gtk_source_snapshot_is_start (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset == 0;
+}
+
+static gboolean
+smie_gtk_source_snapshot_is_end (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset == snapshot->text->length;
+}
+
+static gint
+smie_gtk_source_snapshot_get_offset (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset;
+}
+
+static gint
+smie_gtk_source_snapshot_get_line_offset (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  gint offset = snapshot->offset, line_offset;
+
+  smie_gtk_source_snapshot_backward_to_line_start (data);
+  line_offset = offset - snapshot->offset;
+  snapshot->offset = offset;
+  return line_offset;
+}
+
+static gunichar
+smie_gtk_source_snapshot_get_char (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return SMIE_GTK_SOURCE_CHAR (snapshot, snapshot->offset);
+}
+
+static void
+smie_gtk_source_snapshot_push_context (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  snapshot->stack = g_list_prepend (snapshot->stack,
+				    GINT_TO_POINTER (snapshot->offset));
+}
+
+static void
+smie_gtk_source_snapshot_pop_context (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  g_return_if_fail (snapshot->stack);
+  snapshot->offset = GPOINTER_TO_INT (snapshot->stack->data);
+  snapshot->stack = g_list_delete_link (snapshot->stack, snapshot->stack);
+}
+
+static void
+smie_gtk_source_snapshot_set_offset (gpointer data, gint offset)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  snapshot->offset = CLAMP (offset, 0, snapshot->text->length);
+}
+
+static gpointer
+smie_gtk_source_snapshot_copy_context (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  smie_gtk_source_snapshot_t *copy;
+
+  copy = g_new0 (smie_gtk_source_snapshot_t, 1);
+  copy->text = snapshot->text;
+  g_atomic_int_inc (&copy->text->ref_count);
+  copy->offset = snapshot->offset;
+  return copy;
+}
+
+static void
+smie_gtk_source_snapshot_free_context (gpointer data)
+{
+  smie_gtk_source_snapshot_free (data);
+}
+
+static smie_cursor_mark_t
+smie_gtk_source_snapshot_save (gpointer data)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  return snapshot->offset;
+}
+
+static void
+smie_gtk_source_snapshot_restore (gpointer data, smie_cursor_mark_t mark)
+{
+  smie_gtk_source_snapshot_t *snapshot = data;
+  snapshot->offset = mark;
+}
+
+smie_cursor_functions_t smie_gtk_source_snapshot_cursor_functions =
+  {
+    smie_gtk_source_snapshot_forward_char,
+    smie_gtk_source_snapshot_backward_char,
+    smie_gtk_source_snapshot_forward_line,
+    smie_gtk_source_snapshot_backward_line,
+    smie_gtk_source_snapshot_forward_to_line_end,
+    smie_gtk_source_snapshot_backward_to_line_start,
+    smie_gtk_source_snapshot_forward_comment,
+    smie_gtk_source_snapshot_backward_comment,
+    smie_gtk_source_snapshot_forward_token,
+    smie_gtk_source_snapshot_backward_token,
+    smie_gtk_source_snapshot_is_start,
+    smie_gtk_source_snapshot_is_end,
+    smie_gtk_source_snapshot_starts_line,
+    smie_gtk_source_snapshot_ends_line,
+    smie_gtk_source_snapshot_get_offset,
+    smie_gtk_source_snapshot_get_line_offset,
+    smie_gtk_source_snapshot_get_char,
+    smie_gtk_source_snapshot_push_context,
+    smie_gtk_source_snapshot_pop_context,
+    smie_gtk_source_snapshot_set_offset,
+    NULL,
+    smie_gtk_source_snapshot_copy_context,
+    smie_gtk_source_snapshot_free_context,
+    smie_gtk_source_snapshot_save,
+    smie_gtk_source_snapshot_restore
   };
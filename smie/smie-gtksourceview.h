@@ -42,6 +42,22 @@ struct _smie_gtk_source_buffer_context_t
 
 smie_cursor_functions_t smie_gtk_source_buffer_cursor_functions;
 
+/**
+ * smie_gtk_source_snapshot_t:
+ *
+ * A context object holding a copy of the text of a #GtkSourceBuffer,
+ * along with its comment and string regions, which can be read from
+ * any thread.
+ */
+typedef struct _smie_gtk_source_snapshot_t smie_gtk_source_snapshot_t;
+
+smie_gtk_source_snapshot_t *
+smie_gtk_source_snapshot_new (GtkSourceBuffer *buffer,
+			      const GtkTextIter *iter);
+void smie_gtk_source_snapshot_free (smie_gtk_source_snapshot_t *snapshot);
+
+smie_cursor_functions_t smie_gtk_source_snapshot_cursor_functions;
+
 G_END_DECLS
 
 #endif	/* __SMIE_GTKSOURCEVIEW_H__ */
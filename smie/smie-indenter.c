@@ -38,18 +38,199 @@ struct _smie_indenter_t
 {
   volatile gint ref_count;
 
+  /* GRAMMAR may be replaced by smie_indenter_set_grammar() while
+     other threads are calculating indentation.  The lock only covers
+     reading the pointer and taking a reference to it; a calculation
+     keeps using its own reference until it finishes.  Readers share
+     the lock, so only a replacement makes them wait.  */
+  GRWLock grammar_lock;
   smie_grammar_t *grammar;
   const smie_cursor_functions_t *functions;
   const smie_rule_functions_t *rules;
+
+  /* Results of backward S-expression scans, or %NULL if disabled.
+     The table is cleared when it grows beyond SMIE_SEXP_MEMO_MAX_SIZE
+     entries, or when the buffer version reported by @get_version
+     changes, in which case MEMO_VERSION is the new version.  */
+  GMutex memo_lock;
+  GHashTable *memo;
+  guint memo_version;
+
+  /* Indentation of lines, or %NULL if disabled.  Also protected by
+     MEMO_LOCK.  LINE_CACHE_VERSION is the buffer version the entries
+     were calculated for, unless LINE_CACHE_SYNCED is unset, which
+     means that the buffer has been modified since then and the entries
+     have been updated by smie_indenter_invalidate().  */
+  GHashTable *line_cache;
+  guint line_cache_version;
+  gboolean line_cache_synced;
+
+  /* Stacks of open constructs every CHECKPOINT_INTERVAL lines, in
+     buffer order, or %NULL if disabled.  Also protected by MEMO_LOCK.
+     The levels on the stacks belong to CHECKPOINT_GRAMMAR.  */
+  GArray *checkpoints;
+  guint checkpoint_interval;
+  smie_grammar_t *checkpoint_grammar;
+
+  /* Incremented by smie_indenter_invalidate(), so that calculations
+     which have started before it, on the old text, do not store their
+     results.  Also protected by MEMO_LOCK.  */
+  guint generation;
+
+  /* Strategies tried in order for each line, sorted by priority.  The
+     counts in their statistics are updated atomically, and the cost,
+     which does not fit in an atomic integer, under MEMO_LOCK.  */
+  GArray *strategies;
+
+  /* Whether the time spent in strategies is measured, accessed
+     atomically.  */
+  gint strategy_timing;
+};
+
+struct smie_indent_state_t;
+
+typedef gint (* smie_indent_function_t) (smie_indenter_t *,
+					 struct smie_indent_state_t *,
+					 gpointer);
+
+struct smie_indent_strategy_t
+{
+  gchar *name;
+  gint priority;
+
+  /* Either a built-in function, or one added by the user.  */
+  smie_indent_function_t function;
+  smie_indent_strategy_func_t func;
+  gpointer user_data;
+
+  smie_indent_strategy_stats_t stats;
+};
+
+#define SMIE_INDENT_STRATEGY(strategies, i)				\
+  (&g_array_index ((strategies), struct smie_indent_strategy_t, (i)))
+
+static void smie_indent_add_builtin_strategies (smie_indenter_t *indenter);
+
+#define SMIE_SEXP_MEMO_MAX_SIZE 4096
+
+/* A memoized backward S-expression scan.  START is the scan anchor,
+   the end of the token before the position the scan started from, so
+   that scans from anywhere between that token and the next share an
+   entry.  */
+struct smie_sexp_memo_entry_t
+{
+  /* Key.  */
+  smie_grammar_t *grammar;
+  guint version;
+  gint start;
+  gboolean backward;
+  const smie_symbol_t *symbol;
+
+  /* Value.  */
+  gint end;
+  smie_sexp_result_t result;
+};
+
+/* Indentation of a line, keyed by START.  LOW and HIGH delimit the text
+   the calculation has read: the first token of the line, and the text
+   before it back to the line of the keyword the indentation was
+   derived from.  */
+struct smie_line_entry_t
+{
+  smie_grammar_t *grammar;
+  gint start;
+  gint low;
+  gint high;
+  gint indent;
+};
+
+/* A keyword on the stack of open constructs, with the offset of the
+   opener of its construct, if it belongs to one.  */
+struct smie_keyword_entry_t
+{
+  gint start;
+  const smie_symbol_t *symbol;
+  const struct smie_level_t *level;
+  gint group;
+  const smie_symbol_t *group_symbol;
+
+  /* Whether the keywords of the group after its opener, up to this
+     one, are all non-associative, so that a backward scan from a
+     keyword continuing the group goes back to the opener.  */
+  gboolean chained;
 };
 
+/* The keywords read forward from the start of a line.  */
+struct smie_keyword_stack_t
+{
+  /* The open constructs, innermost last.  */
+  GArray *entries;
+
+  /* The start of the last keyword at which backward scans may stop
+     early, since a keyword read after it cannot enclose it, and that
+     of the last keyword which closed constructs it does not belong to,
+     which backward scans do not skip as the stack tells, or -1.  */
+  gint sync;
+  gint broken;
+
+  /* The last keyword read, if any.  */
+  gint last;
+  const struct smie_level_t *last_level;
+};
+
+/* The stack of open constructs at the beginning of a line.  */
+struct smie_checkpoint_t
+{
+  gint start;
+
+  /* Where reading resumes and the end of the last token read, as in
+     struct smie_indent_region_t.  */
+  gint next;
+  gint end;
+
+  struct smie_keyword_stack_t *stack;
+};
+
+#define SMIE_CHECKPOINT(checkpoints, i)				\
+  (&g_array_index ((checkpoints), struct smie_checkpoint_t, (i)))
+
+#define SMIE_KEYWORD_STACK_ENTRY(stack, i)				\
+  (&g_array_index ((stack)->entries, struct smie_keyword_entry_t, (i)))
+
+#define SMIE_KEYWORD_STACK_TOP(stack)					\
+  SMIE_KEYWORD_STACK_ENTRY ((stack), (stack)->entries->len - 1)
+
+static guint
+smie_sexp_memo_hash (gconstpointer key)
+{
+  const struct smie_sexp_memo_entry_t *entry = key;
+  return g_direct_hash (entry->symbol)
+    ^ g_int_hash (&entry->start)
+    ^ (entry->version << 1)
+    ^ entry->backward;
+}
+
+static gboolean
+smie_sexp_memo_equal (gconstpointer a, gconstpointer b)
+{
+  const struct smie_sexp_memo_entry_t *ae = a;
+  const struct smie_sexp_memo_entry_t *be = b;
+  return ae->grammar == be->grammar
+    && ae->version == be->version
+    && ae->start == be->start
+    && ae->backward == be->backward
+    && ae->symbol == be->symbol;
+}
+
 /**
  * smie_indenter_new:
  * @grammar: a #smie_grammar_t object
  * @functions: a #smie_cursor_functions_t
- * @rules: a #smie_rule_functions_t
+ * @rules: (nullable): a #smie_rule_functions_t
  *
- * Create a new indenter.
+ * Create a new indenter.  The rules given in the %rules section of
+ * the grammar take precedence over @rules, which are only consulted
+ * for the tokens the grammar does not cover.
  * Returns: a new #smie_indenter_t object
  */
 smie_indenter_t *
@@ -61,20 +242,89 @@ smie_indenter_new (smie_grammar_t *grammar,
 
   g_return_val_if_fail (grammar, NULL);
   g_return_val_if_fail (functions, NULL);
-  g_return_val_if_fail (rules, NULL);
 
   result = g_new0 (smie_indenter_t, 1);
   result->ref_count = 1;
+  g_rw_lock_init (&result->grammar_lock);
+  g_mutex_init (&result->memo_lock);
   result->grammar = grammar;
   result->functions = functions;
   result->rules = rules;
+  result->strategies
+    = g_array_new (FALSE, FALSE, sizeof (struct smie_indent_strategy_t));
+  smie_indent_add_builtin_strategies (result);
   return result;
 }
 
+static struct smie_keyword_stack_t *
+smie_keyword_stack_new (void)
+{
+  struct smie_keyword_stack_t *stack = g_new0 (struct smie_keyword_stack_t, 1);
+  stack->entries
+    = g_array_new (FALSE, FALSE, sizeof (struct smie_keyword_entry_t));
+  stack->sync = -1;
+  stack->broken = -1;
+  stack->last = -1;
+  return stack;
+}
+
+static struct smie_keyword_stack_t *
+smie_keyword_stack_copy (const struct smie_keyword_stack_t *stack)
+{
+  struct smie_keyword_stack_t *copy
+    = g_memdup (stack, sizeof (struct smie_keyword_stack_t));
+  copy->entries
+    = g_array_sized_new (FALSE, FALSE, sizeof (struct smie_keyword_entry_t),
+			 stack->entries->len);
+  g_array_append_vals (copy->entries, stack->entries->data,
+		       stack->entries->len);
+  return copy;
+}
+
+static void
+smie_keyword_stack_free (struct smie_keyword_stack_t *stack)
+{
+  g_array_free (stack->entries, TRUE);
+  g_free (stack);
+}
+
+/* Drop the checkpoints from the Nth one.  */
+static void
+smie_checkpoints_truncate (smie_indenter_t *indenter, guint n)
+{
+  guint i;
+
+  for (i = n; i < indenter->checkpoints->len; i++)
+    smie_keyword_stack_free (SMIE_CHECKPOINT (indenter->checkpoints,
+					      i)->stack);
+  g_array_set_size (indenter->checkpoints, n);
+  if (n == 0 && indenter->checkpoint_grammar)
+    {
+      smie_grammar_unref (indenter->checkpoint_grammar);
+      indenter->checkpoint_grammar = NULL;
+    }
+}
+
 static void
 smie_indenter_free (smie_indenter_t *indenter)
 {
-  smie_grammar_free (indenter->grammar);
+  guint i;
+
+  smie_grammar_unref (indenter->grammar);
+  if (indenter->memo)
+    g_hash_table_unref (indenter->memo);
+  if (indenter->line_cache)
+    g_hash_table_unref (indenter->line_cache);
+  if (indenter->checkpoints)
+    {
+      smie_checkpoints_truncate (indenter, 0);
+      g_array_free (indenter->checkpoints, TRUE);
+    }
+  for (i = 0; i < indenter->strategies->len; i++)
+    g_free (SMIE_INDENT_STRATEGY (indenter->strategies, i)->name);
+  g_array_free (indenter->strategies, TRUE);
+  g_rw_lock_clear (&indenter->grammar_lock);
+  g_mutex_clear (&indenter->memo_lock);
   g_free (indenter);
 }
 
@@ -110,232 +360,2042 @@ smie_indenter_unref (smie_indenter_t *indenter)
     smie_indenter_free (indenter);
 }
 
-static gboolean
-smie_indent_starts_line (smie_indenter_t *indenter,
-			 gpointer context)
+/**
+ * smie_indenter_get_grammar:
+ * @indenter: a #smie_indenter_t object
+ *
+ * Get the grammar currently used by @indenter.
+ * Returns: (transfer full): a #smie_grammar_t object
+ */
+smie_grammar_t *
+smie_indenter_get_grammar (smie_indenter_t *indenter)
 {
-  if (indenter->functions->starts_line (context))
-    return TRUE;
-
-  indenter->functions->push_context (context);
-  while (indenter->functions->backward_char (context)
-	 && !indenter->functions->starts_line (context))
-    {
-      gunichar uc = indenter->functions->get_char (context);
-      if (!(uc == ' ' || uc == '\t'))
-	{
-	  indenter->functions->pop_context (context);
-	  return FALSE;
-	}
-    }
-  indenter->functions->pop_context (context);
-  return TRUE;
-}
+  smie_grammar_t *grammar;
 
-typedef gint (* smie_indent_function_t) (smie_indenter_t *, gpointer);
+  g_return_val_if_fail (indenter, NULL);
 
-static gint
-smie_indent_virtual (smie_indenter_t *indenter,
-		     gpointer context)
-{
-  if (smie_indent_starts_line (indenter, context))
-    return indenter->functions->get_line_offset (context);
-  return smie_indenter_calculate (indenter, context);
+  g_rw_lock_reader_lock (&indenter->grammar_lock);
+  grammar = smie_grammar_ref (indenter->grammar);
+  g_rw_lock_reader_unlock (&indenter->grammar_lock);
+  return grammar;
 }
 
-static gint
-smie_indent_bob (smie_indenter_t *indenter, gpointer context)
+/**
+ * smie_indenter_set_grammar:
+ * @indenter: a #smie_indenter_t object
+ * @grammar: a #smie_grammar_t object
+ *
+ * Replace the grammar used by @indenter.  Calculations already in
+ * progress in other threads keep using the previous grammar until
+ * they return; the previous grammar is released when the last of
+ * them finishes.  Subsequent calls to smie_indenter_calculate() use
+ * @grammar.
+ */
+void
+smie_indenter_set_grammar (smie_indenter_t *indenter,
+			   smie_grammar_t *grammar)
 {
-  gboolean result;
+  smie_grammar_t *old_grammar;
 
-  indenter->functions->push_context (context);
-  indenter->functions->backward_comment (context);
-  result = indenter->functions->is_start (context);
-  indenter->functions->pop_context (context);
-  if (result)
-    return 0;
+  g_return_if_fail (indenter);
+  g_return_if_fail (grammar);
 
-  return -1;
+  smie_grammar_ref (grammar);
+  g_rw_lock_writer_lock (&indenter->grammar_lock);
+  old_grammar = indenter->grammar;
+  indenter->grammar = grammar;
+  g_rw_lock_writer_unlock (&indenter->grammar_lock);
+
+  /* Memoized results refer to symbols of the previous grammar.  */
+  g_mutex_lock (&indenter->memo_lock);
+  if (indenter->memo)
+    g_hash_table_remove_all (indenter->memo);
+  if (indenter->line_cache)
+    g_hash_table_remove_all (indenter->line_cache);
+  if (indenter->checkpoints)
+    smie_checkpoints_truncate (indenter, 0);
+  g_mutex_unlock (&indenter->memo_lock);
+
+  smie_grammar_unref (old_grammar);
 }
 
-static gint
-smie_indent_keyword (smie_indenter_t *indenter, gpointer context)
+/**
+ * smie_indenter_set_sexp_memo:
+ * @indenter: a #smie_indenter_t object
+ * @enabled: whether to memoize S-expression scans
+ *
+ * Enable or disable the memo table of S-expression scans.  When
+ * enabled, the indenter remembers where a backward scan from a given
+ * position landed and which keyword it stopped at, so that
+ * indenting the lines of a block one by one does not rescan the block
+ * for each line.  Scans are keyed by the end of the token before their
+ * start, so that changing the whitespace after it, such as
+ * reindenting a line, keeps the results valid.  The table holds at
+ * most a few thousand entries and is cleared when it is full.
+ *
+ * The memo table requires the @set_offset cursor function.  Results
+ * are keyed by the buffer version reported by @get_version, if
+ * provided; otherwise the application must report every edit with
+ * smie_indenter_invalidate().
+ */
+void
+smie_indenter_set_sexp_memo (smie_indenter_t *indenter, gboolean enabled)
 {
-  gint offset = indenter->functions->get_offset (context), offset2;
-  gchar *token, *parent_token;
-  smie_symbol_pool_t *pool;
-  const smie_symbol_t *symbol, *parent_symbol;
-  smie_symbol_class_t symbol_class;
-  gint left_prec, parent_left_prec;
-  gint indent;
-
-  indenter->functions->push_context (context);
-  token = indenter->functions->forward_token (context);
-  indenter->functions->pop_context (context);
-  if (!token)
-    return -1;
+  g_return_if_fail (indenter);
+  g_return_if_fail (!enabled || indenter->functions->set_offset);
 
-  pool = smie_grammar_get_symbol_pool (indenter->grammar);
-  symbol = smie_symbol_intern (pool, token, SMIE_SYMBOL_TERMINAL);
-  g_free (token);
+  g_mutex_lock (&indenter->memo_lock);
+  if (enabled && !indenter->memo)
+    g_atomic_pointer_set (&indenter->memo,
+			  g_hash_table_new_full (smie_sexp_memo_hash,
+						 smie_sexp_memo_equal,
+						 g_free,
+						 NULL));
+  else if (!enabled && indenter->memo)
+    {
+      g_hash_table_unref (indenter->memo);
+      g_atomic_pointer_set (&indenter->memo, NULL);
+    }
+  g_mutex_unlock (&indenter->memo_lock);
+}
 
-  if (!smie_grammar_is_keyword (indenter->grammar, symbol))
-    return -1;
+/**
+ * smie_indenter_set_line_cache:
+ * @indenter: a #smie_indenter_t object
+ * @enabled: whether to cache the indentation of lines
+ *
+ * Enable or disable the cache of calculated indentation.  When
+ * enabled, smie_indenter_calculate() on a line whose indentation is
+ * known returns it after moving the cursor to the beginning of line,
+ * without scanning the buffer.
+ *
+ * Each entry records the text its calculation depended on, which
+ * extends back to the line of the enclosing construct.  On
+ * smie_indenter_invalidate(), the entries depending on the modified
+ * text are dropped, and those after it are kept and moved.  If the
+ * @get_version cursor function is provided, the cache is also cleared
+ * when the buffer has been modified without notification.
+ *
+ * Dependencies are tracked by line, so an edit which changes how the
+ * previous lines are tokenized, such as opening a multi-line comment,
+ * should be reported as a change of the whole buffer.
+ */
+void
+smie_indenter_set_line_cache (smie_indenter_t *indenter, gboolean enabled)
+{
+  g_return_if_fail (indenter);
 
-  symbol_class = smie_grammar_get_symbol_class (indenter->grammar, symbol);
-  if (symbol_class == SMIE_SYMBOL_CLASS_OPENER)
+  g_mutex_lock (&indenter->memo_lock);
+  if (enabled && !indenter->line_cache)
     {
-      if (indenter->rules->before)
-	{
-	  gint indent = indenter->rules->before (symbol->name);
-	  if (indent >= 0)
-	    return indent;
-	}
+      indenter->line_cache = g_hash_table_new_full (g_int_hash,
+						    g_int_equal,
+						    NULL,
+						    g_free);
+      indenter->line_cache_synced = FALSE;
+    }
+  else if (!enabled && indenter->line_cache)
+    {
+      g_hash_table_unref (indenter->line_cache);
+      indenter->line_cache = NULL;
+    }
+  g_mutex_unlock (&indenter->memo_lock);
+}
 
-      /* FIXME: Skip comments.  */
-      if (smie_indent_starts_line (indenter, context))
-	return -1;
+/**
+ * smie_indenter_set_checkpoints:
+ * @indenter: a #smie_indenter_t object
+ * @interval: the number of lines between checkpoints, or 0 to disable
+ *   them
+ *
+ * Enable or disable the checkpoint table.  When enabled, the indenter
+ * records the stack of open constructs at the beginning of every
+ * @interval lines, as it reads the buffer forward.  Then
+ * smie_indenter_calculate() replays at most @interval lines from the
+ * nearest checkpoint above the line to get the stack at the line, and
+ * answers the backward scans from the line from the stack where it
+ * tells for sure, as smie_indenter_calculate_region() does.  The
+ * results are the same as without the table.
+ *
+ * The checkpoint table requires the @set_offset cursor function.  The
+ * application must report every edit with smie_indenter_invalidate().
+ */
+void
+smie_indenter_set_checkpoints (smie_indenter_t *indenter, guint interval)
+{
+  g_return_if_fail (indenter);
+  g_return_if_fail (interval == 0 || indenter->functions->set_offset);
 
-      /* FIXME: Check if the token is hanging.  */
-      indent = indenter->functions->get_line_offset (context);
-      return indent;
+  g_mutex_lock (&indenter->memo_lock);
+  if (indenter->checkpoints)
+    {
+      smie_checkpoints_truncate (indenter, 0);
+      g_array_free (indenter->checkpoints, TRUE);
+      indenter->checkpoints = NULL;
     }
+  if (interval > 0)
+    indenter->checkpoints
+      = g_array_new (FALSE, FALSE, sizeof (struct smie_checkpoint_t));
+  indenter->checkpoint_interval = interval;
+  g_mutex_unlock (&indenter->memo_lock);
+}
 
-  offset2 = indenter->functions->get_offset (context);
-  indenter->functions->push_context (context);
-  smie_backward_sexp (indenter->grammar,
-		      indenter->functions->backward_token,
-		      symbol,
-		      context);
-  if (offset2 == indenter->functions->get_offset (context))
+/* Move the entries of the line cache after an edit at OFFSET, and drop
+   those which depended on the modified text.  */
+static void
+smie_line_cache_invalidate (smie_indenter_t *indenter,
+			    gint offset,
+			    gint removed,
+			    gint inserted)
+{
+  GHashTableIter iter;
+  gpointer value;
+  GSList *moved = NULL, *l;
+
+  g_hash_table_iter_init (&iter, indenter->line_cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-      indenter->functions->pop_context (context);
-      return -1;
+      struct smie_line_entry_t *entry = value;
+
+      if (entry->high < offset)
+	continue;
+
+      if (entry->low > offset + removed)
+	{
+	  g_hash_table_iter_steal (&iter);
+	  entry->start += inserted - removed;
+	  entry->low += inserted - removed;
+	  entry->high += inserted - removed;
+	  moved = g_slist_prepend (moved, entry);
+	}
+      else
+	g_hash_table_iter_remove (&iter);
     }
 
-  indenter->functions->push_context (context);
-  parent_token = indenter->functions->forward_token (context);
-  indenter->functions->pop_context (context);
-  if (!parent_token)
+  for (l = moved; l; l = l->next)
     {
-      indenter->functions->pop_context (context);
-      return -1;
+      struct smie_line_entry_t *entry = l->data;
+      g_hash_table_replace (indenter->line_cache, &entry->start, entry);
     }
-  parent_symbol = smie_symbol_intern (pool, parent_token, SMIE_SYMBOL_TERMINAL);
-  g_free (parent_token);
+  g_slist_free (moved);
 
-  /* For later calls to smie_indent_virtual, place the cursor at the
-     beginning of the first token on the line.  */
-  if (indenter->functions->ends_line (context))
-    indenter->functions->forward_char (context);
-  indenter->functions->forward_comment (context);
+  indenter->line_cache_synced = FALSE;
+}
 
-  left_prec
-    = smie_grammar_get_left_prec (indenter->grammar, symbol);
-  parent_left_prec
-    = smie_grammar_get_left_prec (indenter->grammar, parent_symbol);
+/**
+ * smie_indenter_invalidate:
+ * @indenter: a #smie_indenter_t object
+ * @offset: the offset where the buffer was modified
+ * @removed: the number of characters removed at @offset
+ * @inserted: the number of characters inserted at @offset
+ *
+ * Tell @indenter that the buffer has been modified, so that it drops
+ * the cached results depending on the modified text or on any text
+ * after it.  Cached indentation of the lines after the modified text
+ * which does not depend on it is kept; see
+ * smie_indenter_set_line_cache().
+ */
+void
+smie_indenter_invalidate (smie_indenter_t *indenter,
+			  gint offset,
+			  gint removed,
+			  gint inserted)
+{
+  GHashTableIter iter;
+  gpointer key;
 
-  if (left_prec == parent_left_prec)
+  g_return_if_fail (indenter);
+  g_return_if_fail (offset >= 0);
+
+  g_mutex_lock (&indenter->memo_lock);
+  if (indenter->memo)
     {
-      if (offset != indenter->functions->get_offset (context)
-	  && smie_indent_starts_line (indenter, context))
+      g_hash_table_iter_init (&iter, indenter->memo);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
 	{
-	  indenter->functions->pop_context (context);
-	  return indenter->functions->get_line_offset (context);
+	  struct smie_sexp_memo_entry_t *entry = key;
+	  if (MAX (entry->start, entry->end) >= offset)
+	    g_hash_table_iter_remove (&iter);
 	}
-
-      indent = smie_indent_virtual (indenter, context);
-      indenter->functions->pop_context (context);
-      return indent;
     }
-
-  if (offset == indenter->functions->get_offset (context)
-      && smie_indent_starts_line (indenter, context))
+  if (indenter->line_cache)
+    smie_line_cache_invalidate (indenter, offset, removed, inserted);
+  if (indenter->checkpoints)
     {
-      indenter->functions->pop_context (context);
-      return -1;
+      /* A checkpoint only depends on the text before it.  */
+      guint n = indenter->checkpoints->len;
+      while (n > 0 && SMIE_CHECKPOINT (indenter->checkpoints, n - 1)->start
+	     > offset)
+	n--;
+      smie_checkpoints_truncate (indenter, n);
     }
+  indenter->generation++;
+  g_mutex_unlock (&indenter->memo_lock);
+}
 
-  if (smie_grammar_is_keyword (indenter->grammar, parent_symbol))
-    {
-      indent = indenter->functions->get_line_offset (context);
-      indenter->functions->pop_context (context);
-      return indent;
-    }
+static guint
+smie_indenter_get_generation (smie_indenter_t *indenter)
+{
+  guint generation;
 
-  indent = smie_indent_virtual (indenter, context);
-  indenter->functions->pop_context (context);
-  return indent;
+  g_mutex_lock (&indenter->memo_lock);
+  generation = indenter->generation;
+  g_mutex_unlock (&indenter->memo_lock);
+  return generation;
 }
 
-static gint
-smie_indent_after_keyword (smie_indenter_t *indenter, gpointer context)
+/* Look up KEY in MEMO, which is either the memo table of the
+   indenter, with MEMO_LOCK held, or the table of a worker of
+   smie_indenter_calculate_region_parallel().  */
+static gboolean
+smie_sexp_memo_find (GHashTable *memo,
+		     struct smie_sexp_memo_entry_t *key,
+		     gint *endp,
+		     smie_sexp_result_t *result)
 {
-  gchar *token;
-  smie_symbol_pool_t *pool;
-  const smie_symbol_t *symbol;
-  smie_symbol_class_t symbol_class;
-  gint indent;
+  struct smie_sexp_memo_entry_t *entry = g_hash_table_lookup (memo, key);
 
-  indenter->functions->push_context (context);
-  token = indenter->functions->backward_token (context);
-  if (!token)
-    {
-      indenter->functions->pop_context (context);
-      return -1;
-    }
+  if (!entry)
+    return FALSE;
+  *endp = entry->end;
+  *result = entry->result;
+  return TRUE;
+}
 
-  pool = smie_grammar_get_symbol_pool (indenter->grammar);
-  symbol = smie_symbol_intern (pool, token, SMIE_SYMBOL_TERMINAL);
-  g_free (token);
-  if (!smie_grammar_is_keyword (indenter->grammar, symbol))
-    {
-      indenter->functions->pop_context (context);
-      return -1;
-    }
+/* Add KEY with END and RESULT to MEMO, which is cleared first if it
+   is full.  */
+static void
+smie_sexp_memo_add (GHashTable *memo,
+		    struct smie_sexp_memo_entry_t *key,
+		    gint end,
+		    const smie_sexp_result_t *result)
+{
+  struct smie_sexp_memo_entry_t *entry
+    = g_memdup (key, sizeof (struct smie_sexp_memo_entry_t));
 
-  if (indenter->rules->after)
-    {
-      gint indent = indenter->rules->after (symbol->name);
-      if (indent >= 0)
-	return indent;
-    }
+  entry->end = end;
+  entry->result = *result;
+  if (g_hash_table_size (memo) >= SMIE_SEXP_MEMO_MAX_SIZE)
+    g_hash_table_remove_all (memo);
+  g_hash_table_add (memo, entry);
+}
 
-  symbol_class = smie_grammar_get_symbol_class (indenter->grammar, symbol);
-  if (symbol_class == SMIE_SYMBOL_CLASS_CLOSER)
-    {
-      indenter->functions->pop_context (context);
-      return -1;
-    }
+static gboolean
+smie_sexp_memo_lookup (smie_indenter_t *indenter,
+		       struct smie_sexp_memo_entry_t *key,
+		       gint *endp,
+		       smie_sexp_result_t *result,
+		       guint generation)
+{
+  gboolean found = FALSE;
 
-  /* For later calls to smie_indent_virtual, place the cursor at the
-     beginning of the first token on the line.  */
-  if (indenter->functions->ends_line (context))
-    indenter->functions->forward_char (context);
-  indenter->functions->forward_comment (context);
+  /* Entries may have been calculated for a newer text than the one
+     the calculation reads.  */
+  g_mutex_lock (&indenter->memo_lock);
+  if (indenter->memo && generation == indenter->generation)
+    found = smie_sexp_memo_find (indenter->memo, key, endp, result);
+  g_mutex_unlock (&indenter->memo_lock);
+  return found;
+}
 
-  if (symbol_class == SMIE_SYMBOL_CLASS_OPENER
-      || smie_grammar_is_pair_end (indenter->grammar, symbol))
+/* Same as smie_sexp_memo_insert(), with MEMO_LOCK held.  */
+static void
+smie_sexp_memo_insert_locked (smie_indenter_t *indenter,
+			      struct smie_sexp_memo_entry_t *key,
+			      gint end,
+			      const smie_sexp_result_t *result,
+			      guint generation)
+{
+  /* Skip if the grammar has been replaced or the buffer has been
+     modified during the calculation; the memo table has been cleared
+     for the new grammar or text.  */
+  g_rw_lock_reader_lock (&indenter->grammar_lock);
+  if (indenter->memo && key->grammar == indenter->grammar
+      && generation == indenter->generation)
     {
-      indent = smie_indent_virtual (indenter, context)
-	+ indenter->rules->basic ();
-      indenter->functions->pop_context (context);
-      return indent;
+      if (key->version != indenter->memo_version)
+	g_hash_table_remove_all (indenter->memo);
+      indenter->memo_version = key->version;
+      smie_sexp_memo_add (indenter->memo, key, end, result);
     }
-  indent = smie_indent_virtual (indenter, context);
-  indenter->functions->pop_context (context);
-  return indent;
+  g_rw_lock_reader_unlock (&indenter->grammar_lock);
 }
 
-static smie_indent_function_t functions[] =
-  {
-    smie_indent_bob,
-    smie_indent_keyword,
-    smie_indent_after_keyword
-    /* FIXME: implement smie_indent_exps */
-  };
+static void
+smie_sexp_memo_insert (smie_indenter_t *indenter,
+		       struct smie_sexp_memo_entry_t *key,
+		       gint end,
+		       const smie_sexp_result_t *result,
+		       guint generation)
+{
+  g_mutex_lock (&indenter->memo_lock);
+  smie_sexp_memo_insert_locked (indenter, key, end, result, generation);
+  g_mutex_unlock (&indenter->memo_lock);
+}
 
-/**
+/* A token read from START, which leaves the cursor at MARK.  */
+struct smie_indent_token_t
+{
+  gint start;
+  gchar *name;
+  smie_cursor_mark_t mark;
+};
+
+/* Keywords read forward by smie_indent_lines(), up to the line being
+   calculated.  */
+struct smie_indent_region_t
+{
+  struct smie_keyword_stack_t *stack;
+
+  /* Where reading resumes, at the start of a token, and the end of the
+     last token read, or -1.  */
+  gint next;
+  gint end;
+
+  /* The start of the line STACK tells the text before, or -1 if a
+     token spans it.  */
+  gint start;
+};
+
+/* State of a single indentation calculation.  */
+struct smie_indent_state_t
+{
+  smie_grammar_t *grammar;
+  smie_scan_budget_t *budget;
+
+  /* Indentation of the lines already calculated, keyed by the offset
+     of the line start, or %NULL.  */
+  GHashTable *lines;
+
+  /* Extent of the text read for the line being calculated, as in
+     struct smie_line_entry_t.  */
+  gint low;
+  gint high;
+
+  /* The keywords before the line being calculated, or %NULL.  */
+  struct smie_indent_region_t *region;
+
+  /* Value of the generation of the indenter for the text read.  */
+  guint generation;
+
+  /* Set for the workers of smie_indenter_calculate_region_parallel(),
+     which keep the results of their scans in MEMO, if the memo table
+     is enabled, and those of their lines in LINES, rather than in the
+     tables of the indenter, so that they do not contend for
+     MEMO_LOCK.  They are merged into the tables of the indenter when
+     the worker finishes.  */
+  gboolean worker;
+  GHashTable *memo;
+
+  /* Set by smie_indent_virtual().  */
+  smie_cursor_mark_t mark;
+  gint delta;
+
+  /* The tokens after and before the start of the line last read, see
+     smie_indent_forward_token().  */
+  struct smie_indent_token_t forward_token;
+  struct smie_indent_token_t backward_token;
+};
+
+#define SMIE_INDENT_GAVE_UP(state)				\
+  ((state)->budget && (state)->budget->exhausted)
+
+struct _smie_indent_query_t
+{
+  smie_indenter_t *indenter;
+  struct smie_indent_state_t *state;
+};
+
+static void
+smie_indent_note (struct smie_indent_state_t *state, gint offset)
+{
+  state->low = MIN (state->low, offset);
+  state->high = MAX (state->high, offset);
+}
+
+/* Record that the calculation depends on the line of the cursor, up to
+   the cursor.  */
+static void
+smie_indent_note_line (smie_indenter_t *indenter,
+		       struct smie_indent_state_t *state,
+		       gpointer context)
+{
+  smie_indent_note (state,
+		    indenter->functions->get_offset (context)
+		    - indenter->functions->get_line_offset (context));
+}
+
+static gint
+smie_indent_line_offset (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 gpointer context)
+{
+  smie_indent_note_line (indenter, state, context);
+  return indenter->functions->get_line_offset (context);
+}
+
+/* Check that the line cache still matches the buffer, and clear it
+   otherwise.  Called with MEMO_LOCK held.  */
+static void
+smie_line_cache_sync (smie_indenter_t *indenter, gpointer context)
+{
+  guint version;
+
+  if (!indenter->functions->get_version)
+    return;
+
+  version = indenter->functions->get_version (context);
+  if (indenter->line_cache_synced && version != indenter->line_cache_version)
+    g_hash_table_remove_all (indenter->line_cache);
+  indenter->line_cache_version = version;
+  indenter->line_cache_synced = TRUE;
+}
+
+static gboolean
+smie_indent_lookup_line (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 gint start,
+			 gpointer context,
+			 struct smie_line_entry_t *result)
+{
+  struct smie_line_entry_t *entry = NULL;
+
+  if (state->lines)
+    {
+      entry = g_hash_table_lookup (state->lines, &start);
+      if (entry)
+	{
+	  *result = *entry;
+	  return TRUE;
+	}
+    }
+  if (state->worker)
+    return FALSE;
+
+  g_mutex_lock (&indenter->memo_lock);
+  if (indenter->line_cache)
+    {
+      smie_line_cache_sync (indenter, context);
+      entry = g_hash_table_lookup (indenter->line_cache, &start);
+
+      /* As in smie_sexp_memo_lookup(), entries may have been
+	 calculated for a newer text.  */
+      if (entry && entry->grammar == state->grammar
+	  && state->generation == indenter->generation)
+	*result = *entry;
+      else
+	entry = NULL;
+    }
+  g_mutex_unlock (&indenter->memo_lock);
+  return entry != NULL;
+}
+
+/* Add ENTRY, calculated in the text of GENERATION, to the line
+   cache.  Called with MEMO_LOCK held.  */
+static void
+smie_line_cache_insert_locked (smie_indenter_t *indenter,
+			       const struct smie_line_entry_t *entry,
+			       guint generation,
+			       gpointer context)
+{
+  g_rw_lock_reader_lock (&indenter->grammar_lock);
+  if (indenter->line_cache && entry->grammar == indenter->grammar
+      && generation == indenter->generation)
+    {
+      struct smie_line_entry_t *copy
+	= g_memdup (entry, sizeof (struct smie_line_entry_t));
+      smie_line_cache_sync (indenter, context);
+      g_hash_table_replace (indenter->line_cache, &copy->start, copy);
+    }
+  g_rw_lock_reader_unlock (&indenter->grammar_lock);
+}
+
+static void
+smie_indent_insert_line (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 gint start,
+			 gint indent,
+			 gpointer context)
+{
+  struct smie_line_entry_t entry;
+
+  entry.grammar = state->grammar;
+  entry.start = start;
+  entry.low = state->low;
+  entry.high = state->high;
+  entry.indent = indent;
+
+  if (state->lines)
+    {
+      struct smie_line_entry_t *copy
+	= g_memdup (&entry, sizeof (struct smie_line_entry_t));
+      g_hash_table_replace (state->lines, &copy->start, copy);
+    }
+  if (state->worker)
+    return;
+
+  g_mutex_lock (&indenter->memo_lock);
+  smie_line_cache_insert_locked (indenter, &entry, state->generation,
+				 context);
+  g_mutex_unlock (&indenter->memo_lock);
+}
+
+/* Merge the results of the worker STATE into the tables of the
+   indenter.  */
+static void
+smie_indent_merge_worker (smie_indenter_t *indenter,
+			  struct smie_indent_state_t *state,
+			  gpointer context)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_mutex_lock (&indenter->memo_lock);
+  if (state->memo)
+    {
+      g_hash_table_iter_init (&iter, state->memo);
+      while (g_hash_table_iter_next (&iter, &value, NULL))
+	{
+	  struct smie_sexp_memo_entry_t *entry = value;
+	  smie_sexp_memo_insert_locked (indenter, entry, entry->end,
+					&entry->result, state->generation);
+	}
+    }
+  if (indenter->line_cache)
+    {
+      g_hash_table_iter_init (&iter, state->lines);
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+	smie_line_cache_insert_locked (indenter, value, state->generation,
+				       context);
+    }
+  g_mutex_unlock (&indenter->memo_lock);
+}
+
+static gboolean
+smie_indent_scan_backward_sexp (smie_indenter_t *indenter,
+				struct smie_indent_state_t *state,
+				const smie_symbol_t *symbol,
+				gpointer context,
+				smie_sexp_result_t *result)
+{
+  if (!state->budget)
+    {
+      smie_backward_sexp_full (state->grammar,
+			       indenter->functions->backward_token,
+			       indenter->functions->get_offset,
+			       symbol,
+			       context,
+			       result);
+      return TRUE;
+    }
+
+  return smie_backward_sexp_bounded (state->grammar,
+				     indenter->functions->backward_token,
+				     indenter->functions->get_offset,
+				     symbol,
+				     context,
+				     state->budget,
+				     result)
+    != SMIE_SEXP_STATUS_GAVE_UP;
+}
+
+/* Return the end of the token before the cursor, which is where a
+   backward scan from the cursor effectively starts.  */
+static gint
+smie_sexp_memo_anchor (smie_indenter_t *indenter, gpointer context)
+{
+  const smie_cursor_functions_t *functions = indenter->functions;
+  gint start, anchor = 0;
+  gchar *token;
+
+  start = functions->get_offset (context);
+  token = functions->backward_token (context);
+  if (token)
+    {
+      g_free (token);
+      g_free (functions->forward_token (context));
+      anchor = functions->get_offset (context);
+    }
+  functions->set_offset (context, start);
+  return anchor;
+}
+
+/* Find where a backward S-expression scan for SYMBOL from the start
+   of the line being calculated in a region stops, from the keywords
+   read forward before the line, and move the cursor there as the scan
+   would.  Return %FALSE if the stack does not tell for sure, which is
+   the case when the scan would stop early at a keyword which cannot be
+   inside an operand, or cross a badly nested construct, or go back
+   along a group with associative keywords.  */
+static gboolean
+smie_indent_region_backward_sexp (smie_indenter_t *indenter,
+				  struct smie_indent_state_t *state,
+				  const smie_symbol_t *symbol,
+				  gpointer context,
+				  smie_sexp_result_t *result)
+{
+  struct smie_indent_region_t *region = state->region;
+  const struct smie_level_t *level;
+  struct smie_keyword_entry_t *entry = NULL;
+  const smie_symbol_t *stop_symbol;
+  gchar *token;
+  gint i, stop, end;
+  gboolean paired = FALSE;
+
+  if (!region || region->start < 0
+      || indenter->functions->get_offset (context) != region->start)
+    return FALSE;
+
+  level = g_hash_table_lookup (state->grammar->levels, symbol);
+  if (!level)
+    return FALSE;
+
+  /* The scan stops early if SYMBOL cannot enclose the keywords it
+     reads first.  */
+  if (region->stack->last_level
+      && SMIE_ZONES_DISJOINT (region->stack->last_level->zones.zones,
+			      level->zones.left_zones))
+    return FALSE;
+
+  /* The constructs which bind tighter than SYMBOL are skipped.  */
+  for (i = (gint) region->stack->entries->len - 1; i >= 0; i--)
+    {
+      entry = SMIE_KEYWORD_STACK_ENTRY (region->stack, i);
+      if (SMIE_ZONES_DISJOINT (entry->level->zones.zones,
+			       level->zones.left_zones)
+	  && level->right_prec != entry->level->left_prec)
+	return FALSE;
+      if (level->right_prec >= entry->level->left_prec)
+	break;
+      if (entry->group >= 0)
+	return FALSE;
+    }
+  if (i < 0)
+    return FALSE;
+
+  /* Then, as smie_sexp_state_step() does when reading ENTRY.  */
+  stop = entry->start;
+  stop_symbol = entry->symbol;
+  if (level->right_prec == entry->level->left_prec)
+    {
+      gboolean associative
+	= entry->level->left_prec == entry->level->right_prec;
+
+      if (entry->level->symbol_class == SMIE_SYMBOL_CLASS_OPENER)
+	paired = TRUE;
+      else if (associative)
+	{
+	  if (level->left_prec != level->right_prec)
+	    return FALSE;
+	}
+      else if (entry->chained && entry->group >= 0)
+	{
+	  stop = entry->group;
+	  stop_symbol = entry->group_symbol;
+	  paired = TRUE;
+	}
+      else
+	return FALSE;
+    }
+
+  if (region->stack->sync >= stop || region->stack->broken >= stop)
+    return FALSE;
+
+  /* Check that the scan would start with the last token read
+     forward.  */
+  token = indenter->functions->backward_token (context);
+  if (token)
+    {
+      g_free (token);
+      g_free (indenter->functions->forward_token (context));
+    }
+  end = indenter->functions->get_offset (context);
+  indenter->functions->set_offset (context, region->start);
+  if (!token || end != region->end)
+    return FALSE;
+
+  /* Read the keyword backward, so that the cursor is left where the
+     cursor functions leave it.  */
+  indenter->functions->set_offset (context, stop);
+  g_free (indenter->functions->forward_token (context));
+  g_free (indenter->functions->backward_token (context));
+  result->symbol = stop_symbol;
+  result->offset = indenter->functions->get_offset (context);
+  result->paired = paired;
+  return TRUE;
+}
+
+/* Skip an S-expression backward from the cursor, consulting the memo
+   table if enabled.  Return %FALSE if the scan budget ran out.  */
+static gboolean
+smie_indent_backward_sexp (smie_indenter_t *indenter,
+			   struct smie_indent_state_t *state,
+			   const smie_symbol_t *symbol,
+			   gpointer context,
+			   smie_sexp_result_t *result)
+{
+  struct smie_sexp_memo_entry_t key;
+  gint end;
+
+  if (smie_indent_region_backward_sexp (indenter, state, symbol, context,
+					result))
+    return TRUE;
+
+  if (!indenter->functions->set_offset
+      || !(state->memo || g_atomic_pointer_get (&indenter->memo)))
+    return smie_indent_scan_backward_sexp (indenter, state, symbol,
+					   context, result);
+
+  memset (&key, 0, sizeof (struct smie_sexp_memo_entry_t));
+  key.grammar = state->grammar;
+  key.version = indenter->functions->get_version
+    ? indenter->functions->get_version (context)
+    : 0;
+  key.backward = TRUE;
+  key.symbol = symbol;
+  key.start = smie_sexp_memo_anchor (indenter, context);
+
+  if (state->memo
+      ? smie_sexp_memo_find (state->memo, &key, &end, result)
+      : smie_sexp_memo_lookup (indenter, &key, &end, result,
+			       state->generation))
+    {
+      indenter->functions->set_offset (context, end);
+      return TRUE;
+    }
+
+  if (!smie_indent_scan_backward_sexp (indenter, state, symbol,
+				       context, result))
+    return FALSE;
+  end = indenter->functions->get_offset (context);
+  if (state->memo)
+    smie_sexp_memo_add (state->memo, &key, end, result);
+  else
+    smie_sexp_memo_insert (indenter, &key, end, result, state->generation);
+  return TRUE;
+}
+
+/* Look up the keyword NAME.  Unlike smie_symbol_intern(), this does not
+   add non-keywords to the symbol pool, which is shared by the threads
+   calculating indentation.  */
+static const smie_symbol_t *
+smie_indent_lookup_keyword (smie_grammar_t *grammar, const gchar *name)
+{
+  smie_symbol_t symbol;
+  gpointer result;
+
+  symbol.name = (gchar *) name;
+  symbol.type = SMIE_SYMBOL_TERMINAL;
+  if (!g_hash_table_lookup_extended (grammar->levels, &symbol,
+				     &result, NULL))
+    return NULL;
+  return result;
+}
+
+/* Record that a backward scan may stop at the top of STACK, if LEVEL,
+   read after it, cannot enclose it.  */
+static void
+smie_keyword_stack_check_zones (struct smie_keyword_stack_t *stack,
+				const struct smie_level_t *level)
+{
+  struct smie_keyword_entry_t *top = SMIE_KEYWORD_STACK_TOP (stack);
+
+  if (SMIE_ZONES_DISJOINT (top->level->zones.zones,
+			   level->zones.left_zones))
+    stack->sync = MAX (stack->sync, top->start);
+}
+
+/* Update STACK with the keyword SYMBOL at START.  The constructs are
+   reduced as in smie_pair_index_scan(), but STACK is a plain copy,
+   which a checkpoint or a region owns.  */
+static void
+smie_keyword_stack_push (struct smie_keyword_stack_t *stack,
+			 gint start,
+			 const smie_symbol_t *symbol,
+			 const struct smie_level_t *level)
+{
+  GArray *entries = stack->entries;
+  struct smie_keyword_entry_t entry;
+
+  memset (&entry, 0, sizeof (struct smie_keyword_entry_t));
+  entry.group = -1;
+  if (stack->last_level
+      && SMIE_ZONES_DISJOINT (stack->last_level->zones.zones,
+			      level->zones.left_zones))
+    stack->sync = stack->last;
+  stack->last = start;
+  stack->last_level = level;
+
+  if (level->symbol_class == SMIE_SYMBOL_CLASS_OPENER)
+    {
+      entry.group = start;
+      entry.group_symbol = symbol;
+      entry.chained = TRUE;
+    }
+  else
+    {
+      while (entries->len > 0
+	     && SMIE_LEVEL_REDUCE (level,
+				   SMIE_KEYWORD_STACK_TOP (stack)->level)
+	     == SMIE_REDUCE_POP)
+	{
+	  smie_keyword_stack_check_zones (stack, level);
+	  if (SMIE_KEYWORD_STACK_TOP (stack)->group >= 0)
+	    stack->broken = start;
+	  g_array_set_size (entries, entries->len - 1);
+	}
+      if (entries->len > 0
+	  && SMIE_LEVEL_REDUCE (level, SMIE_KEYWORD_STACK_TOP (stack)->level)
+	  == SMIE_REDUCE_JOIN)
+	{
+	  struct smie_keyword_entry_t *top = SMIE_KEYWORD_STACK_TOP (stack);
+	  entry.group = top->group;
+	  entry.group_symbol = top->group_symbol;
+	  entry.chained = top->chained
+	    && level->left_prec != level->right_prec;
+	  g_array_set_size (entries, entries->len - 1);
+	}
+      else if (entries->len > 0)
+	smie_keyword_stack_check_zones (stack, level);
+    }
+
+  if (level->symbol_class == SMIE_SYMBOL_CLASS_CLOSER)
+    {
+      if (entry.group < 0)
+	stack->broken = start;
+      return;
+    }
+
+  entry.start = start;
+  entry.symbol = symbol;
+  entry.level = level;
+  g_array_append_val (entries, entry);
+}
+
+/* Move the cursor past whitespace and comments, across lines, to the
+   start of the next token.  */
+static gboolean
+smie_indent_skip_forward (const smie_cursor_functions_t *functions,
+			  gpointer context)
+{
+  gboolean moved = FALSE;
+
+  while (functions->forward_comment (context)
+	 || (functions->ends_line (context)
+	     && functions->forward_char (context)))
+    moved = TRUE;
+  return moved;
+}
+
+/* Cursor functions bound to a context, for the scanning functions
+   which only take the context.  */
+struct smie_indent_cursor_t
+{
+  const smie_cursor_functions_t *functions;
+  gpointer context;
+};
+
+static gchar *
+smie_indent_cursor_forward_token (gpointer data)
+{
+  struct smie_indent_cursor_t *cursor = data;
+  return cursor->functions->forward_token (cursor->context);
+}
+
+static gboolean
+smie_indent_cursor_skip_forward (gpointer data)
+{
+  struct smie_indent_cursor_t *cursor = data;
+  return smie_indent_skip_forward (cursor->functions, cursor->context);
+}
+
+static gint
+smie_indent_cursor_get_offset (gpointer data)
+{
+  struct smie_indent_cursor_t *cursor = data;
+  return cursor->functions->get_offset (cursor->context);
+}
+
+/* Read the keywords from the cursor up to END into STACK, and leave
+   the cursor at the start of the first token from END.  Return the end
+   of the last token read, or -1 if none.  Stop early if BUDGET runs
+   out.  */
+static gint
+smie_keyword_stack_scan (smie_indenter_t *indenter,
+			 smie_grammar_t *grammar,
+			 smie_scan_budget_t *budget,
+			 gpointer context,
+			 gint end,
+			 struct smie_keyword_stack_t *stack)
+{
+  gint last = -1;
+
+  for (;;)
+    {
+      const smie_symbol_t *symbol;
+      gchar *token;
+      gint start;
+
+      smie_indent_skip_forward (indenter->functions, context);
+      start = indenter->functions->get_offset (context);
+      if (start >= end || (budget && !smie_scan_budget_consume (budget)))
+	break;
+      token = indenter->functions->forward_token (context);
+      if (!token)
+	break;
+      last = indenter->functions->get_offset (context);
+      symbol = smie_indent_lookup_keyword (grammar, token);
+      g_free (token);
+      if (symbol)
+	smie_keyword_stack_push (stack, start, symbol,
+				 g_hash_table_lookup (grammar->levels,
+						      symbol));
+    }
+  return last;
+}
+
+/* Add checkpoints until the next one would be after OFFSET.  The
+   text is read without MEMO_LOCK held, and each checkpoint is added
+   only if the table has not changed meanwhile.  */
+static void
+smie_checkpoints_extend (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 gpointer context,
+			 gint offset)
+{
+  for (;;)
+    {
+      struct smie_checkpoint_t last, checkpoint;
+      guint n, interval, line;
+      gboolean added = FALSE;
+
+      g_mutex_lock (&indenter->memo_lock);
+      if (!indenter->checkpoints || state->generation != indenter->generation)
+	{
+	  g_mutex_unlock (&indenter->memo_lock);
+	  return;
+	}
+      if (indenter->checkpoint_grammar != state->grammar)
+	smie_checkpoints_truncate (indenter, 0);
+      if (indenter->checkpoints->len == 0)
+	{
+	  indenter->checkpoint_grammar = smie_grammar_ref (state->grammar);
+	  checkpoint.start = 0;
+	  checkpoint.next = 0;
+	  checkpoint.end = -1;
+	  checkpoint.stack = smie_keyword_stack_new ();
+	  g_array_append_val (indenter->checkpoints, checkpoint);
+	}
+      n = indenter->checkpoints->len;
+      last = *SMIE_CHECKPOINT (indenter->checkpoints, n - 1);
+      checkpoint.stack = smie_keyword_stack_copy (last.stack);
+      interval = indenter->checkpoint_interval;
+      g_mutex_unlock (&indenter->memo_lock);
+
+      indenter->functions->set_offset (context, last.start);
+      for (line = 0; line < interval; line++)
+	if (!indenter->functions->forward_line (context))
+	  break;
+      checkpoint.start = indenter->functions->get_offset (context);
+      if (line == interval && checkpoint.start <= offset)
+	{
+	  indenter->functions->set_offset (context, last.next);
+	  checkpoint.end = smie_keyword_stack_scan (indenter, state->grammar,
+						    state->budget, context,
+						    checkpoint.start,
+						    checkpoint.stack);
+	  if (checkpoint.end < 0)
+	    checkpoint.end = last.end;
+	  checkpoint.next = indenter->functions->get_offset (context);
+
+	  g_mutex_lock (&indenter->memo_lock);
+	  if (!SMIE_INDENT_GAVE_UP (state)
+	      && indenter->checkpoints
+	      && state->generation == indenter->generation
+	      && indenter->checkpoint_grammar == state->grammar
+	      && indenter->checkpoint_interval == interval
+	      && indenter->checkpoints->len == n
+	      && SMIE_CHECKPOINT (indenter->checkpoints, n - 1)->start
+	      == last.start)
+	    {
+	      g_array_append_val (indenter->checkpoints, checkpoint);
+	      added = TRUE;
+	    }
+	  g_mutex_unlock (&indenter->memo_lock);
+	}
+
+      if (!added)
+	{
+	  smie_keyword_stack_free (checkpoint.stack);
+	  return;
+	}
+    }
+}
+
+/* Store into CHECKPOINT the last checkpoint at or before OFFSET, with
+   a copy of its stack, after adding the checkpoints up to it.  Return
+   %FALSE if the table is disabled or the text has changed since STATE
+   was set up.  */
+static gboolean
+smie_checkpoints_lookup (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 gpointer context,
+			 gint offset,
+			 struct smie_checkpoint_t *checkpoint)
+{
+  GArray *checkpoints;
+  guint lo, hi;
+  gboolean found = FALSE;
+
+  smie_checkpoints_extend (indenter, state, context, offset);
+
+  g_mutex_lock (&indenter->memo_lock);
+  checkpoints = indenter->checkpoints;
+  if (checkpoints && checkpoints->len > 0
+      && state->generation == indenter->generation
+      && indenter->checkpoint_grammar == state->grammar)
+    {
+      lo = 0;
+      hi = checkpoints->len;
+      while (lo < hi)
+	{
+	  guint mid = lo + (hi - lo) / 2;
+	  if (SMIE_CHECKPOINT (checkpoints, mid)->start <= offset)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      *checkpoint = *SMIE_CHECKPOINT (checkpoints, lo - 1);
+      checkpoint->stack = smie_keyword_stack_copy (checkpoint->stack);
+      found = TRUE;
+    }
+  g_mutex_unlock (&indenter->memo_lock);
+  return found;
+}
+
+/* Record the cursor position, preferably without allocating.  The
+   result must be passed to smie_indent_restore(), in reverse order of
+   the calls when falling back to the context stack.  */
+static smie_cursor_mark_t
+smie_indent_save (smie_indenter_t *indenter, gpointer context)
+{
+  if (indenter->functions->save && indenter->functions->restore)
+    return indenter->functions->save (context);
+  indenter->functions->push_context (context);
+  return 0;
+}
+
+static void
+smie_indent_restore (smie_indenter_t *indenter,
+		     gpointer context,
+		     smie_cursor_mark_t mark)
+{
+  if (indenter->functions->save && indenter->functions->restore)
+    indenter->functions->restore (context, mark);
+  else
+    indenter->functions->pop_context (context);
+}
+
+static gboolean
+smie_indent_has_marks (smie_indenter_t *indenter)
+{
+  return indenter->functions->save && indenter->functions->restore;
+}
+
+/* Read a token with READ, unless it has already been read from the
+   cursor position, in which case move the cursor past it again.  */
+static const gchar *
+smie_indent_read_token (smie_indenter_t *indenter,
+			gpointer context,
+			struct smie_indent_token_t *token,
+			gchar *(* read) (gpointer))
+{
+  gint start = indenter->functions->get_offset (context);
+
+  if (token->start == start && smie_indent_has_marks (indenter))
+    {
+      indenter->functions->restore (context, token->mark);
+      return token->name;
+    }
+
+  g_free (token->name);
+  token->name = read (context);
+  token->start = start;
+  if (smie_indent_has_marks (indenter))
+    token->mark = indenter->functions->save (context);
+  return token->name;
+}
+
+/* Read the token after the cursor.  The strategies tried on a line
+   all start at the beginning of the line, so the token is read only
+   once for them.  The result is owned by STATE.  */
+static const gchar *
+smie_indent_forward_token (smie_indenter_t *indenter,
+			   struct smie_indent_state_t *state,
+			   gpointer context)
+{
+  return smie_indent_read_token (indenter, context, &state->forward_token,
+				 indenter->functions->forward_token);
+}
+
+/* Same as smie_indent_forward_token(), for the token before the
+   cursor.  */
+static const gchar *
+smie_indent_backward_token (smie_indenter_t *indenter,
+			    struct smie_indent_state_t *state,
+			    gpointer context)
+{
+  return smie_indent_read_token (indenter, context, &state->backward_token,
+				 indenter->functions->backward_token);
+}
+
+static void
+smie_indent_state_init (struct smie_indent_state_t *state)
+{
+  memset (state, 0, sizeof (struct smie_indent_state_t));
+  state->low = G_MAXINT;
+  state->high = -1;
+  state->forward_token.start = -1;
+  state->backward_token.start = -1;
+}
+
+static void
+smie_indent_state_clear (struct smie_indent_state_t *state)
+{
+  g_free (state->forward_token.name);
+  g_free (state->backward_token.name);
+}
+
+/* Read the keywords of REGION up to the start of the line of the
+   cursor, which is at the start of the line.  */
+static void
+smie_indent_region_advance (smie_indenter_t *indenter,
+			    struct smie_indent_state_t *state,
+			    gpointer context)
+{
+  struct smie_indent_region_t *region = state->region;
+  gint start, end;
+
+  start = indenter->functions->get_offset (context);
+  indenter->functions->set_offset (context, region->next);
+  end = smie_keyword_stack_scan (indenter, state->grammar, state->budget,
+				 context, start, region->stack);
+  if (end >= 0)
+    region->end = end;
+  region->next = indenter->functions->get_offset (context);
+  region->start = region->end <= start ? start : -1;
+  indenter->functions->set_offset (context, start);
+}
+
+/* Set up REGION with the keywords before the line of the cursor,
+   read from the nearest checkpoint above, so that the backward scans
+   from the line are answered from the stack.  */
+static void
+smie_indent_checkpoint_region (smie_indenter_t *indenter,
+			       struct smie_indent_state_t *state,
+			       gpointer context,
+			       struct smie_indent_region_t *region)
+{
+  struct smie_checkpoint_t checkpoint;
+  smie_cursor_mark_t mark;
+  gint start;
+
+  mark = smie_indent_save (indenter, context);
+  indenter->functions->backward_to_line_start (context);
+  start = indenter->functions->get_offset (context);
+
+  if (smie_checkpoints_lookup (indenter, state, context, start,
+			       &checkpoint))
+    {
+      region->stack = checkpoint.stack;
+      region->next = checkpoint.next;
+      region->end = checkpoint.end;
+      region->start = -1;
+      state->region = region;
+      indenter->functions->set_offset (context, start);
+      smie_indent_region_advance (indenter, state, context);
+
+      /* The keywords read so far do not tell the text before the
+	 line.  */
+      if (SMIE_INDENT_GAVE_UP (state))
+	{
+	  smie_keyword_stack_free (region->stack);
+	  state->region = NULL;
+	}
+    }
+
+  smie_indent_restore (indenter, context, mark);
+}
+
+static gboolean
+smie_indent_starts_line (smie_indenter_t *indenter,
+			 gpointer context)
+{
+  smie_cursor_mark_t mark;
+
+  if (indenter->functions->starts_line (context))
+    return TRUE;
+
+  mark = smie_indent_save (indenter, context);
+  while (indenter->functions->backward_char (context)
+	 && !indenter->functions->starts_line (context))
+    {
+      gunichar uc = indenter->functions->get_char (context);
+      if (!(uc == ' ' || uc == '\t'))
+	{
+	  smie_indent_restore (indenter, context, mark);
+	  return FALSE;
+	}
+    }
+  smie_indent_restore (indenter, context, mark);
+  return TRUE;
+}
+
+/* Returned by an indent function to take the indentation at the
+   cursor, plus the delta recorded in the state.  */
+#define SMIE_INDENT_VIRTUAL -2
+
+/* Basic indentation step used when neither the grammar nor the rule
+   functions give one.  */
+#define SMIE_INDENT_DEFAULT_BASIC 4
+
+/* Defer to the indentation at the cursor, plus DELTA.  The cursor is
+   left there, and MARK is restored once the indentation is known.  */
+static gint
+smie_indent_virtual (struct smie_indent_state_t *state,
+		     smie_cursor_mark_t mark,
+		     gint delta)
+{
+  state->mark = mark;
+  state->delta = delta;
+  return SMIE_INDENT_VIRTUAL;
+}
+
+/* The rules given in the grammar are looked up first, and the rule
+   functions are only called for the symbols the grammar leaves
+   undetermined.  */
+
+static gint
+smie_indent_rule_before (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 const smie_symbol_t *symbol)
+{
+  gint indent = smie_grammar_get_before_offset (state->grammar, symbol);
+  if (indent < 0 && indenter->rules && indenter->rules->before)
+    indent = indenter->rules->before (symbol->name);
+  return indent;
+}
+
+static gint
+smie_indent_rule_after (smie_indenter_t *indenter,
+			struct smie_indent_state_t *state,
+			const smie_symbol_t *symbol)
+{
+  gint indent = smie_grammar_get_after_offset (state->grammar, symbol);
+  if (indent < 0 && indenter->rules && indenter->rules->after)
+    indent = indenter->rules->after (symbol->name);
+  return indent;
+}
+
+static gint
+smie_indent_rule_basic (smie_indenter_t *indenter,
+			struct smie_indent_state_t *state)
+{
+  gint indent = smie_grammar_get_basic_offset (state->grammar);
+  if (indent < 0 && indenter->rules && indenter->rules->basic)
+    indent = indenter->rules->basic ();
+  return indent < 0 ? SMIE_INDENT_DEFAULT_BASIC : indent;
+}
+
+static gboolean
+smie_indent_rule_list_intro (smie_indenter_t *indenter,
+			     struct smie_indent_state_t *state,
+			     const smie_symbol_t *symbol)
+{
+  if (smie_grammar_is_list_intro (state->grammar, symbol))
+    return TRUE;
+  return indenter->rules && indenter->rules->list_intro
+    && indenter->rules->list_intro (symbol->name);
+}
+
+static gboolean
+smie_indent_rule_close_all (smie_indenter_t *indenter,
+			    struct smie_indent_state_t *state,
+			    const smie_symbol_t *symbol)
+{
+  if (smie_grammar_is_close_all (state->grammar, symbol))
+    return TRUE;
+  return indenter->rules && indenter->rules->close_all
+    && indenter->rules->close_all (symbol->name);
+}
+
+static gint
+smie_indent_bob (smie_indenter_t *indenter,
+		 struct smie_indent_state_t *state,
+		 gpointer context)
+{
+  smie_cursor_mark_t mark;
+  gboolean result;
+
+  mark = smie_indent_save (indenter, context);
+  indenter->functions->backward_comment (context);
+  smie_indent_note_line (indenter, state, context);
+  result = indenter->functions->is_start (context);
+  smie_indent_restore (indenter, context, mark);
+  if (result)
+    return 0;
+
+  return -1;
+}
+
+/* Move the cursor from the beginning of a closer to the beginning of
+   the last one of the closers following it on the same line, and
+   return its symbol.  */
+static const smie_symbol_t *
+smie_indent_last_closer (smie_indenter_t *indenter,
+			 struct smie_indent_state_t *state,
+			 const smie_symbol_t *symbol,
+			 gpointer context)
+{
+  const smie_cursor_functions_t *functions = indenter->functions;
+  smie_cursor_mark_t mark;
+  const smie_symbol_t *next;
+  gchar *token;
+
+  g_free (functions->forward_token (context));
+  for (;;)
+    {
+      gunichar uc = functions->get_char (context);
+      if ((uc == ' ' || uc == '\t') && functions->forward_char (context))
+	continue;
+      if (functions->ends_line (context))
+	break;
+
+      mark = smie_indent_save (indenter, context);
+      token = functions->forward_token (context);
+      smie_indent_note (state, functions->get_offset (context));
+      next = token ? smie_indent_lookup_keyword (state->grammar, token) : NULL;
+      g_free (token);
+      smie_indent_restore (indenter, context, mark);
+      if (!next
+	  || (smie_grammar_get_symbol_class (state->grammar, next)
+	      != SMIE_SYMBOL_CLASS_CLOSER))
+	break;
+
+      g_free (functions->forward_token (context));
+      symbol = next;
+    }
+
+  /* Read the last closer backward, so that the cursor is left where a
+     backward scan from it starts.  */
+  g_free (functions->backward_token (context));
+  return symbol;
+}
+
+static gint
+smie_indent_keyword (smie_indenter_t *indenter,
+		     struct smie_indent_state_t *state,
+		     gpointer context)
+{
+  gint offset = indenter->functions->get_offset (context), offset2;
+  const gchar *token;
+  gchar *parent_token;
+  const smie_symbol_t *symbol, *parent_symbol;
+  smie_symbol_class_t symbol_class;
+  smie_sexp_result_t result;
+  gint left_prec, parent_left_prec;
+  smie_cursor_mark_t mark, token_mark;
+  gint indent;
+
+  token_mark = smie_indent_save (indenter, context);
+  token = smie_indent_forward_token (indenter, state, context);
+  smie_indent_note (state, indenter->functions->get_offset (context));
+  smie_indent_restore (indenter, context, token_mark);
+  if (!token)
+    return -1;
+
+  symbol = smie_indent_lookup_keyword (state->grammar, token);
+  if (!symbol)
+    return -1;
+
+  symbol_class = smie_grammar_get_symbol_class (state->grammar, symbol);
+  if (symbol_class == SMIE_SYMBOL_CLASS_OPENER)
+    {
+      indent = smie_indent_rule_before (indenter, state, symbol);
+      if (indent >= 0)
+	return indent;
+
+      /* FIXME: Skip comments.  */
+      if (smie_indent_starts_line (indenter, context))
+	return -1;
+
+      /* FIXME: Check if the token is hanging.  */
+      indent = smie_indent_line_offset (indenter, state, context);
+      return indent;
+    }
+
+  mark = smie_indent_save (indenter, context);
+  if (symbol_class == SMIE_SYMBOL_CLASS_CLOSER
+      && smie_indent_rule_close_all (indenter, state, symbol))
+    symbol = smie_indent_last_closer (indenter, state, symbol, context);
+
+  offset2 = indenter->functions->get_offset (context);
+  if (!smie_indent_backward_sexp (indenter, state, symbol, context, &result))
+    {
+      smie_indent_restore (indenter, context, mark);
+      return -1;
+    }
+  smie_indent_note_line (indenter, state, context);
+  if (offset2 == indenter->functions->get_offset (context))
+    {
+      smie_indent_restore (indenter, context, mark);
+      return -1;
+    }
+
+  /* The scanner tells which keyword it stopped at.  Only when it
+     reached the beginning of buffer, read the first token.  */
+  if (result.symbol)
+    parent_symbol = result.symbol;
+  else
+    {
+      token_mark = smie_indent_save (indenter, context);
+      parent_token = indenter->functions->forward_token (context);
+      smie_indent_restore (indenter, context, token_mark);
+      if (!parent_token)
+	{
+	  smie_indent_restore (indenter, context, mark);
+	  return -1;
+	}
+      parent_symbol = smie_indent_lookup_keyword (state->grammar,
+						  parent_token);
+      g_free (parent_token);
+    }
+
+  /* For later calls to smie_indent_virtual, place the cursor at the
+     beginning of the first token on the line.  */
+  if (indenter->functions->ends_line (context))
+    indenter->functions->forward_char (context);
+  indenter->functions->forward_comment (context);
+
+  left_prec
+    = smie_grammar_get_left_prec (state->grammar, symbol);
+  parent_left_prec = parent_symbol
+    ? smie_grammar_get_left_prec (state->grammar, parent_symbol)
+    : -1;
+
+  if (left_prec == parent_left_prec)
+    {
+      if (offset != indenter->functions->get_offset (context)
+	  && smie_indent_starts_line (indenter, context))
+	{
+	  smie_indent_restore (indenter, context, mark);
+	  return smie_indent_line_offset (indenter, state, context);
+	}
+
+      return smie_indent_virtual (state, mark, 0);
+    }
+
+  if (offset == indenter->functions->get_offset (context)
+      && smie_indent_starts_line (indenter, context))
+    {
+      smie_indent_restore (indenter, context, mark);
+      return -1;
+    }
+
+  if (parent_symbol)
+    {
+      indent = smie_indent_line_offset (indenter, state, context);
+      smie_indent_restore (indenter, context, mark);
+      return indent;
+    }
+
+  return smie_indent_virtual (state, mark, 0);
+}
+
+/* With the cursor at the beginning of the last element of a list on
+   the previous line, return the indentation of the line continuing
+   the list, which is aligned with the first element when the list
+   follows a list-intro keyword on the same line, and -1 otherwise.  */
+static gint
+smie_indent_list_element (smie_indenter_t *indenter,
+			  struct smie_indent_state_t *state,
+			  gpointer context)
+{
+  const smie_symbol_t *symbol;
+  smie_cursor_mark_t mark;
+  gboolean starts_line;
+  gchar *token;
+  gint column;
+
+  for (;;)
+    {
+      /* Take the column at the beginning of the element.  */
+      mark = smie_indent_save (indenter, context);
+      if (indenter->functions->ends_line (context))
+	indenter->functions->forward_char (context);
+      indenter->functions->forward_comment (context);
+      starts_line = smie_indent_starts_line (indenter, context);
+      column = indenter->functions->get_line_offset (context);
+      smie_indent_restore (indenter, context, mark);
+      if (starts_line)
+	return -1;
+
+      token = indenter->functions->backward_token (context);
+      smie_indent_note_line (indenter, state, context);
+      if (!token)
+	return -1;
+
+      symbol = smie_indent_lookup_keyword (state->grammar, token);
+      g_free (token);
+      if (symbol)
+	return smie_indent_rule_list_intro (indenter, state, symbol)
+	  ? column
+	  : -1;
+    }
+}
+
+static gint
+smie_indent_after_keyword (smie_indenter_t *indenter,
+			   struct smie_indent_state_t *state,
+			   gpointer context)
+{
+  const gchar *token;
+  const smie_symbol_t *symbol;
+  smie_symbol_class_t symbol_class;
+  smie_cursor_mark_t mark;
+  gint indent;
+
+  mark = smie_indent_save (indenter, context);
+  token = smie_indent_backward_token (indenter, state, context);
+  smie_indent_note_line (indenter, state, context);
+  if (!token)
+    {
+      smie_indent_restore (indenter, context, mark);
+      return -1;
+    }
+
+  symbol = smie_indent_lookup_keyword (state->grammar, token);
+  if (!symbol)
+    {
+      indent = smie_indent_list_element (indenter, state, context);
+      smie_indent_restore (indenter, context, mark);
+      return indent;
+    }
+
+  indent = smie_indent_rule_after (indenter, state, symbol);
+  if (indent >= 0)
+    {
+      smie_indent_restore (indenter, context, mark);
+      return indent;
+    }
+
+  symbol_class = smie_grammar_get_symbol_class (state->grammar, symbol);
+  if (symbol_class == SMIE_SYMBOL_CLASS_CLOSER)
+    {
+      smie_indent_restore (indenter, context, mark);
+      return -1;
+    }
+
+  /* For later calls to smie_indent_virtual, place the cursor at the
+     beginning of the first token on the line.  */
+  if (indenter->functions->ends_line (context))
+    indenter->functions->forward_char (context);
+  indenter->functions->forward_comment (context);
+
+  if (symbol_class == SMIE_SYMBOL_CLASS_OPENER
+      || smie_grammar_is_pair_end (state->grammar, symbol))
+    return smie_indent_virtual (state, mark,
+				smie_indent_rule_basic (indenter, state));
+  return smie_indent_virtual (state, mark, 0);
+}
+
+static void
+smie_indent_add_strategy (smie_indenter_t *indenter,
+			  const gchar *name,
+			  gint priority,
+			  smie_indent_function_t function,
+			  smie_indent_strategy_func_t func,
+			  gpointer user_data)
+{
+  struct smie_indent_strategy_t strategy;
+  guint i;
+
+  memset (&strategy, 0, sizeof (struct smie_indent_strategy_t));
+  strategy.name = g_strdup (name);
+  strategy.priority = priority;
+  strategy.function = function;
+  strategy.func = func;
+  strategy.user_data = user_data;
+
+  /* Keep the order of addition among the same priority.  */
+  for (i = 0; i < indenter->strategies->len; i++)
+    if (SMIE_INDENT_STRATEGY (indenter->strategies, i)->priority > priority)
+      break;
+  g_array_insert_val (indenter->strategies, i, strategy);
+}
+
+static void
+smie_indent_add_builtin_strategies (smie_indenter_t *indenter)
+{
+  smie_indent_add_strategy (indenter, "bob",
+			    SMIE_INDENT_PRIORITY_BOB,
+			    smie_indent_bob, NULL, NULL);
+  smie_indent_add_strategy (indenter, "keyword",
+			    SMIE_INDENT_PRIORITY_KEYWORD,
+			    smie_indent_keyword, NULL, NULL);
+  smie_indent_add_strategy (indenter, "after-keyword",
+			    SMIE_INDENT_PRIORITY_AFTER_KEYWORD,
+			    smie_indent_after_keyword, NULL, NULL);
+  /* FIXME: implement smie_indent_exps */
+}
+
+/**
+ * smie_indenter_add_strategy:
+ * @indenter: a #smie_indenter_t object
+ * @name: the name of the strategy
+ * @priority: the priority of the strategy; lower values are tried
+ *   first
+ * @func: a #smie_indent_strategy_func_t
+ * @user_data: the data to pass to @func
+ *
+ * Add a strategy to determine the indentation of lines.  For each
+ * line, the strategies are tried in order of priority, until one of
+ * them determines the indentation.  The built-in strategies have the
+ * priorities %SMIE_INDENT_PRIORITY_BOB,
+ * %SMIE_INDENT_PRIORITY_KEYWORD, and
+ * %SMIE_INDENT_PRIORITY_AFTER_KEYWORD.
+ *
+ * This must not be called while indentation is being calculated.
+ */
+void
+smie_indenter_add_strategy (smie_indenter_t *indenter,
+			    const gchar *name,
+			    gint priority,
+			    smie_indent_strategy_func_t func,
+			    gpointer user_data)
+{
+  g_return_if_fail (indenter);
+  g_return_if_fail (name);
+  g_return_if_fail (func);
+
+  smie_indent_add_strategy (indenter, name, priority, NULL, func,
+			    user_data);
+}
+
+/**
+ * smie_indenter_set_strategy_timing:
+ * @indenter: a #smie_indenter_t object
+ * @enabled: whether to measure the time spent in strategies
+ *
+ * Enable or disable the measure of the time spent in each strategy,
+ * reported in the @cost field of smie_indenter_get_strategy_stats().
+ * It is disabled by default, as reading the clock on every call is
+ * not free.
+ */
+void
+smie_indenter_set_strategy_timing (smie_indenter_t *indenter,
+				   gboolean enabled)
+{
+  g_return_if_fail (indenter);
+
+  g_atomic_int_set (&indenter->strategy_timing, enabled ? 1 : 0);
+}
+
+/**
+ * smie_indenter_get_strategy_stats:
+ * @indenter: a #smie_indenter_t object
+ * @name: the name of a strategy
+ * @stats: (out): return location of the statistics
+ *
+ * Get how often the strategy @name has been tried and has determined
+ * the indentation, and the time spent in it, so that the priorities
+ * can be tuned.  The time is only measured after
+ * smie_indenter_set_strategy_timing().  The built-in strategies are
+ * named "bob", "keyword", and "after-keyword".
+ * Returns: %TRUE if the strategy is found, %FALSE otherwise
+ */
+gboolean
+smie_indenter_get_strategy_stats (smie_indenter_t *indenter,
+				  const gchar *name,
+				  smie_indent_strategy_stats_t *stats)
+{
+  guint i;
+
+  g_return_val_if_fail (indenter, FALSE);
+  g_return_val_if_fail (name, FALSE);
+  g_return_val_if_fail (stats, FALSE);
+
+  for (i = 0; i < indenter->strategies->len; i++)
+    {
+      struct smie_indent_strategy_t *strategy
+	= SMIE_INDENT_STRATEGY (indenter->strategies, i);
+      if (strcmp (strategy->name, name) == 0)
+	{
+	  stats->calls = g_atomic_int_get (&strategy->stats.calls);
+	  stats->hits = g_atomic_int_get (&strategy->stats.hits);
+	  g_mutex_lock (&indenter->memo_lock);
+	  stats->cost = strategy->stats.cost;
+	  g_mutex_unlock (&indenter->memo_lock);
+	  return TRUE;
+	}
+    }
+  return FALSE;
+}
+
+/**
+ * smie_indent_query_forward_token:
+ * @query: a #smie_indent_query_t
+ * @context: cursor context
+ *
+ * Move the cursor to the end of the next token, as the @forward_token
+ * cursor function does.  When the token has already been read from
+ * the cursor position by another strategy, it is not read again.
+ * Returns: (transfer none) (nullable): the token, or %NULL
+ */
+const gchar *
+smie_indent_query_forward_token (smie_indent_query_t *query,
+				 gpointer context)
+{
+  g_return_val_if_fail (query, NULL);
+
+  return smie_indent_forward_token (query->indenter, query->state, context);
+}
+
+/**
+ * smie_indent_query_backward_token:
+ * @query: a #smie_indent_query_t
+ * @context: cursor context
+ *
+ * Same as smie_indent_query_forward_token(), for the previous token.
+ * Returns: (transfer none) (nullable): the token, or %NULL
+ */
+const gchar *
+smie_indent_query_backward_token (smie_indent_query_t *query,
+				  gpointer context)
+{
+  g_return_val_if_fail (query, NULL);
+
+  return smie_indent_backward_token (query->indenter, query->state, context);
+}
+
+static gint
+smie_indent_run_strategy (smie_indenter_t *indenter,
+			  struct smie_indent_state_t *state,
+			  gpointer context,
+			  struct smie_indent_strategy_t *strategy)
+{
+  gboolean timing = g_atomic_int_get (&indenter->strategy_timing);
+  gint64 start_time = timing ? g_get_monotonic_time () : 0;
+  gint indent;
+
+  if (strategy->function)
+    indent = strategy->function (indenter, state, context);
+  else
+    {
+      smie_indent_query_t query;
+
+      query.indenter = indenter;
+      query.state = state;
+      indent = strategy->func (&query, context, strategy->user_data);
+    }
+
+  g_atomic_int_add (&strategy->stats.calls, 1);
+  if (indent >= 0 || indent == SMIE_INDENT_VIRTUAL)
+    g_atomic_int_add (&strategy->stats.hits, 1);
+  if (timing)
+    {
+      gint64 cost = g_get_monotonic_time () - start_time;
+
+      g_mutex_lock (&indenter->memo_lock);
+      strategy->stats.cost += cost;
+      g_mutex_unlock (&indenter->memo_lock);
+    }
+  return indent;
+}
+
+/* A line in the chain of lines whose indentation is derived from the
+   next one, through smie_indent_virtual().  */
+struct smie_indent_link_t
+{
+  gint start;
+
+  /* Extent of the line which depends on this one.  */
+  gint low;
+  gint high;
+
+  /* Index of the strategy being tried.  */
+  guint function;
+
+  /* As returned by smie_indent_virtual().  */
+  smie_cursor_mark_t mark;
+  gint delta;
+};
+
+#define SMIE_INDENT_LINK_TOP(chain)					\
+  (&g_array_index ((chain), struct smie_indent_link_t, (chain)->len - 1))
+
+/* Add the line of the cursor to CHAIN.  Return %TRUE if its
+   indentation is already known, and set INDENT to it.  */
+static gboolean
+smie_indent_push_link (smie_indenter_t *indenter,
+		       struct smie_indent_state_t *state,
+		       gpointer context,
+		       GArray *chain,
+		       gint *indent)
+{
+  struct smie_indent_link_t link;
+  struct smie_line_entry_t entry;
+
+  indenter->functions->backward_to_line_start (context);
+
+  /* The extent of this line is recorded apart from that of the line
+     whose indentation is derived from it, and then added to it.  */
+  memset (&link, 0, sizeof (struct smie_indent_link_t));
+  link.start = indenter->functions->get_offset (context);
+  link.low = state->low;
+  link.high = state->high;
+  g_array_append_val (chain, link);
+  state->low = state->high = link.start;
+
+  if (!smie_indent_lookup_line (indenter, state, link.start, context,
+				&entry))
+    return FALSE;
+
+  *indent = entry.indent;
+  state->low = entry.low;
+  state->high = entry.high;
+  return TRUE;
+}
+
+/* Try the strategies on the line of LINK, from the current one.
+   Return an indent value, -1, or SMIE_INDENT_VIRTUAL if the line
+   depends on another line which does not start with the anchor.  */
+static gint
+smie_indent_run_functions (smie_indenter_t *indenter,
+			   struct smie_indent_state_t *state,
+			   gpointer context,
+			   struct smie_indent_link_t *link)
+{
+  gint indent;
+
+  for (; link->function < indenter->strategies->len; link->function++)
+    {
+      indent = smie_indent_run_strategy
+	(indenter, state, context,
+	 SMIE_INDENT_STRATEGY (indenter->strategies, link->function));
+      if (SMIE_INDENT_GAVE_UP (state))
+	return -1;
+      if (indent == SMIE_INDENT_VIRTUAL)
+	{
+	  link->mark = state->mark;
+	  link->delta = state->delta;
+	  if (!smie_indent_starts_line (indenter, context))
+	    return SMIE_INDENT_VIRTUAL;
+	  indent = smie_indent_line_offset (indenter, state, context)
+	    + link->delta;
+	  smie_indent_restore (indenter, context, link->mark);
+	}
+      if (indent >= 0)
+	return indent;
+    }
+  return -1;
+}
+
+/* Calculate the indentation of the line of the cursor.  Rather than
+   recursing whenever an indent function defers to another line, this
+   keeps the chain of those lines on the heap, so that it works the
+   same on threads with small stacks.  Lines in the chain which are
+   already known end it early.  */
+static gint
+smie_indent_calculate (smie_indenter_t *indenter,
+		       struct smie_indent_state_t *state,
+		       gpointer context)
+{
+  GArray *chain;
+  struct smie_indent_link_t *link;
+  gboolean known;
+  gint indent = -1;
+
+  chain = g_array_new (FALSE, FALSE, sizeof (struct smie_indent_link_t));
+  known = smie_indent_push_link (indenter, state, context, chain, &indent);
+  while (chain->len > 0)
+    {
+      link = SMIE_INDENT_LINK_TOP (chain);
+      if (!known)
+	{
+	  indent = smie_indent_run_functions (indenter, state, context, link);
+	  if (SMIE_INDENT_GAVE_UP (state))
+	    {
+	      /* Restore the cursor of the lines waiting for the result.  */
+	      while (chain->len > 1)
+		{
+		  g_array_set_size (chain, chain->len - 1);
+		  smie_indent_restore (indenter, context,
+				       SMIE_INDENT_LINK_TOP (chain)->mark);
+		}
+	      indent = -1;
+	      break;
+	    }
+	  if (indent == SMIE_INDENT_VIRTUAL)
+	    {
+	      known = smie_indent_push_link (indenter, state, context,
+					     chain, &indent);
+	      continue;
+	    }
+	  smie_indent_insert_line (indenter, state, link->start, indent,
+				   context);
+	}
+
+      state->low = MIN (state->low, link->low);
+      state->high = MAX (state->high, link->high);
+      g_array_set_size (chain, chain->len - 1);
+      if (chain->len == 0)
+	break;
+
+      /* Pass the result down to the line which is waiting for it.  If
+	 that does not determine the indentation, try the next indent
+	 function on that line.  */
+      link = SMIE_INDENT_LINK_TOP (chain);
+      indent += link->delta;
+      smie_indent_restore (indenter, context, link->mark);
+      known = indent >= 0;
+      if (known)
+	smie_indent_insert_line (indenter, state, link->start, indent,
+				 context);
+      else
+	link->function++;
+    }
+
+  g_array_free (chain, TRUE);
+  return indent;
+}
+
+/* Calculate the indentation of the line of the cursor, in the text
+   of GENERATION.  */
+static gint
+smie_indent_calculate_line (smie_indenter_t *indenter,
+			    gpointer context,
+			    smie_scan_budget_t *budget,
+			    guint generation)
+{
+  struct smie_indent_state_t state;
+  struct smie_indent_region_t region;
+  gint indent;
+
+  smie_indent_state_init (&state);
+  state.grammar = smie_indenter_get_grammar (indenter);
+  state.budget = budget;
+  state.generation = generation;
+  smie_indent_checkpoint_region (indenter, &state, context, &region);
+  indent = smie_indent_calculate (indenter, &state, context);
+  if (state.region)
+    smie_keyword_stack_free (region.stack);
+  smie_grammar_unref (state.grammar);
+  smie_indent_state_clear (&state);
+  return indent;
+}
+
+/**
  * smie_indenter_calculate:
  * @indenter: a #smie_indenter_t object
  * @context: cursor context
@@ -346,14 +2406,409 @@ static smie_indent_function_t functions[] =
 gint
 smie_indenter_calculate (smie_indenter_t *indenter, gpointer context)
 {
-  gint i;
+  return smie_indenter_calculate_bounded (indenter, context, NULL);
+}
+
+/**
+ * smie_indenter_calculate_bounded:
+ * @indenter: a #smie_indenter_t object
+ * @context: cursor context
+ * @budget: (nullable): a #smie_scan_budget_t
+ *
+ * Same as smie_indenter_calculate(), but stop scanning when @budget
+ * runs out.  In that case, -1 is returned and @budget->exhausted is
+ * set, so that the caller can tell that the indentation is not known
+ * rather than not determined, and fall back to a simpler heuristic.
+ * Returns: an indent value, or -1
+ */
+gint
+smie_indenter_calculate_bounded (smie_indenter_t *indenter,
+				 gpointer context,
+				 smie_scan_budget_t *budget)
+{
+  g_return_val_if_fail (indenter, -1);
+
+  return smie_indent_calculate_line (indenter, context, budget,
+				     smie_indenter_get_generation (indenter));
+}
+
+struct smie_calculate_data_t
+{
+  smie_indenter_t *indenter;
+  gpointer context;
+  guint generation;
+};
+
+static void
+smie_calculate_data_free (gpointer data)
+{
+  struct smie_calculate_data_t *calculate_data = data;
+
+  calculate_data->indenter->functions->free_context (calculate_data->context);
+  smie_indenter_unref (calculate_data->indenter);
+  g_free (calculate_data);
+}
+
+static void
+smie_indenter_calculate_thread (GTask *task,
+				gpointer source_object,
+				gpointer task_data,
+				GCancellable *cancellable)
+{
+  struct smie_calculate_data_t *data = task_data;
+  smie_scan_budget_t budget;
+  gint indent;
+
+  smie_scan_budget_init (&budget, 0, 0);
+  budget.cancellable = cancellable;
+  indent = smie_indent_calculate_line (data->indenter, data->context,
+				       &budget, data->generation);
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  g_task_return_int (task, indent);
+}
+
+/**
+ * smie_indenter_calculate_async:
+ * @indenter: a #smie_indenter_t object
+ * @context: cursor context
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the indentation is
+ *   calculated
+ * @user_data: the data to pass to @callback
+ *
+ * Calculate the indentation level of the current line in a worker
+ * thread.  @context is copied with the @copy_context cursor function
+ * before this returns, and the copy is read from the worker thread, so
+ * it should be a snapshot of the text which does not change when the
+ * caller goes on editing.  Cancelling @cancellable stops the scans
+ * early, for example when the request is superseded by a newer one.
+ *
+ * When the operation is finished, @callback will be called in the
+ * thread-default main context of the calling thread.  Call
+ * smie_indenter_calculate_finish() from @callback to get the result.
+ */
+void
+smie_indenter_calculate_async (smie_indenter_t *indenter,
+			       gpointer context,
+			       GCancellable *cancellable,
+			       GAsyncReadyCallback callback,
+			       gpointer user_data)
+{
+  struct smie_calculate_data_t *data;
+  GTask *task;
+
+  g_return_if_fail (indenter);
+  g_return_if_fail (indenter->functions->copy_context);
+  g_return_if_fail (indenter->functions->free_context);
+
+  data = g_new0 (struct smie_calculate_data_t, 1);
+  data->indenter = smie_indenter_ref (indenter);
+  data->context = indenter->functions->copy_context (context);
+  data->generation = smie_indenter_get_generation (indenter);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, smie_indenter_calculate_async);
+  g_task_set_task_data (task, data, smie_calculate_data_free);
+  g_task_run_in_thread (task, smie_indenter_calculate_thread);
+  g_object_unref (task);
+}
+
+/**
+ * smie_indenter_calculate_finish:
+ * @indenter: a #smie_indenter_t object
+ * @result: a #GAsyncResult
+ * @error: return location of an error
+ *
+ * Finish an operation started with smie_indenter_calculate_async().
+ * Returns: an indent value, or -1 if it is not determined or on error
+ */
+gint
+smie_indenter_calculate_finish (smie_indenter_t *indenter,
+				GAsyncResult *result,
+				GError **error)
+{
+  g_return_val_if_fail (indenter, -1);
+  g_return_val_if_fail (g_task_is_valid (result, NULL), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/* Calculate the indentation of N_LINES lines from the line of the
+   cursor, in a single forward pass.  The keywords are read along, so
+   that the backward scans from the first token of each line are
+   answered from the stack of open constructs, and the indentation of
+   each line is kept for the lines which derive theirs from it.  Return
+   the number of lines calculated.  WORKER is set for the workers of
+   smie_indenter_calculate_region_parallel().  */
+static gint
+smie_indent_lines (smie_indenter_t *indenter,
+		   smie_grammar_t *grammar,
+		   gpointer context,
+		   gint n_lines,
+		   gint *indents,
+		   gboolean worker)
+{
+  struct smie_indent_state_t state;
+  struct smie_indent_region_t region;
+  gint line;
+
+  smie_indent_state_init (&state);
+  state.grammar = grammar;
+  state.lines = g_hash_table_new_full (g_int_hash, g_int_equal,
+				       NULL, g_free);
+  state.generation = smie_indenter_get_generation (indenter);
+  state.worker = worker;
+  if (worker && g_atomic_pointer_get (&indenter->memo))
+    state.memo = g_hash_table_new_full (smie_sexp_memo_hash,
+					smie_sexp_memo_equal,
+					g_free,
+					NULL);
+  if (indenter->functions->set_offset)
+    {
+      region.stack = smie_keyword_stack_new ();
+      region.next = indenter->functions->get_offset (context);
+      region.end = -1;
+      region.start = -1;
+      state.region = &region;
+    }
+  for (line = 0; line < n_lines; line++)
+    {
+      smie_cursor_mark_t mark;
+
+      if (state.region)
+	smie_indent_region_advance (indenter, &state, context);
+      mark = smie_indent_save (indenter, context);
+      indents[line] = smie_indent_calculate (indenter, &state, context);
+      smie_indent_restore (indenter, context, mark);
+      if (line < n_lines - 1 && !indenter->functions->forward_line (context))
+	{
+	  line++;
+	  break;
+	}
+    }
+  if (state.region)
+    smie_keyword_stack_free (region.stack);
+  if (worker)
+    smie_indent_merge_worker (indenter, &state, context);
+  if (state.memo)
+    g_hash_table_unref (state.memo);
+  g_hash_table_unref (state.lines);
+  smie_indent_state_clear (&state);
+  return line;
+}
+
+/**
+ * smie_indenter_calculate_region:
+ * @indenter: a #smie_indenter_t object
+ * @context: cursor context
+ * @first_line: the first line to indent, counting from 0
+ * @last_line: the last line to indent
+ * @indents: (out caller-allocates) (array): return location of the
+ *   indent values, with room for @last_line - @first_line + 1 elements
+ *
+ * Calculate the indentation levels of the lines from @first_line to
+ * @last_line, with the same results as smie_indenter_calculate() on
+ * each of them.  The lines are visited in a single forward pass,
+ * which reads the keywords from @first_line on and keeps the stack of
+ * open constructs, so that the keyword a line is indented relative to
+ * is looked up on the stack rather than by scanning backward.  The
+ * indentation of each line is also kept until the end of the pass,
+ * for the following lines which derive their indentation from it.
+ * This makes reindenting a buffer take roughly linear time, provided
+ * that the @set_offset cursor function is implemented.
+ *
+ * The cursor is left at the beginning of the last line calculated.
+ * Returns: the number of lines calculated, which is less than
+ *   requested if the buffer ends before @last_line
+ */
+gint
+smie_indenter_calculate_region (smie_indenter_t *indenter,
+				gpointer context,
+				gint first_line,
+				gint last_line,
+				gint *indents)
+{
+  smie_grammar_t *grammar;
+  gint line, n_lines;
+
+  g_return_val_if_fail (indenter, 0);
+  g_return_val_if_fail (first_line >= 0, 0);
+  g_return_val_if_fail (indents || last_line < first_line, 0);
 
+  if (last_line < first_line)
+    return 0;
+
+  while (indenter->functions->backward_line (context))
+    ;
   indenter->functions->backward_to_line_start (context);
-  for (i = 0; i < G_N_ELEMENTS (functions); i++)
+  for (line = 0; line < first_line; line++)
+    if (!indenter->functions->forward_line (context))
+      return 0;
+
+  grammar = smie_indenter_get_grammar (indenter);
+  n_lines = smie_indent_lines (indenter, grammar, context,
+			       last_line - first_line + 1, indents, FALSE);
+  smie_grammar_unref (grammar);
+  return n_lines;
+}
+
+/* Number of chunks per thread in smie_indenter_calculate_region_parallel(),
+   so that threads which finish early can take over the remaining
+   chunks.  */
+#define SMIE_INDENT_CHUNKS_PER_THREAD 4
+
+/* A range of lines indented by a thread.  */
+struct smie_indent_chunk_t
+{
+  gpointer context;
+  gint start;
+  gint n_lines;
+  gint *indents;
+};
+
+struct smie_indent_parallel_t
+{
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+};
+
+static void
+smie_indent_chunk_run (gpointer data, gpointer user_data)
+{
+  struct smie_indent_chunk_t *chunk = data;
+  struct smie_indent_parallel_t *parallel = user_data;
+  const smie_cursor_functions_t *functions = parallel->indenter->functions;
+
+  functions->set_offset (chunk->context, chunk->start);
+  smie_indent_lines (parallel->indenter,
+		     parallel->grammar,
+		     chunk->context,
+		     chunk->n_lines,
+		     chunk->indents,
+		     TRUE);
+  functions->free_context (chunk->context);
+}
+
+/**
+ * smie_indenter_calculate_region_parallel:
+ * @indenter: a #smie_indenter_t object
+ * @context: cursor context
+ * @first_line: the first line to indent, counting from 0
+ * @last_line: the last line to indent
+ * @indents: (out caller-allocates) (array): return location of the
+ *   indent values, with room for @last_line - @first_line + 1 elements
+ * @max_threads: the maximum number of threads to use, or 0 to use one
+ *   per processor
+ *
+ * Same as smie_indenter_calculate_region(), but split the lines into
+ * chunks which are indented by a pool of threads, each with its own
+ * copy of @context.  Chunks only start at lines outside of any
+ * construct, found with a #smie_pair_index_t, so that most lines do
+ * not depend on the lines of another chunk.  The results are the same
+ * as those of smie_indenter_calculate_region().  Each thread keeps the
+ * results of its scans and lines to itself, without locking, and adds
+ * them to the memo table and the line cache when its chunk is done.
+ *
+ * This requires the @set_offset, @copy_context and @free_context
+ * cursor functions.  The cursor and rule functions are called from
+ * several threads at once, on different contexts, and the buffer must
+ * not be modified until this function returns.
+ * Returns: the number of lines calculated, which is less than
+ *   requested if the buffer ends before @last_line
+ */
+gint
+smie_indenter_calculate_region_parallel (smie_indenter_t *indenter,
+					 gpointer context,
+					 gint first_line,
+					 gint last_line,
+					 gint *indents,
+					 gint max_threads)
+{
+  const smie_cursor_functions_t *functions;
+  struct smie_indent_parallel_t parallel;
+  struct smie_indent_chunk_t *chunks;
+  struct smie_indent_cursor_t cursor;
+  smie_pair_index_t *index;
+  GThreadPool *pool;
+  GArray *starts;
+  gint line, n_lines, chunk_size, i, j;
+
+  g_return_val_if_fail (indenter, 0);
+  g_return_val_if_fail (first_line >= 0, 0);
+  g_return_val_if_fail (indents || last_line < first_line, 0);
+
+  functions = indenter->functions;
+  g_return_val_if_fail (functions->set_offset, 0);
+  g_return_val_if_fail (functions->copy_context, 0);
+  g_return_val_if_fail (functions->free_context, 0);
+
+  if (last_line < first_line)
+    return 0;
+
+  /* Find the beginning of each line.  */
+  starts = g_array_new (FALSE, FALSE, sizeof (gint));
+  functions->set_offset (context, 0);
+  for (line = 0; line <= last_line; line++)
     {
-      gint indent = functions[i] (indenter, context);
-      if (indent >= 0)
-	return indent;
+      if (line >= first_line)
+	{
+	  gint offset = functions->get_offset (context);
+	  g_array_append_val (starts, offset);
+	}
+      if (line < last_line && !functions->forward_line (context))
+	break;
     }
-  return -1;
+  n_lines = starts->len;
+
+  parallel.indenter = indenter;
+  parallel.grammar = smie_indenter_get_grammar (indenter);
+
+  index = smie_pair_index_new (parallel.grammar);
+  functions->set_offset (context, 0);
+  cursor.functions = functions;
+  cursor.context = context;
+  smie_pair_index_scan (index,
+			smie_indent_cursor_forward_token,
+			smie_indent_cursor_skip_forward,
+			smie_indent_cursor_get_offset,
+			&cursor);
+
+  if (max_threads <= 0)
+    max_threads = g_get_num_processors ();
+  chunk_size = MAX (1, n_lines / (max_threads
+				  * SMIE_INDENT_CHUNKS_PER_THREAD));
+  chunks = g_new (struct smie_indent_chunk_t, n_lines);
+  pool = g_thread_pool_new (smie_indent_chunk_run, &parallel,
+			    max_threads, FALSE, NULL);
+  for (i = 0, j = 0; i < n_lines; i = j)
+    {
+      struct smie_indent_chunk_t *chunk = &chunks[i];
+
+      /* Extend the chunk up to a line outside of any construct.  */
+      for (j = MIN (i + chunk_size, n_lines); j < n_lines; j++)
+	{
+	  gint offset = g_array_index (starts, gint, j);
+	  if (smie_pair_index_get_depth (index, offset - 1) == 0)
+	    break;
+	}
+
+      chunk->context = functions->copy_context (context);
+      chunk->start = g_array_index (starts, gint, i);
+      chunk->n_lines = j - i;
+      chunk->indents = indents + i;
+      g_thread_pool_push (pool, chunk, NULL);
+    }
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (n_lines > 0)
+    functions->set_offset (context,
+			   g_array_index (starts, gint, n_lines - 1));
+
+  g_free (chunks);
+  smie_pair_index_free (index);
+  smie_grammar_unref (parallel.grammar);
+  g_array_free (starts, TRUE);
+  return n_lines;
 }
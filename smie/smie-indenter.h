@@ -30,6 +30,14 @@ G_BEGIN_DECLS
 typedef struct _smie_indenter_t smie_indenter_t;
 typedef struct _smie_cursor_functions_t smie_cursor_functions_t;
 
+/**
+ * smie_cursor_mark_t:
+ *
+ * An opaque value recording a cursor position, returned by the @save
+ * cursor function.
+ */
+typedef guint64 smie_cursor_mark_t;
+
 /**
  * smie_cursor_functions_t:
  * @forward_char: Move the cursor forward by a character, and return
@@ -77,6 +85,20 @@ typedef struct _smie_cursor_functions_t smie_cursor_functions_t;
  *   Otherwise return (gunichar) -1.
  * @push_context: Save the current cursor position to a stack.
  * @pop_context: Restore the previous cursor position from a stack.
+ * @set_offset: Move the cursor to the given offset.  Optional; needed
+ *   by the S-expression memo table, see smie_indenter_set_sexp_memo().
+ * @get_version: Return a number which changes whenever the buffer is
+ *   modified.  Optional.
+ * @copy_context: Return a new context at the same position, which can
+ *   be used from another thread.  Optional; needed by
+ *   smie_indenter_calculate_region_parallel() and
+ *   smie_indenter_calculate_async().
+ * @free_context: Free a context returned by @copy_context.  Optional.
+ * @save: Return a mark for the current cursor position.  Optional;
+ *   when set together with @restore, the indenter uses it instead of
+ *   @push_context and @pop_context.
+ * @restore: Move the cursor to the position recorded in a mark
+ *   returned by @save.  Optional.
  *
  * Set of callback functions used by the indenter.  All those
  * functions take a context object passed to smie_indenter_calculate().
@@ -102,6 +124,12 @@ struct _smie_cursor_functions_t
   gunichar (* get_char) (gpointer);
   void (* push_context) (gpointer);
   void (* pop_context) (gpointer);
+  void (* set_offset) (gpointer, gint);
+  guint (* get_version) (gpointer);
+  gpointer (* copy_context) (gpointer);
+  void (* free_context) (gpointer);
+  smie_cursor_mark_t (* save) (gpointer);
+  void (* restore) (gpointer, smie_cursor_mark_t);
 };
 
 typedef struct _smie_rule_functions_t smie_rule_functions_t;
@@ -121,8 +149,10 @@ typedef struct _smie_rule_functions_t smie_rule_functions_t;
  *   of the last close-paren token on the same line, if there are
  *   multiple, %FALSE otherwise
  *
- * Set of configuration functions used by the indenter.  All those
- * functions except @basic are optional and can be set to %NULL.
+ * Set of configuration functions used by the indenter, for the
+ * tokens not covered by the %rules section of the grammar.  All those
+ * functions are optional and can be set to %NULL.  If neither the
+ * grammar nor @basic gives the basic indentation step, 4 is used.
  */
 struct _smie_rule_functions_t
 {
@@ -134,13 +164,163 @@ struct _smie_rule_functions_t
   gboolean (* close_all) (const gchar *token);
 };
 
+/**
+ * smie_indent_query_t:
+ *
+ * The state of an indentation calculation, passed to strategies added
+ * with smie_indenter_add_strategy().
+ */
+typedef struct _smie_indent_query_t smie_indent_query_t;
+
+/**
+ * smie_indent_strategy_func_t:
+ * @query: a #smie_indent_query_t
+ * @context: cursor context, placed at the beginning of the line
+ * @user_data: the data passed to smie_indenter_add_strategy()
+ *
+ * A function which tries to determine the indentation of the line of
+ * the cursor.  It must restore the cursor position before returning.
+ * Returns: an indent value, or -1 to let the next strategy try
+ */
+typedef gint (* smie_indent_strategy_func_t) (smie_indent_query_t *query,
+					      gpointer context,
+					      gpointer user_data);
+
+typedef struct _smie_indent_strategy_stats_t smie_indent_strategy_stats_t;
+
+/**
+ * smie_indent_strategy_stats_t:
+ * @calls: the number of times the strategy has been tried
+ * @hits: the number of times it has determined the indentation
+ * @cost: the total time spent in it, in microseconds, when measured
+ *   with smie_indenter_set_strategy_timing()
+ *
+ * Statistics of a strategy, see smie_indenter_get_strategy_stats().
+ */
+struct _smie_indent_strategy_stats_t
+{
+  gint calls;
+  gint hits;
+  gint64 cost;
+};
+
+/**
+ * SMIE_INDENT_PRIORITY_BOB:
+ *
+ * Priority of the built-in strategy which indents the first line of
+ * the buffer.
+ */
+#define SMIE_INDENT_PRIORITY_BOB 100
+
+/**
+ * SMIE_INDENT_PRIORITY_KEYWORD:
+ *
+ * Priority of the built-in strategy which indents a line starting
+ * with a keyword.
+ */
+#define SMIE_INDENT_PRIORITY_KEYWORD 200
+
+/**
+ * SMIE_INDENT_PRIORITY_AFTER_KEYWORD:
+ *
+ * Priority of the built-in strategy which indents a line following a
+ * keyword.
+ */
+#define SMIE_INDENT_PRIORITY_AFTER_KEYWORD 300
+
 smie_indenter_t *smie_indenter_new (smie_grammar_t *grammar,
 				    const smie_cursor_functions_t *functions,
 				    const smie_rule_functions_t *rules);
 smie_indenter_t *smie_indenter_ref (smie_indenter_t *indenter);
 void smie_indenter_unref (smie_indenter_t *indenter);
+smie_grammar_t *smie_indenter_get_grammar (smie_indenter_t *indenter);
+void smie_indenter_set_grammar (smie_indenter_t *indenter,
+				smie_grammar_t *grammar);
 gint smie_indenter_calculate (smie_indenter_t *indenter,
 			      gpointer context);
+gint smie_indenter_calculate_bounded (smie_indenter_t *indenter,
+				      gpointer context,
+				      smie_scan_budget_t *budget);
+void smie_indenter_calculate_async (smie_indenter_t *indenter,
+				    gpointer context,
+				    GCancellable *cancellable,
+				    GAsyncReadyCallback callback,
+				    gpointer user_data);
+gint smie_indenter_calculate_finish (smie_indenter_t *indenter,
+				     GAsyncResult *result,
+				     GError **error);
+gint smie_indenter_calculate_region (smie_indenter_t *indenter,
+				     gpointer context,
+				     gint first_line,
+				     gint last_line,
+				     gint *indents);
+gint smie_indenter_calculate_region_parallel (smie_indenter_t *indenter,
+					      gpointer context,
+					      gint first_line,
+					      gint last_line,
+					      gint *indents,
+					      gint max_threads);
+void smie_indenter_set_sexp_memo (smie_indenter_t *indenter,
+				  gboolean enabled);
+void smie_indenter_set_line_cache (smie_indenter_t *indenter,
+				   gboolean enabled);
+void smie_indenter_set_checkpoints (smie_indenter_t *indenter,
+				    guint interval);
+void smie_indenter_add_strategy (smie_indenter_t *indenter,
+				 const gchar *name,
+				 gint priority,
+				 smie_indent_strategy_func_t func,
+				 gpointer user_data);
+void smie_indenter_set_strategy_timing (smie_indenter_t *indenter,
+					gboolean enabled);
+gboolean smie_indenter_get_strategy_stats
+  (smie_indenter_t *indenter,
+   const gchar *name,
+   smie_indent_strategy_stats_t *stats);
+const gchar *smie_indent_query_forward_token (smie_indent_query_t *query,
+					      gpointer context);
+const gchar *smie_indent_query_backward_token (smie_indent_query_t *query,
+					       gpointer context);
+void smie_indenter_invalidate (smie_indenter_t *indenter,
+			       gint offset,
+			       gint removed,
+			       gint inserted);
+
+/**
+ * smie_grammar_monitor_t:
+ *
+ * A grammar file which is recompiled when it changes.
+ */
+typedef struct _smie_grammar_monitor_t smie_grammar_monitor_t;
+
+/**
+ * smie_grammar_monitor_func_t:
+ * @monitor: a #smie_grammar_monitor_t object
+ * @error: (nullable): the error, if the grammar could not be reloaded
+ * @user_data: user data
+ *
+ * Specify the type of function called after a grammar reload attempt.
+ */
+typedef void (* smie_grammar_monitor_func_t) (smie_grammar_monitor_t *monitor,
+					      const GError *error,
+					      gpointer user_data);
+
+smie_grammar_monitor_t *smie_grammar_monitor_new (const gchar *filename,
+						  GError **error);
+smie_grammar_monitor_t *smie_grammar_monitor_ref
+  (smie_grammar_monitor_t *monitor);
+void smie_grammar_monitor_unref (smie_grammar_monitor_t *monitor);
+smie_grammar_t *smie_grammar_monitor_get_grammar
+  (smie_grammar_monitor_t *monitor);
+void smie_grammar_monitor_add_indenter (smie_grammar_monitor_t *monitor,
+					smie_indenter_t *indenter);
+void smie_grammar_monitor_remove_indenter (smie_grammar_monitor_t *monitor,
+					   smie_indenter_t *indenter);
+void smie_grammar_monitor_set_func (smie_grammar_monitor_t *monitor,
+				    smie_grammar_monitor_func_t func,
+				    gpointer user_data,
+				    GDestroyNotify destroy);
+void smie_grammar_monitor_reload (smie_grammar_monitor_t *monitor);
 
 G_END_DECLS
 
@@ -0,0 +1,501 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "smie-private.h"
+#include <string.h>
+
+enum smie_keyword_pattern_type_t
+  {
+    SMIE_KEYWORD_PATTERN_KEYWORD,
+    SMIE_KEYWORD_PATTERN_COMMENT,
+    SMIE_KEYWORD_PATTERN_STRING
+  };
+
+struct smie_keyword_pattern_t
+{
+  enum smie_keyword_pattern_type_t type;
+  gchar *start;
+  gsize length;
+
+  /* For keywords.  */
+  const smie_symbol_t *symbol;
+
+  /* For comments and strings.  */
+  gchar *end;
+  gchar escape;
+};
+
+struct smie_keyword_node_t
+{
+  /* The pattern ending at this node, or -1.  */
+  gint pattern;
+
+  /* The longest proper suffix of this node in the trie.  */
+  gint fail;
+
+  /* The next node on the failure chain which ends a pattern, or 0.  */
+  gint output;
+};
+
+/* The patterns are compiled into a deterministic automaton over byte
+   classes: each byte occurring in a pattern has its own class, and
+   all the other bytes share class 0.  The automaton is rebuilt
+   whenever a pattern is added.  */
+struct _smie_keyword_matcher_t
+{
+  smie_grammar_t *grammar;
+  GPtrArray *patterns;
+  gsize max_length;
+
+  guint16 classes[256];
+  guint n_classes;
+  GArray *nodes;
+  GArray *delta;
+};
+
+#define SMIE_KEYWORD_NODE(matcher, i)					\
+  (&g_array_index ((matcher)->nodes, struct smie_keyword_node_t, (i)))
+#define SMIE_KEYWORD_DELTA(matcher, i, c)				\
+  (g_array_index ((matcher)->delta, gint, (i) * (matcher)->n_classes + (c)))
+
+static void smie_keyword_matcher_build (smie_keyword_matcher_t *matcher);
+
+static void
+smie_keyword_pattern_free (struct smie_keyword_pattern_t *pattern)
+{
+  g_free (pattern->start);
+  g_free (pattern->end);
+  g_free (pattern);
+}
+
+static void
+smie_keyword_matcher_add_pattern (smie_keyword_matcher_t *matcher,
+				  enum smie_keyword_pattern_type_t type,
+				  const gchar *start,
+				  const smie_symbol_t *symbol,
+				  const gchar *end,
+				  gchar escape)
+{
+  struct smie_keyword_pattern_t *pattern;
+
+  pattern = g_new0 (struct smie_keyword_pattern_t, 1);
+  pattern->type = type;
+  pattern->start = g_strdup (start);
+  pattern->length = strlen (start);
+  pattern->symbol = symbol;
+  pattern->end = g_strdup (end);
+  pattern->escape = escape;
+  g_ptr_array_add (matcher->patterns, pattern);
+
+  matcher->max_length = MAX (matcher->max_length, pattern->length);
+}
+
+/**
+ * smie_keyword_matcher_new:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Create a matcher which finds the keywords of @grammar in a flat
+ * buffer, without splitting the other text into tokens.  This lets
+ * a backend which holds the whole buffer in memory jump from keyword
+ * to keyword when skipping S-expressions, since the scanner ignores
+ * all the other tokens anyway.
+ *
+ * A keyword starting or ending with a word character only matches at
+ * a word boundary, so that "if" is not found in "elif" or "iffy".
+ * Where several keywords match, the leftmost and then the longest one
+ * wins.  Use smie_keyword_matcher_add_comment() and
+ * smie_keyword_matcher_add_string() to skip comments and strings.
+ * Returns: a new #smie_keyword_matcher_t object
+ */
+smie_keyword_matcher_t *
+smie_keyword_matcher_new (smie_grammar_t *grammar)
+{
+  smie_keyword_matcher_t *result;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_return_val_if_fail (grammar, NULL);
+
+  result = g_new0 (smie_keyword_matcher_t, 1);
+  result->grammar = smie_grammar_ref (grammar);
+  result->patterns
+    = g_ptr_array_new_with_free_func ((GDestroyNotify)
+				      smie_keyword_pattern_free);
+  result->nodes = g_array_new (FALSE, FALSE,
+			       sizeof (struct smie_keyword_node_t));
+  result->delta = g_array_new (FALSE, FALSE, sizeof (gint));
+
+  g_hash_table_iter_init (&iter, grammar->levels);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const smie_symbol_t *symbol = key;
+      if (symbol->type == SMIE_SYMBOL_TERMINAL && *symbol->name != '\0')
+	smie_keyword_matcher_add_pattern (result,
+					  SMIE_KEYWORD_PATTERN_KEYWORD,
+					  symbol->name,
+					  symbol,
+					  NULL,
+					  '\0');
+    }
+  smie_keyword_matcher_build (result);
+
+  return result;
+}
+
+/**
+ * smie_keyword_matcher_free:
+ * @matcher: a #smie_keyword_matcher_t object
+ *
+ * Free the memory allocated for @matcher.
+ */
+void
+smie_keyword_matcher_free (smie_keyword_matcher_t *matcher)
+{
+  g_return_if_fail (matcher);
+
+  g_ptr_array_unref (matcher->patterns);
+  g_array_free (matcher->nodes, TRUE);
+  g_array_free (matcher->delta, TRUE);
+  smie_grammar_unref (matcher->grammar);
+  g_free (matcher);
+}
+
+/**
+ * smie_keyword_matcher_add_comment:
+ * @matcher: a #smie_keyword_matcher_t object
+ * @start: the string starting a comment
+ * @end: the string ending a comment, e.g. "\n" for line comments
+ *
+ * Skip the comments delimited by @start and @end.  This must not be
+ * called while @matcher is in use in another thread.
+ */
+void
+smie_keyword_matcher_add_comment (smie_keyword_matcher_t *matcher,
+				  const gchar *start,
+				  const gchar *end)
+{
+  g_return_if_fail (matcher);
+  g_return_if_fail (start && *start != '\0');
+  g_return_if_fail (end && *end != '\0');
+
+  smie_keyword_matcher_add_pattern (matcher,
+				    SMIE_KEYWORD_PATTERN_COMMENT,
+				    start,
+				    NULL,
+				    end,
+				    '\0');
+  smie_keyword_matcher_build (matcher);
+}
+
+/**
+ * smie_keyword_matcher_add_string:
+ * @matcher: a #smie_keyword_matcher_t object
+ * @start: the string starting a string literal
+ * @end: the string ending a string literal
+ * @escape: the byte escaping the next byte inside the literal, or '\0'
+ *
+ * Skip the string literals delimited by @start and @end.  This must
+ * not be called while @matcher is in use in another thread.
+ */
+void
+smie_keyword_matcher_add_string (smie_keyword_matcher_t *matcher,
+				 const gchar *start,
+				 const gchar *end,
+				 gchar escape)
+{
+  g_return_if_fail (matcher);
+  g_return_if_fail (start && *start != '\0');
+  g_return_if_fail (end && *end != '\0');
+
+  smie_keyword_matcher_add_pattern (matcher,
+				    SMIE_KEYWORD_PATTERN_STRING,
+				    start,
+				    NULL,
+				    end,
+				    escape);
+  smie_keyword_matcher_build (matcher);
+}
+
+static gint
+smie_keyword_matcher_new_node (smie_keyword_matcher_t *matcher)
+{
+  struct smie_keyword_node_t node = { -1, 0, 0 };
+  gint c;
+
+  g_array_append_val (matcher->nodes, node);
+  for (c = 0; c < matcher->n_classes; c++)
+    {
+      gint next = -1;
+      g_array_append_val (matcher->delta, next);
+    }
+  return matcher->nodes->len - 1;
+}
+
+static void
+smie_keyword_matcher_build (smie_keyword_matcher_t *matcher)
+{
+  GQueue queue = G_QUEUE_INIT;
+  guint i;
+  gint c;
+
+  g_array_set_size (matcher->nodes, 0);
+  g_array_set_size (matcher->delta, 0);
+
+  memset (matcher->classes, 0, sizeof (matcher->classes));
+  matcher->n_classes = 1;
+  for (i = 0; i < matcher->patterns->len; i++)
+    {
+      struct smie_keyword_pattern_t *pattern
+	= g_ptr_array_index (matcher->patterns, i);
+      gsize j;
+
+      for (j = 0; j < pattern->length; j++)
+	{
+	  guchar byte = pattern->start[j];
+	  if (matcher->classes[byte] == 0)
+	    matcher->classes[byte] = matcher->n_classes++;
+	}
+    }
+
+  /* Build the trie.  Later patterns override earlier ones with the
+     same text, so that delimiters take precedence over keywords.  */
+  smie_keyword_matcher_new_node (matcher);
+  for (i = 0; i < matcher->patterns->len; i++)
+    {
+      struct smie_keyword_pattern_t *pattern
+	= g_ptr_array_index (matcher->patterns, i);
+      gint node = 0;
+      gsize j;
+
+      for (j = 0; j < pattern->length; j++)
+	{
+	  c = matcher->classes[(guchar) pattern->start[j]];
+	  if (SMIE_KEYWORD_DELTA (matcher, node, c) < 0)
+	    {
+	      gint next = smie_keyword_matcher_new_node (matcher);
+	      SMIE_KEYWORD_DELTA (matcher, node, c) = next;
+	    }
+	  node = SMIE_KEYWORD_DELTA (matcher, node, c);
+	}
+      SMIE_KEYWORD_NODE (matcher, node)->pattern = i;
+    }
+
+  /* Compute the failure links breadth first, and turn the trie into
+     a complete transition table.  */
+  for (c = 0; c < matcher->n_classes; c++)
+    {
+      gint next = SMIE_KEYWORD_DELTA (matcher, 0, c);
+      if (next < 0)
+	SMIE_KEYWORD_DELTA (matcher, 0, c) = 0;
+      else
+	g_queue_push_tail (&queue, GINT_TO_POINTER (next));
+    }
+
+  while (!g_queue_is_empty (&queue))
+    {
+      gint node = GPOINTER_TO_INT (g_queue_pop_head (&queue));
+      gint fail = SMIE_KEYWORD_NODE (matcher, node)->fail;
+
+      SMIE_KEYWORD_NODE (matcher, node)->output
+	= SMIE_KEYWORD_NODE (matcher, fail)->pattern >= 0
+	? fail
+	: SMIE_KEYWORD_NODE (matcher, fail)->output;
+
+      for (c = 0; c < matcher->n_classes; c++)
+	{
+	  gint next = SMIE_KEYWORD_DELTA (matcher, node, c);
+	  if (next < 0)
+	    SMIE_KEYWORD_DELTA (matcher, node, c)
+	      = SMIE_KEYWORD_DELTA (matcher, fail, c);
+	  else
+	    {
+	      SMIE_KEYWORD_NODE (matcher, next)->fail
+		= SMIE_KEYWORD_DELTA (matcher, fail, c);
+	      g_queue_push_tail (&queue, GINT_TO_POINTER (next));
+	    }
+	}
+    }
+}
+
+static gboolean
+smie_keyword_is_word_byte (gchar byte)
+{
+  /* Treat all non-ASCII bytes as parts of identifiers.  */
+  return g_ascii_isalnum (byte) || byte == '_' || (guchar) byte >= 0x80;
+}
+
+static gboolean
+smie_keyword_at_boundary (const struct smie_keyword_pattern_t *pattern,
+			  const gchar *text,
+			  gsize length,
+			  gsize start)
+{
+  gsize end = start + pattern->length;
+
+  if (pattern->type != SMIE_KEYWORD_PATTERN_KEYWORD)
+    return TRUE;
+
+  if (smie_keyword_is_word_byte (pattern->start[0])
+      && start > 0
+      && smie_keyword_is_word_byte (text[start - 1]))
+    return FALSE;
+
+  if (smie_keyword_is_word_byte (pattern->start[pattern->length - 1])
+      && end < length
+      && smie_keyword_is_word_byte (text[end]))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Find the leftmost-longest pattern at or after FROM.  */
+static gint
+smie_keyword_matcher_search (smie_keyword_matcher_t *matcher,
+			     const gchar *text,
+			     gsize length,
+			     gsize from,
+			     gsize *startp)
+{
+  gint state = 0, best = -1;
+  gsize i, best_start = 0, best_length = 0;
+
+  for (i = from; i < length; i++)
+    {
+      gint node;
+
+      /* No pattern starting at or before BEST_START can end here.  */
+      if (best >= 0 && i >= best_start + matcher->max_length)
+	break;
+
+      state = SMIE_KEYWORD_DELTA (matcher, state,
+				  matcher->classes[(guchar) text[i]]);
+      node = SMIE_KEYWORD_NODE (matcher, state)->pattern >= 0
+	? state
+	: SMIE_KEYWORD_NODE (matcher, state)->output;
+      for (; node > 0; node = SMIE_KEYWORD_NODE (matcher, node)->output)
+	{
+	  gint index = SMIE_KEYWORD_NODE (matcher, node)->pattern;
+	  struct smie_keyword_pattern_t *pattern
+	    = g_ptr_array_index (matcher->patterns, index);
+	  gsize start = i + 1 - pattern->length;
+
+	  if (best >= 0
+	      && (start > best_start
+		  || (start == best_start && pattern->length <= best_length)))
+	    continue;
+
+	  if (smie_keyword_at_boundary (pattern, text, length, start))
+	    {
+	      best = index;
+	      best_start = start;
+	      best_length = pattern->length;
+	    }
+	}
+    }
+
+  *startp = best_start;
+  return best;
+}
+
+/* Return the offset just after the end of the comment or string
+   whose contents start at FROM.  */
+static gsize
+smie_keyword_matcher_skip (const struct smie_keyword_pattern_t *pattern,
+			   const gchar *text,
+			   gsize length,
+			   gsize from)
+{
+  gsize end_length = strlen (pattern->end);
+  gsize i = from;
+
+  while (i < length)
+    {
+      if (pattern->escape != '\0' && text[i] == pattern->escape)
+	i += 2;
+      else if (i + end_length <= length
+	       && memcmp (&text[i], pattern->end, end_length) == 0)
+	return i + end_length;
+      else
+	i++;
+    }
+  return length;
+}
+
+/**
+ * smie_keyword_matcher_next:
+ * @matcher: a #smie_keyword_matcher_t object
+ * @text: the buffer contents
+ * @length: the length of @text in bytes
+ * @offset: (inout): the byte offset to search from; on return, the
+ *   offset of the keyword found
+ * @symbol: (out) (transfer none): return location of the keyword
+ * @match_length: (out) (optional): return location of the length of
+ *   the keyword in bytes
+ *
+ * Find the next keyword in @text at or after @offset, skipping
+ * comments and strings.  @offset must not be inside a comment or a
+ * string.  To continue the search, add @match_length to @offset.
+ * Returns: %TRUE if a keyword was found, %FALSE otherwise
+ */
+gboolean
+smie_keyword_matcher_next (smie_keyword_matcher_t *matcher,
+			   const gchar *text,
+			   gsize length,
+			   gsize *offset,
+			   const smie_symbol_t **symbol,
+			   gsize *match_length)
+{
+  gsize from;
+
+  g_return_val_if_fail (matcher, FALSE);
+  g_return_val_if_fail (text || length == 0, FALSE);
+  g_return_val_if_fail (offset, FALSE);
+  g_return_val_if_fail (symbol, FALSE);
+
+  from = *offset;
+  while (from < length)
+    {
+      struct smie_keyword_pattern_t *pattern;
+      gsize start;
+      gint index;
+
+      index = smie_keyword_matcher_search (matcher, text, length, from,
+					   &start);
+      if (index < 0)
+	break;
+
+      pattern = g_ptr_array_index (matcher->patterns, index);
+      if (pattern->type == SMIE_KEYWORD_PATTERN_KEYWORD)
+	{
+	  *offset = start;
+	  *symbol = pattern->symbol;
+	  if (match_length)
+	    *match_length = pattern->length;
+	  return TRUE;
+	}
+
+      from = smie_keyword_matcher_skip (pattern, text, length,
+					start + pattern->length);
+    }
+
+  return FALSE;
+}
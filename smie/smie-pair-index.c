@@ -0,0 +1,824 @@
+/*
+ * Copyright (C) 2015 Daiki Ueno
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "smie-private.h"
+#include <string.h>
+
+/* A keyword found in the buffer.  Entries are stored in buffer order
+   and refer to each other by their index in the array.
+
+   The parser stack is persistent: each entry pushed to it records the
+   entry below it, and each entry records the top of the stack after
+   it has been read.  Thus the parser state at any entry can be
+   restored without keeping copies of the stack.  */
+struct smie_pair_index_entry_t
+{
+  gint start;
+  gint end;
+  const smie_symbol_t *symbol;
+  const struct smie_level_t *level;
+
+  /* The other end of the pair, or -1.  */
+  gint match;
+
+  /* The opener of the construct enclosing this keyword, or -1.  */
+  gint opener;
+
+  /* The number of constructs enclosing this keyword.  */
+  gint depth;
+
+  /* The top of the stack after reading this keyword.  */
+  gint top;
+
+  /* Valid only if the keyword has been pushed to the stack.  */
+  gint below;
+  gint group;
+  gint group_top;
+  gint nesting;
+};
+
+/* The depths of the keywords are also kept in a segment tree of
+   minimums, so that range queries over depths take logarithmic time.
+   The tree is stored as an array of 2 * CAPACITY nodes, where the
+   node I has children 2I and 2I + 1, and the leaves start at
+   CAPACITY.  Unused leaves hold G_MAXINT.  After an edit, only the
+   leaves of the keywords read again are assigned, and if the keywords
+   after them have moved, theirs; the nodes above them are then
+   recomputed level by level.  */
+struct smie_depth_tree_t
+{
+  gint *nodes;
+  guint capacity;
+};
+
+struct _smie_pair_index_t
+{
+  smie_grammar_t *grammar;
+  GArray *entries;
+  gint top;
+  struct smie_depth_tree_t tree;
+
+  /* Between smie_pair_index_invalidate() and the end of the next
+     smie_pair_index_scan(), the keywords read again are stored in
+     FRESH, and numbered from LO as if they replaced the entries from
+     LO.  The entries from LO to HI overlap the edit and are dropped.
+     Those from HI are kept, and their offsets are to be shifted by
+     DELTA, once the scan reaches one of them, KEPT, with the same
+     parser state as before the edit.  MAP holds the index given to
+     each kept entry before KEPT which has been read again, or -2.  */
+  GArray *fresh;
+  GArray *map;
+  guint lo;
+  guint hi;
+  guint kept;
+  gint delta;
+};
+
+#define SMIE_PAIR_INDEX_ENTRY(index, i)				\
+  (&g_array_index ((index)->entries, struct smie_pair_index_entry_t, (i)))
+
+static void
+smie_depth_tree_init (struct smie_depth_tree_t *tree, guint capacity)
+{
+  guint i;
+
+  tree->capacity = capacity;
+  tree->nodes = g_new (gint, 2 * capacity);
+  for (i = 0; i < 2 * capacity; i++)
+    tree->nodes[i] = G_MAXINT;
+}
+
+static void
+smie_depth_tree_set (struct smie_depth_tree_t *tree, guint i, gint depth)
+{
+  i += tree->capacity;
+  tree->nodes[i] = depth;
+  for (i /= 2; i > 0; i /= 2)
+    tree->nodes[i] = MIN (tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+}
+
+/* Recompute the nodes above the leaves in [LO, HI), after the leaves
+   have been assigned.  Each level is visited once, so this takes time
+   proportional to HI - LO plus the height of the tree.  */
+static void
+smie_depth_tree_update (struct smie_depth_tree_t *tree, guint lo, guint hi)
+{
+  guint i;
+
+  if (lo >= hi)
+    return;
+
+  for (lo += tree->capacity, hi += tree->capacity - 1; lo > 1;
+       lo /= 2, hi /= 2)
+    for (i = lo / 2; i <= hi / 2; i++)
+      tree->nodes[i] = MIN (tree->nodes[2 * i], tree->nodes[2 * i + 1]);
+}
+
+/* Return the minimum depth of the leaves in [LO, HI).  */
+static gint
+smie_depth_tree_min (struct smie_depth_tree_t *tree, guint lo, guint hi)
+{
+  gint result = G_MAXINT;
+
+  for (lo += tree->capacity, hi += tree->capacity; lo < hi;
+       lo /= 2, hi /= 2)
+    {
+      if (lo & 1)
+	{
+	  result = MIN (result, tree->nodes[lo]);
+	  lo++;
+	}
+      if (hi & 1)
+	{
+	  hi--;
+	  result = MIN (result, tree->nodes[hi]);
+	}
+    }
+  return result;
+}
+
+/* Return the last leaf before HI whose depth is less than DEPTH, or
+   -1, looking in the subtree NODE which covers [NODE_LO, NODE_HI).  */
+static gint
+smie_depth_tree_find_last (struct smie_depth_tree_t *tree,
+			   guint node,
+			   guint node_lo,
+			   guint node_hi,
+			   guint hi,
+			   gint depth)
+{
+  guint mid;
+  gint result;
+
+  if (node_lo >= hi || tree->nodes[node] >= depth)
+    return -1;
+  if (node_hi - node_lo == 1)
+    return node_lo;
+
+  mid = node_lo + (node_hi - node_lo) / 2;
+  result = smie_depth_tree_find_last (tree, 2 * node + 1, mid, node_hi,
+				      hi, depth);
+  if (result < 0)
+    result = smie_depth_tree_find_last (tree, 2 * node, node_lo, mid,
+					hi, depth);
+  return result;
+}
+
+/* Make room for N keywords in the tree of INDEX.  */
+static void
+smie_pair_index_reserve (smie_pair_index_t *index, guint n)
+{
+  struct smie_depth_tree_t tree;
+  guint capacity, j;
+
+  if (n <= index->tree.capacity)
+    return;
+
+  for (capacity = index->tree.capacity; capacity < n; capacity *= 2)
+    ;
+  smie_depth_tree_init (&tree, capacity);
+  for (j = 0; j < index->tree.capacity; j++)
+    tree.nodes[tree.capacity + j]
+      = index->tree.nodes[index->tree.capacity + j];
+  smie_depth_tree_update (&tree, 0, index->tree.capacity);
+  g_free (index->tree.nodes);
+  index->tree = tree;
+}
+
+/* Record the depth of the keyword I, growing the tree if needed.  */
+static void
+smie_pair_index_set_depth (smie_pair_index_t *index, guint i, gint depth)
+{
+  smie_pair_index_reserve (index, i + 1);
+  smie_depth_tree_set (&index->tree, i, depth);
+}
+
+/**
+ * smie_pair_index_new:
+ * @grammar: a #smie_grammar_t object
+ *
+ * Create an empty index of the keywords of a buffer.  Fill it with
+ * smie_pair_index_scan().
+ *
+ * The index records, for each keyword, the other end of the pair it
+ * belongs to, the opener of the enclosing construct, and the nesting
+ * depth, so that editors can answer those questions without skipping
+ * S-expressions for each query.
+ * Returns: a new #smie_pair_index_t object
+ */
+smie_pair_index_t *
+smie_pair_index_new (smie_grammar_t *grammar)
+{
+  smie_pair_index_t *result;
+
+  g_return_val_if_fail (grammar, NULL);
+
+  result = g_new0 (smie_pair_index_t, 1);
+  result->grammar = smie_grammar_ref (grammar);
+  result->entries = g_array_new (FALSE, FALSE,
+				 sizeof (struct smie_pair_index_entry_t));
+  result->top = -1;
+  smie_depth_tree_init (&result->tree, 64);
+  return result;
+}
+
+/**
+ * smie_pair_index_free:
+ * @index: a #smie_pair_index_t object
+ *
+ * Free the memory allocated for @index.
+ */
+void
+smie_pair_index_free (smie_pair_index_t *index)
+{
+  g_return_if_fail (index);
+
+  if (index->fresh)
+    {
+      g_array_free (index->fresh, TRUE);
+      g_array_free (index->map, TRUE);
+    }
+  g_array_free (index->entries, TRUE);
+  g_free (index->tree.nodes);
+  smie_grammar_unref (index->grammar);
+  g_free (index);
+}
+
+static gboolean
+smie_pair_index_lookup (smie_grammar_t *grammar,
+			const gchar *name,
+			const smie_symbol_t **symbolp,
+			const struct smie_level_t **levelp)
+{
+  smie_symbol_t symbol;
+
+  symbol.name = (gchar *) name;
+  symbol.type = SMIE_SYMBOL_TERMINAL;
+  return g_hash_table_lookup_extended (grammar->levels, &symbol,
+				       (gpointer *) symbolp,
+				       (gpointer *) levelp);
+}
+
+/* Return the keyword I, in the numbering of the keywords being
+   read.  */
+static struct smie_pair_index_entry_t *
+smie_pair_index_get (smie_pair_index_t *index, gint i)
+{
+  if (index->fresh && i >= (gint) index->lo)
+    return &g_array_index (index->fresh, struct smie_pair_index_entry_t,
+			   i - index->lo);
+  return SMIE_PAIR_INDEX_ENTRY (index, i);
+}
+
+/* Add the keyword ENTRY, whose START, END, SYMBOL and LEVEL are set,
+   after the keywords read so far.  Return its index.  */
+static gint
+smie_pair_index_push (smie_pair_index_t *index,
+		      struct smie_pair_index_entry_t *entry)
+{
+  const struct smie_level_t *level = entry->level;
+  gint top, group = -1;
+  gint i;
+
+  i = index->fresh
+    ? (gint) (index->lo + index->fresh->len)
+    : (gint) index->entries->len;
+
+  entry->match = -1;
+  entry->below = -1;
+  entry->group = -1;
+  entry->group_top = -1;
+  entry->nesting = 0;
+
+  /* Reduce the constructs which bind tighter than the keyword, as
+     smie_forward_sexp() does.  If the keyword continues the construct
+     on the top of the stack, it joins its group.  */
+  top = index->top;
+  while (top >= 0
+	 && SMIE_LEVEL_REDUCE (level, smie_pair_index_get (index, top)->level)
+	 == SMIE_REDUCE_POP)
+    top = smie_pair_index_get (index, top)->below;
+  if (top >= 0
+      && SMIE_LEVEL_REDUCE (level, smie_pair_index_get (index, top)->level)
+      == SMIE_REDUCE_JOIN)
+    {
+      group = smie_pair_index_get (index, top)->group;
+      top = smie_pair_index_get (index, top)->below;
+    }
+
+  if (group >= 0)
+    entry->opener = group;
+  else
+    entry->opener = top >= 0
+      ? smie_pair_index_get (index, top)->group_top
+      : -1;
+  entry->depth = top >= 0
+    ? smie_pair_index_get (index, top)->nesting
+    : 0;
+
+  if (level->symbol_class == SMIE_SYMBOL_CLASS_OPENER)
+    group = i;
+
+  if (level->symbol_class == SMIE_SYMBOL_CLASS_CLOSER)
+    {
+      if (group >= 0)
+	{
+	  smie_pair_index_get (index, group)->match = i;
+	  entry->match = group;
+	}
+    }
+  else
+    {
+      entry->below = top;
+      entry->group = group;
+      entry->nesting = entry->depth + (group >= 0 ? 1 : 0);
+      if (group >= 0)
+	entry->group_top = group;
+      else
+	entry->group_top = top >= 0
+	  ? smie_pair_index_get (index, top)->group_top
+	  : -1;
+      top = i;
+    }
+
+  entry->top = top;
+  index->top = top;
+  if (index->fresh)
+    g_array_append_val (index->fresh, *entry);
+  else
+    {
+      g_array_append_val (index->entries, *entry);
+      smie_pair_index_set_depth (index, i, entry->depth);
+    }
+  return i;
+}
+
+/* Translate the index X of a keyword before the edit into the
+   numbering of the keywords being read, or -2 if it has been
+   dropped.  */
+static gint
+smie_pair_index_renumber (smie_pair_index_t *index, gint x)
+{
+  if (x < (gint) index->lo)
+    return x;
+  if (x < (gint) index->hi)
+    return -2;
+  if (x < (gint) index->kept)
+    return g_array_index (index->map, gint, x - index->hi);
+  return x - index->kept + index->lo + index->fresh->len;
+}
+
+/* Return %TRUE if the stack of the keywords read so far is the same
+   as the stack before the kept keyword KEPT.  */
+static gboolean
+smie_pair_index_same_state (smie_pair_index_t *index)
+{
+  gint x, y;
+
+  x = index->kept > 0
+    ? SMIE_PAIR_INDEX_ENTRY (index, index->kept - 1)->top
+    : -1;
+  y = index->top;
+  while (x >= (gint) index->lo && y >= (gint) index->lo)
+    {
+      struct smie_pair_index_entry_t *old = SMIE_PAIR_INDEX_ENTRY (index, x);
+      struct smie_pair_index_entry_t *new = smie_pair_index_get (index, y);
+
+      if (smie_pair_index_renumber (index, x) != y
+	  || old->level != new->level
+	  || old->nesting != new->nesting
+	  || smie_pair_index_renumber (index, old->group) != new->group
+	  || (smie_pair_index_renumber (index, old->group_top)
+	      != new->group_top))
+	return FALSE;
+      x = old->below;
+      y = new->below;
+    }
+
+  /* Below LO, the stacks share their entries.  */
+  return x == y;
+}
+
+/* Replace the entries from LO to KEPT with the keywords read again,
+   and shift and renumber the entries from KEPT.  If KEPT is the
+   number of entries, they are all dropped.  */
+static void
+smie_pair_index_splice (smie_pair_index_t *index)
+{
+  guint lo = index->lo, kept = index->kept;
+  guint n_fresh = index->fresh->len;
+  guint old_len = index->entries->len, new_len, i;
+  gint top = index->top;
+
+  for (i = kept; i < old_len; i++)
+    {
+      struct smie_pair_index_entry_t *entry
+	= SMIE_PAIR_INDEX_ENTRY (index, i);
+
+      entry->start += index->delta;
+      entry->end += index->delta;
+      entry->match = smie_pair_index_renumber (index, entry->match);
+      entry->opener = smie_pair_index_renumber (index, entry->opener);
+      entry->top = smie_pair_index_renumber (index, entry->top);
+      entry->below = smie_pair_index_renumber (index, entry->below);
+      entry->group = smie_pair_index_renumber (index, entry->group);
+      entry->group_top = smie_pair_index_renumber (index, entry->group_top);
+      if (i == old_len - 1)
+	top = entry->top;
+    }
+
+  if (kept - lo == n_fresh)
+    memcpy (SMIE_PAIR_INDEX_ENTRY (index, lo), index->fresh->data,
+	    n_fresh * sizeof (struct smie_pair_index_entry_t));
+  else
+    {
+      g_array_remove_range (index->entries, lo, kept - lo);
+      g_array_insert_vals (index->entries, lo, index->fresh->data, n_fresh);
+    }
+  new_len = index->entries->len;
+  index->top = top;
+
+  /* The openers read again, or before the edit, may be closed by a
+     kept keyword.  */
+  for (i = lo + n_fresh; i < new_len; i++)
+    {
+      struct smie_pair_index_entry_t *entry
+	= SMIE_PAIR_INDEX_ENTRY (index, i);
+      if (entry->match >= 0 && entry->match < (gint) (lo + n_fresh))
+	SMIE_PAIR_INDEX_ENTRY (index, entry->match)->match = i;
+    }
+
+  /* Update the depths of the keywords read again, and if the kept
+     keywords have moved, their depths as well.  */
+  smie_pair_index_reserve (index, new_len);
+  if (kept - lo == n_fresh)
+    old_len = new_len = lo + n_fresh;
+  for (i = lo; i < MAX (old_len, new_len); i++)
+    index->tree.nodes[index->tree.capacity + i]
+      = i < new_len ? SMIE_PAIR_INDEX_ENTRY (index, i)->depth : G_MAXINT;
+  smie_depth_tree_update (&index->tree, lo, MAX (old_len, new_len));
+
+  g_array_free (index->fresh, TRUE);
+  g_array_free (index->map, TRUE);
+  index->fresh = NULL;
+  index->map = NULL;
+}
+
+/* Called when the keyword LEVEL at START is read after an edit.  Pass
+   the kept keywords before START, which are gone, and return %TRUE if
+   the next kept keyword is the one at START.  */
+static gboolean
+smie_pair_index_pass (smie_pair_index_t *index,
+		      gint start,
+		      const struct smie_level_t *level)
+{
+  struct smie_pair_index_entry_t *entry;
+  gint gone = -2;
+
+  for (; index->kept < index->entries->len; index->kept++)
+    {
+      entry = SMIE_PAIR_INDEX_ENTRY (index, index->kept);
+      if (entry->start + index->delta >= start)
+	return entry->start + index->delta == start && entry->level == level;
+      g_array_append_val (index->map, gone);
+    }
+  return FALSE;
+}
+
+/**
+ * smie_pair_index_scan:
+ * @index: a #smie_pair_index_t object
+ * @next_token_func: a #smie_next_token_function_t function moving forward
+ * @skip_func: a #smie_skip_function_t function moving forward
+ * @get_offset_func: a #smie_get_offset_function_t function
+ * @context: a context pointer
+ *
+ * Read tokens forward from the cursor and add the keywords to @index.
+ * The cursor must be at the beginning of buffer if @index is empty,
+ * and the whole buffer is read.
+ *
+ * After smie_pair_index_invalidate(), the cursor must be at the offset
+ * it returned.  The scan then stops as soon as it reaches a keyword
+ * from after the edit with the same stack of open constructs as
+ * before the edit: the rest of the index is kept, with its offsets
+ * shifted.  This assumes that how the text after a keyword is
+ * tokenized does not depend on the text before it.
+ */
+void
+smie_pair_index_scan (smie_pair_index_t *index,
+		      smie_next_token_function_t next_token_func,
+		      smie_skip_function_t skip_func,
+		      smie_get_offset_function_t get_offset_func,
+		      gpointer context)
+{
+  gchar *name;
+
+  g_return_if_fail (index);
+  g_return_if_fail (next_token_func);
+  g_return_if_fail (skip_func);
+  g_return_if_fail (get_offset_func);
+
+  for (;;)
+    {
+      struct smie_pair_index_entry_t entry;
+      gboolean kept = FALSE;
+      gint i;
+
+      while (skip_func (context))
+	;
+      entry.start = get_offset_func (context);
+      name = next_token_func (context);
+      if (!name)
+	break;
+
+      if (!smie_pair_index_lookup (index->grammar, name,
+				   &entry.symbol, &entry.level))
+	{
+	  g_free (name);
+	  continue;
+	}
+      g_free (name);
+      entry.end = get_offset_func (context);
+
+      if (index->fresh)
+	{
+	  kept = smie_pair_index_pass (index, entry.start, entry.level);
+	  if (kept && smie_pair_index_same_state (index))
+	    {
+	      smie_pair_index_splice (index);
+	      return;
+	    }
+	}
+
+      i = smie_pair_index_push (index, &entry);
+      if (kept)
+	{
+	  g_array_append_val (index->map, i);
+	  index->kept++;
+	}
+    }
+
+  if (index->fresh)
+    {
+      index->kept = index->entries->len;
+      smie_pair_index_splice (index);
+    }
+}
+
+/**
+ * smie_pair_index_invalidate:
+ * @index: a #smie_pair_index_t object
+ * @offset: the offset where the buffer was modified
+ * @removed: the number of characters removed at @offset
+ * @inserted: the number of characters inserted at @offset
+ *
+ * Tell @index that the buffer has been modified.  The keywords
+ * overlapping the modified text are dropped, and the constructs they
+ * closed are reopened.  Call smie_pair_index_scan() from the returned
+ * offset to index the modified text, before querying @index again.
+ * Returns: the offset from which scanning should resume
+ */
+gint
+smie_pair_index_invalidate (smie_pair_index_t *index,
+			    gint offset,
+			    gint removed,
+			    gint inserted)
+{
+  gint lo = 0, hi, top;
+
+  g_return_val_if_fail (index, 0);
+  g_return_val_if_fail (offset >= 0, 0);
+  g_return_val_if_fail (removed >= 0 && inserted >= 0, 0);
+
+  /* The previous edit has not been scanned; give up on the keywords
+     after it.  */
+  if (index->fresh)
+    {
+      index->kept = index->entries->len;
+      smie_pair_index_splice (index);
+    }
+
+  /* Find the first keyword which can be affected.  A keyword ending
+     exactly at OFFSET may be extended by an insertion.  */
+  hi = index->entries->len;
+  while (lo < hi)
+    {
+      gint mid = lo + (hi - lo) / 2;
+      if (SMIE_PAIR_INDEX_ENTRY (index, mid)->end < offset)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  index->lo = lo;
+
+  /* Likewise, find the first keyword after the modified text.  */
+  hi = index->entries->len;
+  while (lo < hi)
+    {
+      gint mid = lo + (hi - lo) / 2;
+      if (SMIE_PAIR_INDEX_ENTRY (index, mid)->start <= offset + removed)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  index->hi = lo;
+  index->kept = lo;
+  index->delta = inserted - removed;
+  index->fresh = g_array_new (FALSE, FALSE,
+			      sizeof (struct smie_pair_index_entry_t));
+  index->map = g_array_new (FALSE, FALSE, sizeof (gint));
+
+  /* Restore the stack, and reopen the constructs whose closer may
+     change.  Only those are on the stack.  */
+  lo = index->lo;
+  index->top = lo > 0 ? SMIE_PAIR_INDEX_ENTRY (index, lo - 1)->top : -1;
+  for (top = index->top; top >= 0;
+       top = SMIE_PAIR_INDEX_ENTRY (index, top)->below)
+    {
+      gint group = SMIE_PAIR_INDEX_ENTRY (index, top)->group;
+      if (group >= 0 && SMIE_PAIR_INDEX_ENTRY (index, group)->match >= lo)
+	SMIE_PAIR_INDEX_ENTRY (index, group)->match = -1;
+    }
+
+  return lo > 0 ? SMIE_PAIR_INDEX_ENTRY (index, lo - 1)->end : 0;
+}
+
+/* Return the index of the last keyword starting at or before OFFSET,
+   or -1.  */
+static gint
+smie_pair_index_find (smie_pair_index_t *index, gint offset)
+{
+  gint lo = 0, hi = index->entries->len;
+
+  while (lo < hi)
+    {
+      gint mid = lo + (hi - lo) / 2;
+      if (SMIE_PAIR_INDEX_ENTRY (index, mid)->start <= offset)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo - 1;
+}
+
+/**
+ * smie_pair_index_find_match:
+ * @index: a #smie_pair_index_t object
+ * @offset: the offset of a keyword
+ *
+ * Find the other end of the pair the keyword at @offset belongs to,
+ * that is the closer of an opener, or the opener of a closer.
+ * Returns: the offset of the matching keyword, or -1
+ */
+gint
+smie_pair_index_find_match (smie_pair_index_t *index, gint offset)
+{
+  gint i;
+
+  g_return_val_if_fail (index, -1);
+
+  i = smie_pair_index_find (index, offset);
+  if (i < 0 || SMIE_PAIR_INDEX_ENTRY (index, i)->start != offset)
+    return -1;
+  i = SMIE_PAIR_INDEX_ENTRY (index, i)->match;
+  return i >= 0 ? SMIE_PAIR_INDEX_ENTRY (index, i)->start : -1;
+}
+
+/**
+ * smie_pair_index_find_opener:
+ * @index: a #smie_pair_index_t object
+ * @offset: an offset
+ *
+ * Find the opener of the innermost construct enclosing @offset.  If
+ * @offset is on a keyword which continues or closes a construct, such
+ * as "then" or "fi", the opener of that construct is returned.
+ * Returns: the offset of the opener, or -1 at top level
+ */
+gint
+smie_pair_index_find_opener (smie_pair_index_t *index, gint offset)
+{
+  struct smie_pair_index_entry_t *entry;
+  gint i;
+
+  g_return_val_if_fail (index, -1);
+
+  i = smie_pair_index_find (index, offset);
+  if (i < 0)
+    return -1;
+
+  entry = SMIE_PAIR_INDEX_ENTRY (index, i);
+  if (offset < entry->end)
+    i = entry->opener;
+  else
+    i = entry->top >= 0
+      ? SMIE_PAIR_INDEX_ENTRY (index, entry->top)->group_top
+      : -1;
+  return i >= 0 ? SMIE_PAIR_INDEX_ENTRY (index, i)->start : -1;
+}
+
+/**
+ * smie_pair_index_get_depth:
+ * @index: a #smie_pair_index_t object
+ * @offset: an offset
+ *
+ * Get the number of constructs enclosing @offset.  Keywords which
+ * continue or close a construct have the same depth as its opener.
+ * Returns: the nesting depth
+ */
+gint
+smie_pair_index_get_depth (smie_pair_index_t *index, gint offset)
+{
+  struct smie_pair_index_entry_t *entry;
+  gint i;
+
+  g_return_val_if_fail (index, 0);
+
+  i = smie_pair_index_find (index, offset);
+  if (i < 0)
+    return 0;
+
+  entry = SMIE_PAIR_INDEX_ENTRY (index, i);
+  if (offset < entry->end)
+    return entry->depth;
+  return entry->top >= 0
+    ? SMIE_PAIR_INDEX_ENTRY (index, entry->top)->nesting
+    : 0;
+}
+
+/**
+ * smie_pair_index_get_min_depth:
+ * @index: a #smie_pair_index_t object
+ * @start: the start offset of a region
+ * @end: the end offset of a region
+ *
+ * Get the smallest depth of the keywords starting in the region from
+ * @start to @end, which tells how far out an edit in the region can
+ * affect the structure of the buffer.
+ * Returns: the smallest depth, or -1 if there is no keyword
+ */
+gint
+smie_pair_index_get_min_depth (smie_pair_index_t *index,
+			       gint start,
+			       gint end)
+{
+  gint lo, hi;
+
+  g_return_val_if_fail (index, -1);
+
+  lo = smie_pair_index_find (index, start - 1) + 1;
+  hi = smie_pair_index_find (index, end - 1) + 1;
+  if (lo >= hi)
+    return -1;
+
+  return smie_depth_tree_min (&index->tree, lo, hi);
+}
+
+/**
+ * smie_pair_index_find_parent:
+ * @index: a #smie_pair_index_t object
+ * @offset: an offset
+ *
+ * Find the nearest keyword before @offset which is less deeply
+ * nested than @offset, such as "then" for a command in the then
+ * branch of an "if".  This is the keyword smie_backward_sexp() stops
+ * at, and the one indentation is usually relative to.  If @offset is
+ * on a keyword, the depth of the keyword is used.
+ * Returns: the offset of the keyword, or -1
+ */
+gint
+smie_pair_index_find_parent (smie_pair_index_t *index, gint offset)
+{
+  gint depth, i;
+
+  g_return_val_if_fail (index, -1);
+
+  depth = smie_pair_index_get_depth (index, offset);
+  i = smie_pair_index_find (index, offset);
+  if (i >= 0 && offset < SMIE_PAIR_INDEX_ENTRY (index, i)->end)
+    i--;
+  if (i < 0)
+    return -1;
+
+  i = smie_depth_tree_find_last (&index->tree, 1, 0, index->tree.capacity,
+				 i + 1, depth);
+  return i >= 0 ? SMIE_PAIR_INDEX_ENTRY (index, i)->start : -1;
+}
@@ -26,12 +26,27 @@ struct _smie_symbol_pool_t
 {
   volatile gint ref_count;
   GHashTable *allocated;
+
+  /* Symbols indexed by their id.  */
+  GPtrArray *symbols;
 };
 
 struct _smie_symbol_t
 {
   gchar *name;
   smie_symbol_type_t type;
+
+  /* Index of the symbol in the pool, used to address bitsets.  */
+  guint id;
+};
+
+#define SMIE_BITSET_WORD_BITS (sizeof (gulong) * 8)
+
+/* A set of symbol ids.  */
+struct smie_bitset_t
+{
+  guint n_words;
+  gulong *words;
 };
 
 struct smie_rule_t
@@ -56,6 +71,18 @@ struct smie_prec2_t
   const smie_symbol_t *right;
 };
 
+/* Indentation rules read from the %rules section of a grammar.
+   BEFORE and AFTER map symbols to offsets, LIST_INTROS and CLOSE_ALLS
+   are sets of symbols.  BASIC is -1 if unspecified.  */
+struct smie_rules_t
+{
+  gint basic;
+  GHashTable *before;
+  GHashTable *after;
+  GHashTable *list_intros;
+  GHashTable *close_alls;
+};
+
 struct _smie_prec2_grammar_t
 {
   smie_symbol_pool_t *pool;
@@ -63,6 +90,12 @@ struct _smie_prec2_grammar_t
   GHashTable *classes;
   GHashTable *pairs;
   GHashTable *ends;
+
+  /* Maps keywords to their struct smie_zones_t.  */
+  GHashTable *zones;
+
+  /* Indentation rules, or %NULL if the grammar has none.  */
+  struct smie_rules_t *rules;
 };
 
 struct smie_prec_t
@@ -95,19 +128,162 @@ struct smie_func_t
   enum smie_func_type_t type;
 };
 
+/* The non-terminals of a BNF grammar around a keyword, as bit masks
+   indexed by non-terminal.  ZONES holds the left-hand sides of the
+   rules the keyword appears in, LEFT_ZONES those which can end right
+   before the keyword, and RIGHT_ZONES those which can start right
+   after it.  A zero mask means that nothing is known.  */
+struct smie_zones_t
+{
+  guint64 zones;
+  guint64 left_zones;
+  guint64 right_zones;
+};
+
 struct smie_level_t
 {
   gint left_prec;
   gint right_prec;
   smie_symbol_class_t symbol_class;
+  struct smie_zones_t zones;
+};
+
+/* Whether a keyword in ZONES cannot be inside an operand which can only
+   derive from OPERAND_ZONES.  */
+#define SMIE_ZONES_DISJOINT(zones, operand_zones)			\
+  ((zones) != 0 && (operand_zones) != 0 && ((zones) & (operand_zones)) == 0)
+
+/* How a keyword of LEVEL, read forward, acts on the keyword of TOP on
+   the top of the parser stack: it reduces the construct of TOP if that
+   binds tighter, joins it if it continues it, and otherwise is pushed
+   above it.  An opener is always pushed.  */
+enum smie_reduce_t
+  {
+    SMIE_REDUCE_POP,
+    SMIE_REDUCE_JOIN,
+    SMIE_REDUCE_PUSH
+  };
+
+#define SMIE_LEVEL_REDUCE(level, top)					\
+  ((level)->symbol_class == SMIE_SYMBOL_CLASS_OPENER ? SMIE_REDUCE_PUSH	\
+   : (level)->right_prec < (top)->left_prec ? SMIE_REDUCE_POP		\
+   : (level)->right_prec == (top)->left_prec ? SMIE_REDUCE_JOIN		\
+   : SMIE_REDUCE_PUSH)
+
+#define SMIE_LEVEL_STACK_INLINE_SIZE 32
+
+/* Stack of precedence levels used while skipping S-expressions.  The
+   first SMIE_LEVEL_STACK_INLINE_SIZE entries are stored in the
+   structure itself, so that typical nesting needs no heap
+   allocation.  Since LEVELS may point into the structure, it must not
+   be copied.  */
+struct smie_level_stack_t
+{
+  const struct smie_level_t **levels;
+  gsize length;
+  gsize allocated;
+  const struct smie_level_t *inline_levels[SMIE_LEVEL_STACK_INLINE_SIZE];
+};
+
+typedef gboolean (*smie_select_function_t) (const struct smie_level_t *,
+					    gint *);
+
+/* State of an S-expression scan, between two tokens.  */
+struct smie_sexp_state_t
+{
+  smie_select_function_t op_forward;
+  smie_select_function_t op_backward;
+  struct smie_level_stack_t stack;
+  gboolean backward;
+
+  /* The keyword whose operand the scan is in, when the bottom of STACK
+     holds the level of an earlier keyword of the same construct.  */
+  const struct smie_level_t *bottom;
+};
+
+struct _smie_sexp_scanner_t
+{
+  smie_grammar_t *grammar;
+  gboolean backward;
+  struct smie_sexp_state_t state;
+
+  /* Where to resume the scan.  */
+  gint offset;
+
+  gboolean finished;
+  smie_sexp_status_t status;
+  smie_sexp_result_t result;
 };
 
 struct _smie_grammar_t
 {
+  volatile gint ref_count;
   smie_symbol_pool_t *pool;
   GHashTable *levels;
-  GHashTable *pairs;
-  GHashTable *ends;
+
+  /* Indexed by the id of an opener symbol; each element is either a
+     struct smie_bitset_t of closer ids or %NULL.  */
+  GPtrArray *pairs;
+  struct smie_bitset_t ends;
+
+  /* Indentation rules.  BEFORE and AFTER are arrays of offsets indexed
+     by symbol id, where -1 means undetermined; BASIC is -1 if
+     unspecified.  */
+  GArray *before;
+  GArray *after;
+  struct smie_bitset_t list_intros;
+  struct smie_bitset_t close_alls;
+  gint basic;
+};
+
+#define SMIE_GRAMMAR_RESOURCE_PATH "/org/du_a/smie/grammars/"
+
+#define SMIE_COMPILED_MAGIC "SMIE"
+#define SMIE_COMPILED_FORMAT_VERSION 4
+#define SMIE_COMPILED_BYTE_ORDER 0x01020304
+
+enum smie_compiled_symbol_flags_t
+  {
+    SMIE_COMPILED_SYMBOL_HAS_LEVEL = 1 << 0,
+    SMIE_COMPILED_SYMBOL_LIST_INTRO = 1 << 1,
+    SMIE_COMPILED_SYMBOL_CLOSE_ALL = 1 << 2
+  };
+
+/* On-disk representation of a compiled grammar.  The header is
+   followed by the symbol records, the pair records, and the string
+   table holding NUL-terminated symbol names.  All the fields are in
+   host byte order.  */
+struct smie_compiled_header_t
+{
+  gchar magic[4];
+  guint32 format_version;
+  guint32 byte_order;
+  guint32 n_symbols;
+  guint32 n_pairs;
+  guint32 strings_size;
+  gint32 basic;
+};
+
+struct smie_compiled_symbol_t
+{
+  guint32 name;
+  guint32 type;
+  gint32 left_prec;
+  gint32 right_prec;
+  guint32 symbol_class;
+  guint32 flags;
+  gint32 before;
+  gint32 after;
+
+  /* The masks of struct smie_zones_t, split into their low and high
+     halves to keep the records 4-byte aligned.  */
+  guint32 zones[6];
+};
+
+struct smie_compiled_pair_t
+{
+  guint32 opener;
+  guint32 closer;
 };
 
 struct smie_grammar_parser_context_t
@@ -115,6 +291,8 @@ struct smie_grammar_parser_context_t
   smie_bnf_grammar_t *bnf;
   smie_precs_grammar_t *precs;
   GList *resolvers;
+  struct smie_rules_t *rules;
+  gboolean in_rules;
   const gchar *input;
 };
 
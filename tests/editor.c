@@ -43,6 +43,9 @@ struct _EditorApplicationWindow
   GtkSourceFile *file;
   GtkSourceBuffer *buffer;
   smie_indenter_t *indenter;
+  GCancellable *cancellable;
+  GList *pending;
+  GCancellable *indent_cancellable;
 };
 
 struct _EditorApplicationWindowClass
@@ -88,6 +91,7 @@ static const smie_rule_functions_t editor_rules =
   };
 
 static const gchar *grammar_filename;
+static const gchar *grammar_name;
 
 static void
 remove_all_marks (GtkSourceBuffer *buffer)
@@ -100,53 +104,269 @@ remove_all_marks (GtkSourceBuffer *buffer)
 }
 
 static void
-set_indenter (EditorApplicationWindow *window, const gchar *filename)
+apply_indent (EditorApplicationWindow *window, GtkTextIter *iter, gint indent)
+{
+  gint current_indent;
+  GtkTextIter start_iter, end_iter;
+
+  /* Point START_ITER to the beginning of the line.  */
+  gtk_text_iter_assign (&start_iter, iter);
+  while (!gtk_text_iter_is_start (&start_iter)
+	 && !gtk_text_iter_starts_line (&start_iter)
+	 && gtk_text_iter_backward_char (&start_iter))
+    ;
+
+  /* Point END_ITER to the end of the indent and count the offset.  */
+  gtk_text_iter_assign (&end_iter, &start_iter);
+  current_indent = 0;
+  while (!gtk_text_iter_is_end (&end_iter)
+	 && !gtk_text_iter_ends_line (&end_iter)
+	 && g_unichar_isspace (gtk_text_iter_get_char (&end_iter))
+	 && gtk_text_iter_forward_char (&end_iter))
+    current_indent++;
+
+  /* Replace the current indent if it doesn't match the computed one.  */
+  if (indent < current_indent)
+    {
+      gtk_text_iter_forward_chars (&start_iter, indent);
+      gtk_text_buffer_delete (GTK_TEXT_BUFFER (window->buffer),
+			      &start_iter, &end_iter);
+    }
+  else if (indent > current_indent)
+    {
+      gchar *text = g_new0 (gchar, indent - current_indent);
+      memset (text, ' ', (indent - current_indent) * sizeof (gchar));
+      gtk_text_buffer_insert (GTK_TEXT_BUFFER (window->buffer),
+			      &start_iter,
+			      text,
+			      indent - current_indent);
+      g_free (text);
+    }
+}
+
+struct indent_request
+{
+  EditorApplicationWindow *window;
+  smie_indenter_t *indenter;
+  GtkTextMark *mark;
+};
+
+static void
+indent_ready (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  struct indent_request *request = user_data;
+  EditorApplicationWindow *window = request->window;
+  GError *error = NULL;
+  gint indent;
+
+  indent = smie_indenter_calculate_finish (request->indenter, res, &error);
+  if (indent < 0)
+    {
+      /* Cancelled if the buffer has been modified since the request.  */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	g_printf ("indent: cancelled\n");
+      else
+	g_printf ("indent: undetermined\n");
+      g_clear_error (&error);
+    }
+  else
+    {
+      GtkTextIter iter;
+
+      g_printf ("indent: %d\n", indent);
+      gtk_text_buffer_get_iter_at_mark (GTK_TEXT_BUFFER (window->buffer),
+					&iter,
+					request->mark);
+      apply_indent (window, &iter, indent);
+    }
+
+  /* The buffer may be gone if the window has been closed.  */
+  if (!gtk_text_mark_get_deleted (request->mark))
+    gtk_text_buffer_delete_mark (gtk_text_mark_get_buffer (request->mark),
+				 request->mark);
+  g_object_unref (request->mark);
+  smie_indenter_unref (request->indenter);
+  g_object_unref (window);
+  g_free (request);
+}
+
+/* Calculate the indentation of the line at ITER in a worker thread,
+   on a snapshot of the buffer, and apply it unless the buffer is
+   modified in the meantime.  */
+static void
+indent_line (EditorApplicationWindow *window, GtkTextIter *iter)
+{
+  GtkTextBuffer *buffer = GTK_TEXT_BUFFER (window->buffer);
+  smie_gtk_source_snapshot_t *snapshot;
+  struct indent_request *request;
+
+  if (!window->indent_cancellable)
+    window->indent_cancellable = g_cancellable_new ();
+
+  request = g_new0 (struct indent_request, 1);
+  request->window = g_object_ref (window);
+  request->indenter = smie_indenter_ref (window->indenter);
+  request->mark = gtk_text_buffer_create_mark (buffer, NULL, iter, TRUE);
+  g_object_ref (request->mark);
+
+  snapshot = smie_gtk_source_snapshot_new (window->buffer, iter);
+  smie_indenter_calculate_async (window->indenter,
+				 snapshot,
+				 window->indent_cancellable,
+				 indent_ready,
+				 request);
+  smie_gtk_source_snapshot_free (snapshot);
+}
+
+/* Cancel the indentation requests made before the buffer changed.  */
+static void
+cancel_indent (EditorApplicationWindow *window)
+{
+  if (window->indent_cancellable)
+    g_cancellable_cancel (window->indent_cancellable);
+  g_clear_object (&window->indent_cancellable);
+}
+
+static void
+replace_indenter (EditorApplicationWindow *window, smie_grammar_t *grammar)
+{
+  if (window->indenter)
+    smie_indenter_unref (window->indenter);
+  window->indenter
+    = smie_indenter_new (grammar,
+			 &smie_gtk_source_snapshot_cursor_functions,
+			 &editor_rules);
+  smie_indenter_set_sexp_memo (window->indenter, TRUE);
+  smie_indenter_set_line_cache (window->indenter, TRUE);
+  smie_indenter_set_checkpoints (window->indenter, 100);
+}
+
+static void
+buffer_insert_text (GtkTextBuffer *buffer,
+		    GtkTextIter *location,
+		    gchar *text,
+		    gint len,
+		    gpointer user_data)
+{
+  EditorApplicationWindow *window = EDITOR_APPLICATION_WINDOW (user_data);
+
+  cancel_indent (window);
+  if (window->indenter)
+    smie_indenter_invalidate (window->indenter,
+			      gtk_text_iter_get_offset (location),
+			      0,
+			      g_utf8_strlen (text, len));
+}
+
+static void
+buffer_delete_range (GtkTextBuffer *buffer,
+		     GtkTextIter *start,
+		     GtkTextIter *end,
+		     gpointer user_data)
+{
+  EditorApplicationWindow *window = EDITOR_APPLICATION_WINDOW (user_data);
+
+  cancel_indent (window);
+  if (window->indenter)
+    smie_indenter_invalidate (window->indenter,
+			      gtk_text_iter_get_offset (start),
+			      gtk_text_iter_get_offset (end)
+			      - gtk_text_iter_get_offset (start),
+			      0);
+}
+
+/* Drop the indentation requests queued while loading the grammar.  */
+static void
+clear_pending (EditorApplicationWindow *window)
+{
+  GList *l;
+
+  for (l = window->pending; l; l = l->next)
+    {
+      GtkTextMark *mark = l->data;
+
+      if (!gtk_text_mark_get_deleted (mark))
+	gtk_text_buffer_delete_mark (gtk_text_mark_get_buffer (mark), mark);
+    }
+  g_list_free (window->pending);
+  window->pending = NULL;
+}
+
+static void
+grammar_ready (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-  GMappedFile *mapped_file;
-  smie_symbol_pool_t *pool;
-  smie_prec2_grammar_t *prec2;
+  EditorApplicationWindow *window = EDITOR_APPLICATION_WINDOW (user_data);
   smie_grammar_t *grammar;
-  const gchar *contents;
-  GError *error;
+  GList *l;
+  GError *error = NULL;
 
-  error = NULL;
-  mapped_file = g_mapped_file_new (filename, FALSE, &error);
-  if (!mapped_file)
+  grammar = smie_grammar_load_finish (res, &error);
+  if (!grammar)
     {
-      g_warning ("Error while loading the file: %s", error->message);
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+	  g_warning ("Error while loading the grammar: %s; "
+		     "discarding %u pending indentation requests",
+		     error->message,
+		     g_list_length (window->pending));
+	  g_clear_object (&window->cancellable);
+	  clear_pending (window);
+	}
       g_error_free (error);
-      return;
+      goto out;
     }
 
-  pool = smie_symbol_pool_alloc ();
-  error = NULL;
-  contents = (const gchar *) g_mapped_file_get_contents (mapped_file);
-  prec2 = smie_prec2_grammar_load (contents, &error);
-  g_mapped_file_unref (mapped_file);
-  if (!prec2)
+  g_clear_object (&window->cancellable);
+  replace_indenter (window, grammar);
+
+  /* Run the indentation requests queued while loading.  */
+  for (l = window->pending; l; l = l->next)
     {
-      g_warning ("Error while loading the grammar: %s", error->message);
-      g_error_free (error);
-      smie_symbol_pool_unref (pool);
-      return;
+      GtkTextMark *mark = l->data;
+      GtkTextIter iter;
+
+      gtk_text_buffer_get_iter_at_mark (GTK_TEXT_BUFFER (window->buffer),
+					&iter,
+					mark);
+      indent_line (window, &iter);
+      gtk_text_buffer_delete_mark (GTK_TEXT_BUFFER (window->buffer), mark);
     }
+  g_list_free (window->pending);
+  window->pending = NULL;
+
+ out:
+  g_object_unref (window);
+}
 
-  error = NULL;
-  grammar = smie_prec2_to_grammar (prec2, &error);
-  smie_prec2_grammar_free (prec2);
+static void
+set_builtin_indenter (EditorApplicationWindow *window, const gchar *name)
+{
+  smie_grammar_t *grammar;
+  GError *error = NULL;
+
+  grammar = smie_grammar_new_from_resource (name, &error);
   if (!grammar)
     {
-      g_warning ("Error while converting prec2 to grammar: %s", error->message);
+      g_warning ("Error while loading the grammar: %s", error->message);
       g_error_free (error);
-      smie_symbol_pool_unref (pool);
-      smie_grammar_free (grammar);
       return;
     }
 
-  window->indenter
-    = smie_indenter_new (grammar,
-			 &smie_gtk_source_buffer_cursor_functions,
-			 &editor_rules);
+  replace_indenter (window, grammar);
+}
+
+static void
+set_indenter (EditorApplicationWindow *window, const gchar *filename)
+{
+  if (window->cancellable)
+    g_cancellable_cancel (window->cancellable);
+  g_clear_object (&window->cancellable);
+
+  window->cancellable = g_cancellable_new ();
+  smie_grammar_load_async (filename,
+			   window->cancellable,
+			   grammar_ready,
+			   g_object_ref (window));
 }
 
 static void
@@ -184,6 +404,8 @@ load_ready (GObject *source_object, GAsyncResult *res, gpointer user_data)
 
   if (grammar_filename)
     set_indenter (window, grammar_filename);
+  else if (grammar_name)
+    set_builtin_indenter (window, grammar_name);
 
  out:
   g_object_unref (loader);
@@ -233,6 +455,8 @@ editor_application_activate (GApplication *application)
 
   if (grammar_filename)
     set_indenter (window, grammar_filename);
+  else if (grammar_name)
+    set_builtin_indenter (window, grammar_name);
 
   gtk_window_present (GTK_WINDOW (window));
 }
@@ -245,58 +469,23 @@ editor_application_window_key_press_event (GtkWidget *widget,
   if (event->keyval == GDK_KEY_KP_Tab || event->keyval == GDK_KEY_Tab)
     {
       GtkTextMark *mark;
-      smie_gtk_source_buffer_context_t context;
-      gint indent, current_indent;
-      GtkTextIter iter, start_iter, end_iter;
+      GtkTextIter iter;
 
-      memset (&context, 0, sizeof (smie_gtk_source_buffer_context_t));
-      context.buffer = window->buffer;
       mark = gtk_text_buffer_get_insert (GTK_TEXT_BUFFER (window->buffer));
       gtk_text_buffer_get_iter_at_mark (GTK_TEXT_BUFFER (window->buffer),
 					&iter,
 					mark);
-      gtk_text_iter_assign (&context.iter, &iter);
-      indent = smie_indenter_calculate (window->indenter, &context);
-      if (indent < 0)
+      if (window->indenter)
+	indent_line (window, &iter);
+      else if (window->cancellable)
 	{
-	  g_printf ("indent: undetermined\n");
-	  return TRUE;
-	}
-      else
-	g_printf ("indent: %d\n", indent);
-
-      /* Point START_ITER to the beginning of the line.  */
-      gtk_text_iter_assign (&start_iter, &iter);
-      while (!gtk_text_iter_is_start (&start_iter)
-	     && !gtk_text_iter_starts_line (&start_iter)
-	     && gtk_text_iter_backward_char (&start_iter))
-	;
-
-      /* Point END_ITER to the end of the indent and count the offset.  */
-      gtk_text_iter_assign (&end_iter, &start_iter);
-      current_indent = 0;
-      while (!gtk_text_iter_is_end (&end_iter)
-	     && !gtk_text_iter_ends_line (&end_iter)
-	     && g_unichar_isspace (gtk_text_iter_get_char (&end_iter))
-	     && gtk_text_iter_forward_char (&end_iter))
-	current_indent++;
-
-      /* Replace the current indent if it doesn't match the computed one.  */
-      if (indent < current_indent)
-	{
-	  gtk_text_iter_forward_chars (&start_iter, indent);
-	  gtk_text_buffer_delete (GTK_TEXT_BUFFER (window->buffer),
-				  &start_iter, &end_iter);
-	}
-      else if (indent > current_indent)
-	{
-	  gchar *text = g_new0 (gchar, indent - current_indent);
-	  memset (text, ' ', indent * sizeof (gchar));
-	  gtk_text_buffer_insert (GTK_TEXT_BUFFER (window->buffer),
-				  &start_iter,
-				  text,
-				  indent - current_indent);
-	  g_free (text);
+	  /* The grammar is still loading; indent the line once it is
+	     ready.  */
+	  mark = gtk_text_buffer_create_mark (GTK_TEXT_BUFFER (window->buffer),
+					      NULL,
+					      &iter,
+					      TRUE);
+	  window->pending = g_list_append (window->pending, mark);
 	}
       return TRUE;
     }
@@ -315,10 +504,30 @@ editor_application_init (EditorApplication *application)
 {
 }
 
+static void
+editor_application_window_dispose (GObject *object)
+{
+  EditorApplicationWindow *window = EDITOR_APPLICATION_WINDOW (object);
+
+  if (window->cancellable)
+    g_cancellable_cancel (window->cancellable);
+  g_clear_object (&window->cancellable);
+  clear_pending (window);
+  cancel_indent (window);
+  if (window->indenter)
+    {
+      smie_indenter_unref (window->indenter);
+      window->indenter = NULL;
+    }
+
+  G_OBJECT_CLASS (editor_application_window_parent_class)->dispose (object);
+}
+
 static void
 editor_application_window_class_init (EditorApplicationWindowClass *klass)
 {
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+  G_OBJECT_CLASS (klass)->dispose = editor_application_window_dispose;
   gtk_widget_class_set_template_from_resource (widget_class,
 					       "/org/du_a/Editor/editor.ui");
   gtk_widget_class_bind_template_child (widget_class,
@@ -335,12 +544,21 @@ editor_application_window_init (EditorApplicationWindow *window)
 
   view = GTK_TEXT_VIEW (window->view);
   window->buffer = GTK_SOURCE_BUFFER (gtk_text_view_get_buffer (view));
+
+  /* Connect before the default handlers, while the iters still point
+     at the text being modified.  */
+  g_signal_connect (window->buffer, "insert-text",
+		    G_CALLBACK (buffer_insert_text), window);
+  g_signal_connect (window->buffer, "delete-range",
+		    G_CALLBACK (buffer_delete_range), window);
 }
 
 static GOptionEntry entries[] =
   {
     { "grammar", 'g', 0, G_OPTION_ARG_STRING, &grammar_filename,
       "Use FILE as grammar", "FILE" },
+    { "builtin", 'b', 0, G_OPTION_ARG_STRING, &grammar_name,
+      "Use the built-in grammar NAME", "NAME" },
     { NULL }
   };
 
@@ -266,8 +266,10 @@ test_common_backward_comment (gpointer data)
   return offset != context->offset;
 }
 
-static gchar *
-test_common_forward_token (gpointer data)
+gboolean
+test_common_forward_token_slice (gpointer data,
+				 const gchar **token,
+				 gsize *length)
 {
   struct test_common_context_t *context = data;
   goffset offset;
@@ -275,16 +277,20 @@ test_common_forward_token (gpointer data)
 	 && g_ascii_isspace (context->input[context->offset]))
     context->offset++;
   if (context->input[context->offset] == '\0')
-    return NULL;
+    return FALSE;
   offset = context->offset;
   while (context->input[context->offset] != '\0'
 	 && !g_ascii_isspace (context->input[context->offset]))
     context->offset++;
-  return g_strndup (&context->input[offset], context->offset - offset);
+  *token = &context->input[offset];
+  *length = context->offset - offset;
+  return TRUE;
 }
 
-static gchar *
-test_common_backward_token (gpointer data)
+gboolean
+test_common_backward_token_slice (gpointer data,
+				  const gchar **token,
+				  gsize *length)
 {
   struct test_common_context_t *context = data;
   goffset offset;
@@ -292,13 +298,34 @@ test_common_backward_token (gpointer data)
 	 && g_ascii_isspace (context->input[context->offset]))
     context->offset--;
   if (context->offset == 0)
-    return NULL;
+    return FALSE;
   offset = context->offset;
   while (context->offset > 0
 	 && !g_ascii_isspace (context->input[context->offset]))
     context->offset--;
-  return g_strndup (&context->input[context->offset + !!context->offset],
-		    offset - context->offset + !context->offset);
+  *token = &context->input[context->offset + !!context->offset];
+  *length = offset - context->offset + !context->offset;
+  return TRUE;
+}
+
+static gchar *
+test_common_forward_token (gpointer data)
+{
+  const gchar *token;
+  gsize length;
+  if (!test_common_forward_token_slice (data, &token, &length))
+    return NULL;
+  return g_strndup (token, length);
+}
+
+static gchar *
+test_common_backward_token (gpointer data)
+{
+  const gchar *token;
+  gsize length;
+  if (!test_common_backward_token_slice (data, &token, &length))
+    return NULL;
+  return g_strndup (token, length);
 }
 
 static gboolean
@@ -375,6 +402,48 @@ test_common_pop_context (gpointer data)
   context->stack = g_list_delete_link (context->stack, context->stack);
 }
 
+static void
+test_common_set_offset (gpointer data, gint offset)
+{
+  struct test_common_context_t *context = data;
+  context->offset = offset;
+}
+
+static gpointer
+test_common_copy_context (gpointer data)
+{
+  struct test_common_context_t *context = data;
+  struct test_common_context_t *result;
+
+  result = g_new0 (struct test_common_context_t, 1);
+  result->input = context->input;
+  result->offset = context->offset;
+  return result;
+}
+
+static void
+test_common_free_context (gpointer data)
+{
+  struct test_common_context_t *context = data;
+
+  g_list_free (context->stack);
+  g_free (context);
+}
+
+static smie_cursor_mark_t
+test_common_save (gpointer data)
+{
+  struct test_common_context_t *context = data;
+  return context->offset;
+}
+
+static void
+test_common_restore (gpointer data, smie_cursor_mark_t mark)
+{
+  struct test_common_context_t *context = data;
+  context->offset = mark;
+}
+
 smie_cursor_functions_t test_common_cursor_functions =
   {
     test_common_forward_char,
@@ -395,5 +464,11 @@ smie_cursor_functions_t test_common_cursor_functions =
     test_common_get_line_offset,
     test_common_get_char,
     test_common_push_context,
-    test_common_pop_context
+    test_common_pop_context,
+    test_common_set_offset,
+    NULL,
+    test_common_copy_context,
+    test_common_free_context,
+    test_common_save,
+    test_common_restore
   };
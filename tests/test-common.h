@@ -40,6 +40,13 @@ struct test_common_context_t
 
 smie_cursor_functions_t test_common_cursor_functions;
 
+gboolean test_common_forward_token_slice (gpointer data,
+					  const gchar **token,
+					  gsize *length);
+gboolean test_common_backward_token_slice (gpointer data,
+					   const gchar **token,
+					   gsize *length);
+
 G_END_DECLS
 
 #endif	/* __TEST_COMMON_H__ */
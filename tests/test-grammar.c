@@ -22,6 +22,7 @@
 
 #include "tests/test-common.h"
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 #include <string.h>
 
 #ifdef DEBUG
@@ -338,6 +339,1147 @@ test_movement_backward (struct fixture *fixture, gconstpointer user_data)
   g_assert_cmpint (5, ==, context.offset);
 }
 
+static void
+test_movement_full (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context;
+  smie_sexp_result_t result;
+
+  context.input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+
+  context.offset = 1;
+  smie_forward_sexp_full (fixture->grammar,
+			  test_common_cursor_functions.forward_token,
+			  test_common_cursor_functions.get_offset,
+			  NULL,
+			  &context,
+			  &result);
+  g_assert_cmpint (23, ==, context.offset);
+  g_assert (result.symbol);
+  g_assert_cmpstr (")", ==, result.symbol->name);
+  g_assert_cmpint (21, ==, result.offset);
+  g_assert (result.paired);
+
+  context.offset = 23;
+  smie_backward_sexp_full (fixture->grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   NULL,
+			   &context,
+			   &result);
+  g_assert_cmpint (1, ==, context.offset);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("(", ==, result.symbol->name);
+  g_assert_cmpint (1, ==, result.offset);
+  g_assert (result.paired);
+
+  /* Stopping at an enclosing opener is not a pair.  */
+  context.offset = 11;
+  smie_backward_sexp_full (fixture->grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   NULL,
+			   &context,
+			   &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("(", ==, result.symbol->name);
+  g_assert_cmpint (7, ==, result.offset);
+  g_assert (!result.paired);
+}
+
+static void
+test_movement_batch (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context;
+  smie_sexp_result_t results[15], expected;
+  gint offsets[15];
+  gsize i;
+
+  context.input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    offsets[i] = 2 * i;
+
+  context.offset = 0;
+  smie_forward_sexp_batch (fixture->grammar,
+			   test_common_cursor_functions.forward_token,
+			   test_common_cursor_functions.get_offset,
+			   &context,
+			   offsets,
+			   G_N_ELEMENTS (offsets),
+			   results);
+
+  g_assert_cmpstr (")", ==, results[1].symbol->name);
+  g_assert_cmpint (21, ==, results[1].offset);
+  g_assert (results[1].paired);
+  g_assert_cmpstr ("#", ==, results[13].symbol->name);
+  g_assert_cmpint (27, ==, results[13].offset);
+  g_assert (!results[13].paired);
+
+  /* Each result is the same as that of a separate scan.  */
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      context.offset = offsets[i];
+      smie_forward_sexp_full (fixture->grammar,
+			      test_common_cursor_functions.forward_token,
+			      test_common_cursor_functions.get_offset,
+			      NULL,
+			      &context,
+			      &expected);
+      g_assert (expected.symbol == results[i].symbol);
+      if (expected.symbol)
+	g_assert_cmpint (expected.offset, ==, results[i].offset);
+      g_assert_cmpint (expected.paired, ==, results[i].paired);
+    }
+}
+
+static void
+test_movement_bounded (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context;
+  smie_scan_budget_t budget;
+  smie_sexp_result_t result;
+  smie_sexp_status_t status;
+  smie_next_token_function_t forward, backward;
+  smie_get_offset_function_t get_offset;
+
+  forward = test_common_cursor_functions.forward_token;
+  backward = test_common_cursor_functions.backward_token;
+  get_offset = test_common_cursor_functions.get_offset;
+  context.input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+
+  /* The pair spans 11 tokens.  */
+  smie_scan_budget_init (&budget, 5, 0);
+  context.offset = 23;
+  status = smie_backward_sexp_bounded (fixture->grammar,
+				       backward,
+				       get_offset,
+				       NULL,
+				       &context,
+				       &budget,
+				       &result);
+  g_assert_cmpint (SMIE_SEXP_STATUS_GAVE_UP, ==, status);
+  g_assert (budget.exhausted);
+  g_assert (!result.symbol);
+
+  /* An exhausted budget stays exhausted.  */
+  context.offset = 17;
+  status = smie_backward_sexp_bounded (fixture->grammar,
+				       backward,
+				       NULL,
+				       NULL,
+				       &context,
+				       &budget,
+				       NULL);
+  g_assert_cmpint (SMIE_SEXP_STATUS_GAVE_UP, ==, status);
+
+  smie_scan_budget_init (&budget, 100, 0);
+  context.offset = 23;
+  status = smie_backward_sexp_bounded (fixture->grammar,
+				       backward,
+				       get_offset,
+				       NULL,
+				       &context,
+				       &budget,
+				       &result);
+  g_assert_cmpint (SMIE_SEXP_STATUS_PAIRED, ==, status);
+  g_assert_cmpint (1, ==, context.offset);
+  g_assert (!budget.exhausted);
+  g_assert_cmpuint (budget.n_tokens, <=, 100);
+
+  /* A deadline in the past gives up at once.  */
+  smie_scan_budget_init (&budget, 0, 1);
+  context.offset = 1;
+  status = smie_forward_sexp_bounded (fixture->grammar,
+				      forward,
+				      NULL,
+				      NULL,
+				      &context,
+				      &budget,
+				      NULL);
+  g_assert_cmpint (SMIE_SEXP_STATUS_GAVE_UP, ==, status);
+}
+
+static void
+test_movement_resumable (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context;
+  smie_sexp_scanner_t *scanner;
+  smie_scan_budget_t budget;
+  smie_sexp_result_t result;
+  smie_sexp_status_t status;
+  smie_next_token_function_t forward, backward;
+  smie_get_offset_function_t get_offset;
+  gint runs = 0;
+
+  forward = test_common_cursor_functions.forward_token;
+  backward = test_common_cursor_functions.backward_token;
+  get_offset = test_common_cursor_functions.get_offset;
+  context.input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+  context.offset = 23;
+
+  /* Resume the scan two tokens at a time.  */
+  scanner = smie_sexp_scanner_new (fixture->grammar, TRUE, NULL);
+  do
+    {
+      smie_scan_budget_init (&budget, 2, 0);
+      status = smie_sexp_scanner_run (scanner,
+				      backward,
+				      get_offset,
+				      &context,
+				      &budget,
+				      &result);
+      context.offset = smie_sexp_scanner_get_offset (scanner);
+      runs++;
+    }
+  while (status == SMIE_SEXP_STATUS_GAVE_UP);
+
+  g_assert_cmpint (6, ==, runs);
+  g_assert_cmpint (SMIE_SEXP_STATUS_PAIRED, ==, status);
+  g_assert_cmpint (1, ==, context.offset);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("(", ==, result.symbol->name);
+  g_assert_cmpint (1, ==, result.offset);
+  g_assert (result.paired);
+
+  /* A finished scan keeps its result.  */
+  status = smie_sexp_scanner_run (scanner,
+				  backward,
+				  get_offset,
+				  &context,
+				  NULL,
+				  &result);
+  g_assert_cmpint (SMIE_SEXP_STATUS_PAIRED, ==, status);
+  g_assert_cmpint (1, ==, context.offset);
+  smie_sexp_scanner_free (scanner);
+
+  /* A suspended scan can be abandoned.  */
+  context.offset = 1;
+  scanner = smie_sexp_scanner_new (fixture->grammar, FALSE, NULL);
+  smie_scan_budget_init (&budget, 3, 0);
+  status = smie_sexp_scanner_run (scanner,
+				  forward,
+				  get_offset,
+				  &context,
+				  &budget,
+				  NULL);
+  g_assert_cmpint (SMIE_SEXP_STATUS_GAVE_UP, ==, status);
+  g_assert_cmpint (7, ==, smie_sexp_scanner_get_offset (scanner));
+  smie_sexp_scanner_free (scanner);
+}
+
+static void
+test_movement_slice (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context, slice_context;
+  const gchar *input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+  gsize offset;
+
+  context.input = input;
+  slice_context.input = input;
+  for (offset = 1; offset < strlen (input); offset++)
+    {
+      gboolean result, slice_result;
+
+      context.offset = offset;
+      slice_context.offset = offset;
+      result = smie_forward_sexp (fixture->grammar,
+				  test_common_cursor_functions.forward_token,
+				  NULL,
+				  &context);
+      slice_result
+	= smie_forward_sexp_slice (fixture->grammar,
+				   test_common_forward_token_slice,
+				   NULL,
+				   &slice_context);
+      g_assert_cmpint (result, ==, slice_result);
+      g_assert_cmpint (context.offset, ==, slice_context.offset);
+
+      context.offset = offset;
+      slice_context.offset = offset;
+      result = smie_backward_sexp (fixture->grammar,
+				   test_common_cursor_functions.backward_token,
+				   NULL,
+				   &context);
+      slice_result
+	= smie_backward_sexp_slice (fixture->grammar,
+				    test_common_backward_token_slice,
+				    NULL,
+				    &slice_context);
+      g_assert_cmpint (result, ==, slice_result);
+      g_assert_cmpint (context.offset, ==, slice_context.offset);
+    }
+}
+
+static void
+test_movement_deep (struct fixture *fixture, gconstpointer user_data)
+{
+  test_common_context_t context;
+  GString *input;
+  gint i, depth = 1000;
+
+  /* Nest deeper than the inline part of the level stack.  */
+  input = g_string_new ("#");
+  for (i = 0; i < depth; i++)
+    g_string_append (input, " (");
+  g_string_append (input, " 1");
+  for (i = 0; i < depth; i++)
+    g_string_append (input, " )");
+  g_string_append (input, " #");
+
+  context.input = input->str;
+  context.offset = 1;
+  smie_forward_sexp (fixture->grammar,
+		     test_common_cursor_functions.forward_token,
+		     NULL,
+		     &context);
+  g_assert_cmpint (input->len - 2, ==, context.offset);
+
+  smie_backward_sexp (fixture->grammar,
+		      test_common_cursor_functions.backward_token,
+		      NULL,
+		      &context);
+  g_assert_cmpint (1, ==, context.offset);
+
+  g_string_free (input, TRUE);
+}
+
+static gboolean
+skip_whitespace (gpointer data)
+{
+  test_common_context_t *context = data;
+  gint offset = context->offset;
+
+  while (g_ascii_isspace (context->input[context->offset]))
+    context->offset++;
+  return offset != context->offset;
+}
+
+static guint forward_token_count;
+
+static gchar *
+counting_forward_token (gpointer data)
+{
+  forward_token_count++;
+  return test_common_cursor_functions.forward_token (data);
+}
+
+static smie_pair_index_t *
+pair_index_new_for_input (smie_grammar_t *grammar, const gchar *input)
+{
+  test_common_context_t context;
+  smie_pair_index_t *index;
+
+  index = smie_pair_index_new (grammar);
+  context.input = input;
+  context.offset = 0;
+  smie_pair_index_scan (index,
+			test_common_cursor_functions.forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  return index;
+}
+
+/* Check that INDEX answers every query on INPUT as an index built
+   from scratch does.  */
+static void
+assert_pair_index_equal (smie_grammar_t *grammar,
+			 smie_pair_index_t *index,
+			 const gchar *input)
+{
+  smie_pair_index_t *expected;
+  gint offset, end, length = strlen (input);
+
+  expected = pair_index_new_for_input (grammar, input);
+  for (offset = 0; offset <= length; offset++)
+    {
+      g_assert_cmpint (smie_pair_index_find_match (expected, offset),
+		       ==,
+		       smie_pair_index_find_match (index, offset));
+      g_assert_cmpint (smie_pair_index_find_opener (expected, offset),
+		       ==,
+		       smie_pair_index_find_opener (index, offset));
+      g_assert_cmpint (smie_pair_index_get_depth (expected, offset),
+		       ==,
+		       smie_pair_index_get_depth (index, offset));
+      g_assert_cmpint (smie_pair_index_find_parent (expected, offset),
+		       ==,
+		       smie_pair_index_find_parent (index, offset));
+      for (end = offset; end <= length; end += 7)
+	g_assert_cmpint (smie_pair_index_get_min_depth (expected, offset, end),
+			 ==,
+			 smie_pair_index_get_min_depth (index, offset, end));
+    }
+  smie_pair_index_free (expected);
+}
+
+static void
+test_movement_pair_index (struct fixture *fixture, gconstpointer user_data)
+{
+  static const struct
+  {
+    gint offset;
+    gint removed;
+    const gchar *inserted;
+  } edits[] =
+      {
+	/* Delete the inner closer: the rest of the buffer moves out.  */
+	{ 16, 2, "" },
+	/* Put it back.  */
+	{ 16, 0, ") " },
+	/* Rename an operand, which does not change the structure.  */
+	{ 4, 1, "42" },
+	/* Wrap an operand in parentheses.  */
+	{ 25, 1, "( 7 x 7 )" },
+	/* Replace the last keyword.  */
+	{ 42, 1, "x" },
+	/* Insert an unmatched opener at the start.  */
+	{ 0, 0, "( " },
+	{ 0, 2, "" }
+      };
+  test_common_context_t context;
+  smie_pair_index_t *index;
+  GString *input;
+  guint full_count;
+  gsize i;
+  gint offset;
+
+  index = pair_index_new_for_input (fixture->grammar,
+				    "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #");
+
+  g_assert_cmpint (22, ==, smie_pair_index_find_match (index, 2));
+  g_assert_cmpint (2, ==, smie_pair_index_find_match (index, 22));
+  g_assert_cmpint (16, ==, smie_pair_index_find_match (index, 8));
+  g_assert_cmpint (8, ==, smie_pair_index_find_match (index, 16));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_match (index, 6));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_match (index, 3));
+
+  g_assert_cmpint (-1, ==, smie_pair_index_find_opener (index, 0));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_opener (index, 2));
+  g_assert_cmpint (2, ==, smie_pair_index_find_opener (index, 4));
+  g_assert_cmpint (2, ==, smie_pair_index_find_opener (index, 8));
+  g_assert_cmpint (8, ==, smie_pair_index_find_opener (index, 10));
+  g_assert_cmpint (8, ==, smie_pair_index_find_opener (index, 16));
+  g_assert_cmpint (2, ==, smie_pair_index_find_opener (index, 18));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_opener (index, 24));
+
+  g_assert_cmpint (0, ==, smie_pair_index_get_depth (index, 2));
+  g_assert_cmpint (1, ==, smie_pair_index_get_depth (index, 4));
+  g_assert_cmpint (2, ==, smie_pair_index_get_depth (index, 10));
+  g_assert_cmpint (1, ==, smie_pair_index_get_depth (index, 16));
+  g_assert_cmpint (0, ==, smie_pair_index_get_depth (index, 26));
+
+  g_assert_cmpint (8, ==, smie_pair_index_find_parent (index, 10));
+  g_assert_cmpint (2, ==, smie_pair_index_find_parent (index, 20));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_parent (index, 26));
+  g_assert_cmpint (1, ==, smie_pair_index_get_min_depth (index, 8, 20));
+  g_assert_cmpint (2, ==, smie_pair_index_get_min_depth (index, 9, 16));
+  g_assert_cmpint (-1, ==, smie_pair_index_get_min_depth (index, 9, 12));
+
+  /* Delete the inner closer and reindex.  */
+  offset = smie_pair_index_invalidate (index, 16, 2, 0);
+  g_assert_cmpint (13, ==, offset);
+  context.input = "# ( 4 + ( 5 x 6 + 7 ) + 8 #";
+  context.offset = offset;
+  smie_pair_index_scan (index,
+			test_common_cursor_functions.forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  g_assert_cmpint (20, ==, smie_pair_index_find_match (index, 8));
+  g_assert_cmpint (-1, ==, smie_pair_index_find_match (index, 2));
+  g_assert_cmpint (2, ==, smie_pair_index_find_opener (index, 24));
+  g_assert_cmpint (1, ==, smie_pair_index_get_depth (index, 24));
+  smie_pair_index_free (index);
+
+  /* Apply a series of edits to a longer buffer, and check the index
+     against one built from scratch after each of them.  */
+  input = g_string_new ("# ( 4 + ( 5 x 6 ) + 7 ) + 8 + ( 9 x 9 ) + 1 #");
+  index = pair_index_new_for_input (fixture->grammar, input->str);
+  for (i = 0; i < G_N_ELEMENTS (edits); i++)
+    {
+      g_string_erase (input, edits[i].offset, edits[i].removed);
+      g_string_insert (input, edits[i].offset, edits[i].inserted);
+      context.input = input->str;
+      context.offset = smie_pair_index_invalidate (index,
+						   edits[i].offset,
+						   edits[i].removed,
+						   strlen (edits[i].inserted));
+      smie_pair_index_scan (index,
+			    test_common_cursor_functions.forward_token,
+			    skip_whitespace,
+			    test_common_cursor_functions.get_offset,
+			    &context);
+      assert_pair_index_equal (fixture->grammar, index, input->str);
+    }
+  smie_pair_index_free (index);
+  g_string_free (input, TRUE);
+
+  /* An edit which does not change the structure only reads the tokens
+     around it again.  */
+  input = g_string_new ("#");
+  for (i = 0; i < 100; i++)
+    g_string_append (input, " ( 1 + 2 )");
+  g_string_append (input, " #");
+  index = smie_pair_index_new (fixture->grammar);
+  context.input = input->str;
+  context.offset = 0;
+  forward_token_count = 0;
+  smie_pair_index_scan (index,
+			counting_forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  full_count = forward_token_count;
+
+  g_string_erase (input, 4, 1);
+  g_string_insert (input, 4, "12");
+  context.offset = smie_pair_index_invalidate (index, 4, 1, 2);
+  forward_token_count = 0;
+  smie_pair_index_scan (index,
+			counting_forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  g_assert_cmpuint (forward_token_count, <, 10);
+  g_assert_cmpuint (forward_token_count, <, full_count / 10);
+  assert_pair_index_equal (fixture->grammar, index, input->str);
+
+  /* Add keywords, which moves the depths of all the following ones in
+     the tree, and remove them again.  */
+  g_string_erase (input, 4, 2);
+  g_string_insert (input, 4, "( 12 )");
+  context.offset = smie_pair_index_invalidate (index, 4, 2, 6);
+  forward_token_count = 0;
+  smie_pair_index_scan (index,
+			counting_forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  g_assert_cmpuint (forward_token_count, <, 10);
+  assert_pair_index_equal (fixture->grammar, index, input->str);
+
+  g_string_erase (input, 4, 6);
+  g_string_insert (input, 4, "1");
+  context.offset = smie_pair_index_invalidate (index, 4, 6, 1);
+  forward_token_count = 0;
+  smie_pair_index_scan (index,
+			counting_forward_token,
+			skip_whitespace,
+			test_common_cursor_functions.get_offset,
+			&context);
+  g_assert_cmpuint (forward_token_count, <, 10);
+  assert_pair_index_equal (fixture->grammar, index, input->str);
+  smie_pair_index_free (index);
+  g_string_free (input, TRUE);
+}
+
+struct keyword_context_t
+{
+  smie_keyword_matcher_t *matcher;
+  const gchar *input;
+  gsize offset;
+};
+
+static gboolean
+forward_keyword_slice (gpointer data, const gchar **token, gsize *length)
+{
+  struct keyword_context_t *context = data;
+  const smie_symbol_t *symbol;
+  gsize offset = context->offset;
+
+  if (!smie_keyword_matcher_next (context->matcher,
+				  context->input,
+				  strlen (context->input),
+				  &offset,
+				  &symbol,
+				  length))
+    return FALSE;
+
+  *token = &context->input[offset];
+  context->offset = offset + *length;
+  return TRUE;
+}
+
+static void
+test_movement_keyword_matcher (struct fixture *fixture,
+			       gconstpointer user_data)
+{
+  const gchar *input = "(a+x /* ( */ \"x \\\" )\" xy x_ )+8";
+  static const gsize offsets[] = { 0, 2, 3, 28, 29 };
+  static const gchar *names[] = { "(", "+", "x", ")", "+" };
+  struct keyword_context_t context;
+  smie_keyword_matcher_t *matcher;
+  const smie_symbol_t *symbol;
+  gsize offset, length;
+  gsize i;
+
+  matcher = smie_keyword_matcher_new (fixture->grammar);
+  smie_keyword_matcher_add_comment (matcher, "/*", "*/");
+  smie_keyword_matcher_add_string (matcher, "\"", "\"", '\\');
+
+  offset = 0;
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      g_assert (smie_keyword_matcher_next (matcher,
+					   input,
+					   strlen (input),
+					   &offset,
+					   &symbol,
+					   &length));
+      g_assert_cmpuint (offsets[i], ==, offset);
+      g_assert_cmpstr (names[i], ==, symbol->name);
+      g_assert_cmpuint (strlen (names[i]), ==, length);
+      offset += length;
+    }
+  g_assert (!smie_keyword_matcher_next (matcher,
+					input,
+					strlen (input),
+					&offset,
+					&symbol,
+					&length));
+
+  /* Skipping S-expressions from keyword to keyword gives the same
+     result as reading all the tokens.  */
+  context.matcher = matcher;
+  context.input = "# ( 4 + ( 5 x 6 ) + 7 ) + 8 #";
+  context.offset = 1;
+  smie_forward_sexp_slice (fixture->grammar,
+			   forward_keyword_slice,
+			   NULL,
+			   &context);
+  g_assert_cmpuint (23, ==, context.offset);
+
+  smie_keyword_matcher_free (matcher);
+}
+
+static gboolean
+grammar_equal_by_name (smie_grammar_t *a, smie_grammar_t *b)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (g_hash_table_size (a->levels) != g_hash_table_size (b->levels))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, a->levels);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      smie_symbol_t *symbol = key;
+      struct smie_level_t *level = value, *level1;
+      const smie_symbol_t *symbol1;
+
+      symbol1 = smie_symbol_intern (b->pool, symbol->name, symbol->type);
+      level1 = g_hash_table_lookup (b->levels, symbol1);
+      if (!level1
+	  || level->left_prec != level1->left_prec
+	  || level->right_prec != level1->right_prec
+	  || level->symbol_class != level1->symbol_class
+	  || memcmp (&level->zones, &level1->zones,
+		     sizeof (struct smie_zones_t)) != 0)
+	return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+test_compiled_roundtrip (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_grammar_t *expected, *actual;
+  smie_symbol_pool_t *pool;
+  GBytes *bytes;
+  GError *error;
+
+  error = NULL;
+  expected = smie_prec2_to_grammar (fixture->prec2, &error);
+  g_assert_no_error (error);
+  g_assert (expected);
+
+  bytes = smie_grammar_serialize (expected);
+  g_assert (bytes);
+
+  error = NULL;
+  actual = smie_grammar_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert (actual);
+  g_assert (grammar_equal_by_name (expected, actual));
+
+  pool = smie_grammar_get_symbol_pool (actual);
+  g_assert (smie_grammar_has_pair (actual,
+				   smie_symbol_intern (pool, "(",
+						       SMIE_SYMBOL_TERMINAL),
+				   smie_symbol_intern (pool, ")",
+						       SMIE_SYMBOL_TERMINAL)));
+  smie_grammar_free (actual);
+  smie_grammar_free (expected);
+  g_bytes_unref (bytes);
+
+  bytes = g_bytes_new_static ("SMIE", 4);
+  error = NULL;
+  actual = smie_grammar_new_from_bytes (bytes, &error);
+  g_assert_error (error, SMIE_ERROR, SMIE_ERROR_FORMAT);
+  g_assert (!actual);
+  g_error_free (error);
+  g_bytes_unref (bytes);
+}
+
+static const gchar grammar_input[] =
+  "s : \"#\" e \"#\" ;\n"
+  "e : e \"+\" t | t ;\n"
+  "t : t \"x\" f | f ;\n"
+  "f : N | \"(\" e \")\" ;\n";
+
+static const gchar rules_grammar_input[] =
+  "cmd : \"if\" cmd \"then\" cmd \"fi\"\n"
+  "    | \"for\" exp \"do\" cmd \"done\"\n"
+  "    | \"(\" cmd \")\"\n"
+  "    | cmd \";\" cmd\n"
+  "    ;\n"
+  "exp : EXP ;\n"
+  "%rules {\n"
+  "  basic 3;\n"
+  "  before 0 \"fi\" \"done\";\n"
+  "  after 6 \"then\";\n"
+  "  before 2 \"do\";\n"
+  "  after -4 \"do\";\n"
+  "  list-intro \"for\";\n"
+  "  close-all \")\";\n"
+  "}\n";
+
+static void
+test_grammar_rules (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *grammars[2];
+  smie_symbol_pool_t *pool;
+  const smie_symbol_t *symbol;
+  GBytes *bytes;
+  GError *error;
+  gsize i;
+
+  error = NULL;
+  prec2 = smie_prec2_grammar_load (rules_grammar_input, &error);
+  g_assert_no_error (error);
+  g_assert (prec2);
+  grammars[0] = smie_prec2_to_grammar (prec2, &error);
+  g_assert_no_error (error);
+  g_assert (grammars[0]);
+  smie_prec2_grammar_free (prec2);
+
+  /* The rules survive the compiled form.  */
+  bytes = smie_grammar_serialize (grammars[0]);
+  grammars[1] = smie_grammar_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert (grammars[1]);
+  g_bytes_unref (bytes);
+
+  for (i = 0; i < G_N_ELEMENTS (grammars); i++)
+    {
+      pool = smie_grammar_get_symbol_pool (grammars[i]);
+      g_assert_cmpint (3, ==, smie_grammar_get_basic_offset (grammars[i]));
+      symbol = smie_symbol_intern (pool, "fi", SMIE_SYMBOL_TERMINAL);
+      g_assert_cmpint (0, ==,
+		       smie_grammar_get_before_offset (grammars[i], symbol));
+      g_assert_cmpint (-1, ==,
+		       smie_grammar_get_after_offset (grammars[i], symbol));
+      symbol = smie_symbol_intern (pool, "done", SMIE_SYMBOL_TERMINAL);
+      g_assert_cmpint (0, ==,
+		       smie_grammar_get_before_offset (grammars[i], symbol));
+      symbol = smie_symbol_intern (pool, "then", SMIE_SYMBOL_TERMINAL);
+      g_assert_cmpint (-1, ==,
+		       smie_grammar_get_before_offset (grammars[i], symbol));
+      g_assert_cmpint (6, ==,
+		       smie_grammar_get_after_offset (grammars[i], symbol));
+      /* A negative offset is undetermined.  */
+      symbol = smie_symbol_intern (pool, "do", SMIE_SYMBOL_TERMINAL);
+      g_assert_cmpint (2, ==,
+		       smie_grammar_get_before_offset (grammars[i], symbol));
+      g_assert_cmpint (-1, ==,
+		       smie_grammar_get_after_offset (grammars[i], symbol));
+      symbol = smie_symbol_intern (pool, "for", SMIE_SYMBOL_TERMINAL);
+      g_assert (smie_grammar_is_list_intro (grammars[i], symbol));
+      g_assert (!smie_grammar_is_close_all (grammars[i], symbol));
+      symbol = smie_symbol_intern (pool, ")", SMIE_SYMBOL_TERMINAL);
+      g_assert (smie_grammar_is_close_all (grammars[i], symbol));
+      g_assert (!smie_grammar_is_list_intro (grammars[i], symbol));
+      smie_grammar_unref (grammars[i]);
+    }
+
+  /* Without a %rules section, nothing is determined.  */
+  prec2 = smie_prec2_grammar_load (grammar_input, &error);
+  g_assert_no_error (error);
+  grammars[0] = smie_prec2_to_grammar (prec2, &error);
+  g_assert_no_error (error);
+  smie_prec2_grammar_free (prec2);
+  pool = smie_grammar_get_symbol_pool (grammars[0]);
+  g_assert_cmpint (-1, ==, smie_grammar_get_basic_offset (grammars[0]));
+  symbol = smie_symbol_intern (pool, "#", SMIE_SYMBOL_TERMINAL);
+  g_assert_cmpint (-1, ==,
+		   smie_grammar_get_before_offset (grammars[0], symbol));
+  smie_grammar_unref (grammars[0]);
+
+  /* Keywords are only recognized as whole words.  */
+  prec2 = smie_prec2_grammar_load ("cmd : \"x\" ;\n"
+				   "%rules {\n"
+				   "  basics 2;\n"
+				   "}\n",
+				   &error);
+  g_assert_error (error, SMIE_ERROR, SMIE_ERROR_GRAMMAR);
+  g_assert (!prec2);
+  g_clear_error (&error);
+}
+
+static void
+test_compiled_cache (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *first, *second, *other;
+  gchar *cache_dir, *filename;
+  GBytes *bytes;
+  GError *error;
+  GDir *dir;
+  const gchar *name;
+  gint count;
+
+  error = NULL;
+  cache_dir = g_dir_make_tmp ("smie-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  error = NULL;
+  first = smie_grammar_load_cached (grammar_input, cache_dir, &error);
+  g_assert_no_error (error);
+  g_assert (first);
+  g_assert_cmpint (-1, ==, smie_grammar_get_basic_offset (first));
+
+  dir = g_dir_open (cache_dir, 0, NULL);
+  g_assert (dir);
+  name = g_dir_read_name (dir);
+  g_assert (name);
+  g_assert (g_str_has_suffix (name, ".smiec"));
+  filename = g_build_filename (cache_dir, name, NULL);
+  g_assert (!g_dir_read_name (dir));
+  g_dir_close (dir);
+
+  /* Replace the cached artifact with a different grammar, so that the
+     second load can only return it if the cache is hit.  */
+  error = NULL;
+  prec2 = smie_prec2_grammar_load (rules_grammar_input, &error);
+  g_assert_no_error (error);
+  other = smie_prec2_to_grammar (prec2, &error);
+  g_assert_no_error (error);
+  smie_prec2_grammar_free (prec2);
+  bytes = smie_grammar_serialize (other);
+  g_assert (g_file_set_contents (filename,
+				 g_bytes_get_data (bytes, NULL),
+				 g_bytes_get_size (bytes),
+				 NULL));
+  g_bytes_unref (bytes);
+
+  error = NULL;
+  second = smie_grammar_load_cached (grammar_input, cache_dir, &error);
+  g_assert_no_error (error);
+  g_assert (second);
+  g_assert_cmpint (3, ==, smie_grammar_get_basic_offset (second));
+  g_assert (grammar_equal_by_name (other, second));
+
+  dir = g_dir_open (cache_dir, 0, NULL);
+  g_assert (dir);
+  count = 0;
+  while ((name = g_dir_read_name (dir)) != NULL)
+    count++;
+  g_dir_close (dir);
+  g_assert_cmpint (1, ==, count);
+  g_unlink (filename);
+  g_free (filename);
+  g_rmdir (cache_dir);
+  g_free (cache_dir);
+
+  smie_grammar_free (first);
+  smie_grammar_free (second);
+  smie_grammar_free (other);
+}
+
+static void
+test_grammar_pairs (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_grammar_t *grammar;
+  smie_grammar_closer_iter_t iter;
+  const smie_symbol_t *opener, *closer, *fi, *done, *esac;
+  gboolean seen_fi = FALSE, seen_esac = FALSE;
+  gint i, count;
+
+  grammar = smie_grammar_alloc (fixture->pool);
+
+  /* Spread the closer ids over more than one bitset word.  */
+  fi = smie_symbol_intern (fixture->pool, "fi", SMIE_SYMBOL_TERMINAL);
+  for (i = 0; i < 100; i++)
+    {
+      gchar *name = g_strdup_printf ("filler%d", i);
+      smie_symbol_intern (fixture->pool, name, SMIE_SYMBOL_TERMINAL);
+      g_free (name);
+    }
+  esac = smie_symbol_intern (fixture->pool, "esac", SMIE_SYMBOL_TERMINAL);
+  done = smie_symbol_intern (fixture->pool, "done", SMIE_SYMBOL_TERMINAL);
+  opener = smie_symbol_intern (fixture->pool, "if", SMIE_SYMBOL_TERMINAL);
+
+  g_assert (smie_grammar_add_pair (grammar, opener, fi));
+  g_assert (smie_grammar_add_pair (grammar, opener, esac));
+  g_assert (!smie_grammar_add_pair (grammar, opener, fi));
+
+  g_assert (smie_grammar_has_pair (grammar, opener, fi));
+  g_assert (smie_grammar_has_pair (grammar, opener, esac));
+  g_assert (!smie_grammar_has_pair (grammar, opener, done));
+  g_assert (!smie_grammar_has_pair (grammar, fi, opener));
+  g_assert (smie_grammar_is_pair_end (grammar, fi));
+  g_assert (smie_grammar_is_pair_end (grammar, esac));
+  g_assert (!smie_grammar_is_pair_end (grammar, done));
+
+  count = 0;
+  smie_grammar_closer_iter_init (&iter, grammar, opener);
+  while (smie_grammar_closer_iter_next (&iter, &closer))
+    {
+      if (closer == fi)
+	seen_fi = TRUE;
+      else if (closer == esac)
+	seen_esac = TRUE;
+      count++;
+    }
+  g_assert_cmpint (2, ==, count);
+  g_assert (seen_fi && seen_esac);
+
+  smie_grammar_closer_iter_init (&iter, grammar, done);
+  g_assert (!smie_grammar_closer_iter_next (&iter, &closer));
+
+  smie_grammar_unref (grammar);
+}
+
+static const gchar sync_grammar_input[] =
+  "prog : prog \"%%\" sect | sect ;\n"
+  "sect : \"def\" exp \"begin\" body \"end\" ;\n"
+  "body : body \";\" body | \"if\" exp \"then\" body \"fi\" | EXP ;\n"
+  "exp : EXP ;\n"
+  "%precs { assoc \";\"; }\n";
+
+static void
+test_grammar_sync_tokens (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *grammar;
+  smie_symbol_pool_t *pool;
+  const smie_symbol_t *symbol;
+  test_common_context_t context;
+  smie_sexp_result_t result, results[1];
+  gint offsets[1];
+  GError *error;
+
+  error = NULL;
+  prec2 = smie_prec2_grammar_load (sync_grammar_input, &error);
+  g_assert_no_error (error);
+  g_assert (prec2);
+  grammar = smie_prec2_to_grammar (prec2, &error);
+  g_assert_no_error (error);
+  g_assert (grammar);
+  smie_prec2_grammar_free (prec2);
+
+  pool = smie_grammar_get_symbol_pool (grammar);
+  symbol = smie_symbol_intern (pool, "%%", SMIE_SYMBOL_TERMINAL);
+  g_assert (smie_grammar_is_sync_token (grammar, symbol));
+  symbol = smie_symbol_intern (pool, ";", SMIE_SYMBOL_TERMINAL);
+  g_assert (smie_grammar_is_sync_token (grammar, symbol));
+
+  /* A construct missing its closer does not extend beyond "%%".  */
+  context.input = "def x begin a ; b %% def y begin c end";
+  context.offset = 11;
+  symbol = smie_symbol_intern (pool, "begin", SMIE_SYMBOL_TERMINAL);
+  smie_forward_sexp_full (grammar,
+			  test_common_cursor_functions.forward_token,
+			  test_common_cursor_functions.get_offset,
+			  symbol,
+			  &context,
+			  &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("%%", ==, result.symbol->name);
+  g_assert_cmpint (17, ==, result.offset);
+  g_assert (!result.paired);
+
+  context.offset = 0;
+  offsets[0] = 0;
+  smie_forward_sexp_batch (grammar,
+			   test_common_cursor_functions.forward_token,
+			   test_common_cursor_functions.get_offset,
+			   &context,
+			   offsets,
+			   G_N_ELEMENTS (offsets),
+			   results);
+  g_assert (results[0].symbol);
+  g_assert_cmpstr ("%%", ==, results[0].symbol->name);
+  g_assert_cmpint (17, ==, results[0].offset);
+
+  /* Nor does a construct missing its opener.  */
+  context.input = "def x begin a %% b ; c end";
+  context.offset = 23;
+  symbol = smie_symbol_intern (pool, "end", SMIE_SYMBOL_TERMINAL);
+  smie_backward_sexp_full (grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   symbol,
+			   &context,
+			   &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("%%", ==, result.symbol->name);
+  g_assert_cmpint (13, ==, result.offset);
+  g_assert (!result.paired);
+
+  /* A scan from a sync token goes past other sync tokens.  */
+  context.input = "def x begin a end %% def y begin b end %% c";
+  context.offset = 20;
+  symbol = smie_symbol_intern (pool, "%%", SMIE_SYMBOL_TERMINAL);
+  smie_forward_sexp_full (grammar,
+			  test_common_cursor_functions.forward_token,
+			  test_common_cursor_functions.get_offset,
+			  symbol,
+			  &context,
+			  &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("%%", ==, result.symbol->name);
+  g_assert_cmpint (38, ==, result.offset);
+
+  smie_grammar_unref (grammar);
+}
+
+static void
+test_grammar_sync_tokens_lua (struct fixture *fixture,
+			      gconstpointer user_data)
+{
+  smie_grammar_t *grammar;
+  smie_symbol_pool_t *pool;
+  const smie_symbol_t *symbol;
+  test_common_context_t context;
+  smie_sexp_result_t result;
+  GError *error;
+
+  error = NULL;
+  grammar = smie_grammar_load (GRAMMARS_DIR "/lua.grammar", &error);
+  g_assert_no_error (error);
+  g_assert (grammar);
+
+  pool = smie_grammar_get_symbol_pool (grammar);
+  symbol = smie_symbol_intern (pool, ";", SMIE_SYMBOL_TERMINAL);
+  g_assert (smie_grammar_is_sync_token (grammar, symbol));
+  symbol = smie_symbol_intern (pool, "end", SMIE_SYMBOL_TERMINAL);
+  g_assert (smie_grammar_is_sync_token (grammar, symbol));
+
+  /* A table constructor cannot contain a statement separator.  */
+  context.input = "f { a ; b }";
+  context.offset = 9;
+  symbol = smie_symbol_intern (pool, "}", SMIE_SYMBOL_TERMINAL);
+  smie_backward_sexp_full (grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   symbol,
+			   &context,
+			   &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr (";", ==, result.symbol->name);
+  g_assert_cmpint (5, ==, result.offset);
+  g_assert (!result.paired);
+
+  /* Nor a block closer.  */
+  context.input = "f { a , do b end }";
+  context.offset = 16;
+  smie_backward_sexp_full (grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   symbol,
+			   &context,
+			   &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("end", ==, result.symbol->name);
+  g_assert_cmpint (12, ==, result.offset);
+  g_assert (!result.paired);
+
+  /* A parameter list stops at a statement separator as well.  */
+  context.input = "function f ( a ; b ) c end";
+  context.offset = 12;
+  symbol = smie_symbol_intern (pool, "(", SMIE_SYMBOL_TERMINAL);
+  smie_forward_sexp_full (grammar,
+			  test_common_cursor_functions.forward_token,
+			  test_common_cursor_functions.get_offset,
+			  symbol,
+			  &context,
+			  &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr (";", ==, result.symbol->name);
+  g_assert_cmpint (14, ==, result.offset);
+  g_assert (!result.paired);
+
+  /* A complete block is still matched.  */
+  context.input = "while a do b ; c end";
+  context.offset = 16;
+  symbol = smie_symbol_intern (pool, "end", SMIE_SYMBOL_TERMINAL);
+  smie_backward_sexp_full (grammar,
+			   test_common_cursor_functions.backward_token,
+			   test_common_cursor_functions.get_offset,
+			   symbol,
+			   &context,
+			   &result);
+  g_assert (result.symbol);
+  g_assert_cmpstr ("do", ==, result.symbol->name);
+  g_assert_cmpint (7, ==, result.offset);
+  g_assert (result.paired);
+
+  smie_grammar_unref (grammar);
+}
+
+static void
+test_compiled_builtin (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_grammar_t *grammar, *other;
+  const smie_symbol_t *symbol;
+  gchar **names;
+  GError *error;
+  gsize i;
+
+  names = smie_grammar_list_builtin ();
+  g_assert (names);
+  g_assert (g_strv_length (names) > 0);
+  for (i = 0; names[i]; i++)
+    {
+      error = NULL;
+      grammar = smie_grammar_new_from_resource (names[i], &error);
+      g_assert_no_error (error);
+      g_assert (grammar);
+      smie_grammar_unref (grammar);
+    }
+  g_strfreev (names);
+
+  error = NULL;
+  grammar = smie_grammar_new_from_resource ("sh", &error);
+  g_assert_no_error (error);
+  g_assert (grammar);
+
+  /* The second load is served from the per-process cache.  */
+  error = NULL;
+  other = smie_grammar_new_from_resource ("sh", &error);
+  g_assert_no_error (error);
+  g_assert (other == grammar);
+  smie_grammar_unref (other);
+
+  symbol = smie_symbol_intern (smie_grammar_get_symbol_pool (grammar),
+			       "fi",
+			       SMIE_SYMBOL_TERMINAL);
+  g_assert_cmpint (SMIE_SYMBOL_CLASS_CLOSER,
+		   ==,
+		   smie_grammar_get_symbol_class (grammar, symbol));
+  smie_grammar_unref (grammar);
+
+  error = NULL;
+  grammar = smie_grammar_new_from_resource ("no-such-language", &error);
+  g_assert_error (error, G_RESOURCE_ERROR, G_RESOURCE_ERROR_NOT_FOUND);
+  g_assert (!grammar);
+  g_error_free (error);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -362,5 +1504,65 @@ main (int argc, char **argv)
 	      setup_movement,
 	      test_movement_backward,
 	      teardown_movement);
+  g_test_add ("/grammar/movement/full", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_full,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/batch", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_batch,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/bounded", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_bounded,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/resumable", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_resumable,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/keyword-matcher", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_keyword_matcher,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/slice", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_slice,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/deep", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_deep,
+	      teardown_movement);
+  g_test_add ("/grammar/movement/pair-index", struct fixture, NULL,
+	      setup_movement,
+	      test_movement_pair_index,
+	      teardown_movement);
+  g_test_add ("/grammar/pairs", struct fixture, NULL,
+	      setup_movement,
+	      test_grammar_pairs,
+	      teardown_movement);
+  g_test_add ("/grammar/sync-tokens", struct fixture, NULL,
+	      NULL,
+	      test_grammar_sync_tokens,
+	      NULL);
+  g_test_add ("/grammar/sync-tokens/lua", struct fixture, NULL,
+	      NULL,
+	      test_grammar_sync_tokens_lua,
+	      NULL);
+  g_test_add ("/grammar/rules", struct fixture, NULL,
+	      NULL,
+	      test_grammar_rules,
+	      NULL);
+  g_test_add ("/grammar/compiled/roundtrip", struct fixture, NULL,
+	      setup_grammar,
+	      test_compiled_roundtrip,
+	      teardown_grammar);
+  g_test_add ("/grammar/compiled/cache", struct fixture, NULL,
+	      setup_bnf,
+	      test_compiled_cache,
+	      teardown_bnf);
+  g_test_add ("/grammar/compiled/builtin", struct fixture, NULL,
+	      NULL,
+	      test_compiled_builtin,
+	      NULL);
   return g_test_run ();
 }
@@ -22,6 +22,8 @@
 
 #include "tests/test-common.h"
 
+#include <glib/gstdio.h>
+
 #include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -54,6 +56,28 @@ static const smie_rule_functions_t test_rules =
     NULL
   };
 
+static gboolean
+test_rule_list_intro (const gchar *token)
+{
+  return strcmp (token, "for") == 0;
+}
+
+static gboolean
+test_rule_close_all (const gchar *token)
+{
+  return strcmp (token, "done") == 0;
+}
+
+static const smie_rule_functions_t test_list_rules =
+  {
+    NULL,
+    NULL,
+    NULL,
+    test_rule_basic,
+    test_rule_list_intro,
+    test_rule_close_all
+  };
+
 static void
 setup (struct fixture *fixture, gconstpointer user_data)
 {
@@ -136,6 +160,930 @@ test_basic (struct fixture *fixture, gconstpointer user_data)
   g_assert_cmpint (0, ==, column);
 }
 
+static void
+test_context_stack (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+
+  /* Without marks, the indenter falls back to the context stack.  */
+  functions = test_common_cursor_functions;
+  functions.save = NULL;
+  functions.restore = NULL;
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&functions,
+				&test_rules);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+  do
+    {
+      g_assert_cmpint (smie_indenter_calculate (fixture->indenter, &context),
+		       ==,
+		       smie_indenter_calculate (indenter, &context));
+      g_assert (context.stack == NULL);
+    }
+  while (test_common_cursor_functions.forward_line (&context));
+
+  smie_indenter_unref (indenter);
+}
+
+static guint backward_token_count;
+
+static gchar *
+test_counting_backward_token (gpointer data)
+{
+  backward_token_count++;
+  return test_common_cursor_functions.backward_token (data);
+}
+
+static guint forward_token_count;
+
+static gchar *
+test_counting_forward_token (gpointer data)
+{
+  forward_token_count++;
+  return test_common_cursor_functions.forward_token (data);
+}
+
+static void
+test_sexp_memo (struct fixture *fixture, gconstpointer user_data)
+{
+  static const gint offsets[] = { 0, 34, 45, 55, 58 };
+  static const gint columns[] = { 0, 2, 4, 2, 0 };
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter, *other;
+  smie_grammar_t *grammar;
+  guint uncached_count, cached_count;
+  gchar *input, *prefix;
+  gsize i;
+
+  functions = test_common_cursor_functions;
+  functions.backward_token = test_counting_backward_token;
+  grammar = smie_indenter_get_grammar (fixture->indenter);
+  indenter = smie_indenter_new (grammar, &functions, &test_rules);
+  smie_indenter_set_sexp_memo (indenter, TRUE);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+
+  backward_token_count = 0;
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      context.offset = offsets[i];
+      g_assert_cmpint (columns[i], ==,
+		       smie_indenter_calculate (indenter, &context));
+    }
+  uncached_count = backward_token_count;
+
+  backward_token_count = 0;
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      context.offset = offsets[i];
+      g_assert_cmpint (columns[i], ==,
+		       smie_indenter_calculate (indenter, &context));
+    }
+  cached_count = backward_token_count;
+  g_assert_cmpuint (cached_count, <, uncached_count);
+
+  /* Pretend the text after the second line has changed.  */
+  smie_indenter_invalidate (indenter, 40, 0, 0);
+  backward_token_count = 0;
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    {
+      context.offset = offsets[i];
+      g_assert_cmpint (columns[i], ==,
+		       smie_indenter_calculate (indenter, &context));
+    }
+  g_assert_cmpuint (backward_token_count, >, cached_count);
+
+  /* Reindenting the "done" line only changes the whitespace after the
+     token before it, so the scans from that line are still found.  */
+  prefix = g_strndup (fixture->input_addr, 51);
+  input = g_strconcat (prefix, "  ", fixture->input_addr + 51, NULL);
+  g_free (prefix);
+  smie_indenter_invalidate (indenter, 51, 0, 2);
+  context.input = input;
+  context.offset = 57;
+  backward_token_count = 0;
+  g_assert_cmpint (2, ==, smie_indenter_calculate (indenter, &context));
+  cached_count = backward_token_count;
+
+  other = smie_indenter_new (smie_indenter_get_grammar (indenter),
+			     &functions,
+			     &test_rules);
+  smie_indenter_set_sexp_memo (other, TRUE);
+  context.offset = 57;
+  backward_token_count = 0;
+  g_assert_cmpint (2, ==, smie_indenter_calculate (other, &context));
+  g_assert_cmpuint (cached_count, <, backward_token_count);
+  smie_indenter_unref (other);
+  g_free (input);
+
+  smie_indenter_unref (indenter);
+}
+
+static void
+test_region (struct fixture *fixture, gconstpointer user_data)
+{
+  static const gint columns[] = { 0, 2, 4, 2, 0 };
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+  gint indents[8], line, n_lines;
+  guint line_count, region_count;
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+  context.offset = 40;
+  n_lines = smie_indenter_calculate_region (fixture->indenter,
+					    &context,
+					    0,
+					    G_N_ELEMENTS (columns) - 1,
+					    indents);
+  g_assert_cmpint (G_N_ELEMENTS (columns), ==, n_lines);
+  for (line = 0; line < n_lines; line++)
+    g_assert_cmpint (columns[line], ==, indents[line]);
+
+  n_lines = smie_indenter_calculate_region (fixture->indenter,
+					    &context,
+					    2,
+					    3,
+					    indents);
+  g_assert_cmpint (2, ==, n_lines);
+  g_assert_cmpint (4, ==, indents[0]);
+  g_assert_cmpint (2, ==, indents[1]);
+
+  /* Each line of a sequence is indented relative to the previous one,
+     which is only calculated once for the region.  */
+  functions = test_common_cursor_functions;
+  functions.backward_token = test_counting_backward_token;
+  grammar = smie_indenter_get_grammar (fixture->indenter);
+  indenter = smie_indenter_new (grammar, &functions, &test_rules);
+
+  context.input = "if a ; then\n  b ;\n  c ;\n  d ;\n  e ;\n  f ;\n  g\nfi";
+  context.offset = 0;
+  backward_token_count = 0;
+  n_lines = smie_indenter_calculate_region (indenter,
+					    &context,
+					    0,
+					    G_N_ELEMENTS (indents) - 1,
+					    indents);
+  g_assert_cmpint (G_N_ELEMENTS (indents), ==, n_lines);
+  g_assert_cmpint (2, ==, indents[6]);
+  g_assert_cmpint (0, ==, indents[7]);
+  region_count = backward_token_count;
+
+  backward_token_count = 0;
+  context.offset = 0;
+  for (line = 0; line < n_lines; line++)
+    {
+      g_assert_cmpint (indents[line], ==,
+		       smie_indenter_calculate (indenter, &context));
+      test_common_cursor_functions.forward_line (&context);
+    }
+  line_count = backward_token_count;
+  g_assert_cmpuint (region_count, <, line_count);
+
+  smie_indenter_unref (indenter);
+}
+
+/* Return the number of tokens read to indent DEPTH nested loops.  */
+static guint
+test_region_count_tokens (smie_indenter_t *indenter, gint depth)
+{
+  struct test_common_context_t context;
+  GString *input;
+  gint *indents, n_lines, i;
+
+  input = g_string_new ("");
+  for (i = 0; i < depth; i++)
+    g_string_append_printf (input, "%*swhile a do\n", 2 * i, "");
+  g_string_append_printf (input, "%*sb\n", 2 * depth, "");
+  for (i = depth - 1; i >= 0; i--)
+    g_string_append_printf (input, "%*sdone\n", 2 * i, "");
+  n_lines = 2 * depth + 1;
+  indents = g_new (gint, n_lines);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = input->str;
+  forward_token_count = 0;
+  backward_token_count = 0;
+  g_assert_cmpint (n_lines, ==,
+		   smie_indenter_calculate_region (indenter,
+						   &context,
+						   0,
+						   n_lines - 1,
+						   indents));
+  for (i = 0; i < depth; i++)
+    {
+      g_assert_cmpint (2 * i, ==, indents[i]);
+      g_assert_cmpint (2 * i, ==, indents[n_lines - 1 - i]);
+    }
+  g_assert_cmpint (2 * depth, ==, indents[depth]);
+
+  g_free (indents);
+  g_string_free (input, TRUE);
+  return forward_token_count + backward_token_count;
+}
+
+static void
+test_region_linear (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_cursor_functions_t functions;
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+  guint count, double_count;
+
+  functions = test_common_cursor_functions;
+  functions.forward_token = test_counting_forward_token;
+  functions.backward_token = test_counting_backward_token;
+  grammar = smie_indenter_get_grammar (fixture->indenter);
+  indenter = smie_indenter_new (grammar, &functions, &test_rules);
+
+  /* Each "done" would scan back over the loops it closes, if the
+     "while" it is indented relative to were not found on the stack.  */
+  count = test_region_count_tokens (indenter, 100);
+  double_count = test_region_count_tokens (indenter, 200);
+  g_assert_cmpuint (double_count, <, 3 * count);
+
+  smie_indenter_unref (indenter);
+}
+
+static void
+test_region_parallel (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  GString *input;
+  gint *serial, *parallel, n_lines, line, i;
+
+  input = g_string_new ("");
+  for (i = 0; i < 50; i++)
+    g_string_append (input,
+		     "if a ; then\n"
+		     "  b ;\n"
+		     "  while c ; do\n"
+		     "    d\n"
+		     "  done\n"
+		     "fi\n"
+		     "e ;\n");
+  n_lines = 50 * 7;
+  serial = g_new (gint, n_lines);
+  parallel = g_new (gint, n_lines);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = input->str;
+  g_assert_cmpint (n_lines, ==,
+		   smie_indenter_calculate_region (fixture->indenter,
+						   &context,
+						   0,
+						   n_lines - 1,
+						   serial));
+  g_assert_cmpint (n_lines, ==,
+		   smie_indenter_calculate_region_parallel (fixture->indenter,
+							    &context,
+							    0,
+							    n_lines - 1,
+							    parallel,
+							    4));
+  for (line = 0; line < n_lines; line++)
+    g_assert_cmpint (serial[line], ==, parallel[line]);
+
+  /* A region which does not start at the beginning of buffer.  */
+  g_assert_cmpint (20, ==,
+		   smie_indenter_calculate_region_parallel (fixture->indenter,
+							    &context,
+							    10,
+							    29,
+							    parallel,
+							    0));
+  for (line = 0; line < 20; line++)
+    g_assert_cmpint (serial[line + 10], ==, parallel[line]);
+
+  /* The threads add the lines they calculated to the line cache when
+     they are done.  */
+  functions = test_common_cursor_functions;
+  functions.backward_token = test_counting_backward_token;
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&functions,
+				&test_rules);
+  smie_indenter_set_sexp_memo (indenter, TRUE);
+  smie_indenter_set_line_cache (indenter, TRUE);
+  g_assert_cmpint (n_lines, ==,
+		   smie_indenter_calculate_region_parallel (indenter,
+							    &context,
+							    0,
+							    n_lines - 1,
+							    parallel,
+							    4));
+  for (line = 0; line < n_lines; line++)
+    g_assert_cmpint (serial[line], ==, parallel[line]);
+  backward_token_count = 0;
+  context.offset = 49 * 53 + 39 + 1;
+  g_assert_cmpint (serial[49 * 7 + 4], ==,
+		   smie_indenter_calculate (indenter, &context));
+  g_assert_cmpuint (0, ==, backward_token_count);
+  smie_indenter_unref (indenter);
+
+  g_free (serial);
+  g_free (parallel);
+  g_string_free (input, TRUE);
+}
+
+/* Indent lines starting with "echo" by 7, and let the other strategies
+   try the other lines.  */
+static gint
+test_strategy_echo (smie_indent_query_t *query, gpointer context,
+		    gpointer user_data)
+{
+  struct test_common_context_t *test_context = context;
+  gint offset = test_context->offset;
+  const gchar *token;
+
+  token = smie_indent_query_forward_token (query, context);
+  test_context->offset = offset;
+  return g_strcmp0 (token, "echo") == 0 ? GPOINTER_TO_INT (user_data) : -1;
+}
+
+static void
+test_strategies (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indent_strategy_stats_t stats;
+  smie_indenter_t *indenter;
+  guint count;
+
+  functions = test_common_cursor_functions;
+  functions.forward_token = test_counting_forward_token;
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+
+  /* "fi" at the beginning of a line is a keyword.  */
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&functions,
+				&test_rules);
+  forward_token_count = 0;
+  context.offset = 58;
+  g_assert_cmpint (0, ==, smie_indenter_calculate (indenter, &context));
+  count = forward_token_count;
+  g_assert (smie_indenter_get_strategy_stats (indenter, "keyword", &stats));
+  g_assert_cmpint (1, ==, stats.calls);
+  g_assert_cmpint (1, ==, stats.hits);
+  g_assert_cmpint (0, ==, stats.cost);
+  g_assert (!smie_indenter_get_strategy_stats (indenter, "echo", &stats));
+  smie_indenter_unref (indenter);
+
+  /* A strategy failing before the keyword strategy reads the same
+     token, which is not read again.  */
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&functions,
+				&test_rules);
+  smie_indenter_add_strategy (indenter, "echo",
+			      SMIE_INDENT_PRIORITY_KEYWORD - 1,
+			      test_strategy_echo, GINT_TO_POINTER (7));
+  forward_token_count = 0;
+  context.offset = 58;
+  g_assert_cmpint (0, ==, smie_indenter_calculate (indenter, &context));
+  g_assert_cmpuint (count, ==, forward_token_count);
+  g_assert (smie_indenter_get_strategy_stats (indenter, "echo", &stats));
+  g_assert_cmpint (1, ==, stats.calls);
+  g_assert_cmpint (0, ==, stats.hits);
+
+  /* The "echo" line is indented by the new strategy.  */
+  context.offset = 45;
+  g_assert_cmpint (7, ==, smie_indenter_calculate (indenter, &context));
+  g_assert (smie_indenter_get_strategy_stats (indenter, "echo", &stats));
+  g_assert_cmpint (2, ==, stats.calls);
+  g_assert_cmpint (1, ==, stats.hits);
+  smie_indenter_unref (indenter);
+}
+
+static smie_grammar_t *
+load_grammar_with_rules (struct fixture *fixture, const gchar *rules)
+{
+  smie_prec2_grammar_t *prec2;
+  smie_grammar_t *grammar;
+  gchar *input;
+  GError *error;
+
+  input = g_strdup_printf ("%.*s%s",
+			   (int) fixture->grammar_size,
+			   (const gchar *) fixture->grammar_addr,
+			   rules);
+  error = NULL;
+  prec2 = smie_prec2_grammar_load (input, &error);
+  g_assert_no_error (error);
+  g_assert (prec2);
+  g_free (input);
+
+  grammar = smie_prec2_to_grammar (prec2, &error);
+  g_assert_no_error (error);
+  g_assert (grammar);
+  smie_prec2_grammar_free (prec2);
+  return grammar;
+}
+
+static void
+test_grammar_rules (struct fixture *fixture, gconstpointer user_data)
+{
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+
+  /* The rules in the grammar are enough to indent.  */
+  indenter = smie_indenter_new (load_grammar_with_rules (fixture,
+							 "%rules {\n"
+							 "  basic 3;\n"
+							 "}\n"),
+				&test_common_cursor_functions,
+				NULL);
+  context.offset = 34;
+  g_assert_cmpint (3, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 45;
+  g_assert_cmpint (6, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 58;
+  g_assert_cmpint (0, ==, smie_indenter_calculate (indenter, &context));
+  smie_indenter_unref (indenter);
+
+  /* The rule functions are only consulted for what the grammar
+     leaves undetermined.  */
+  indenter = smie_indenter_new (load_grammar_with_rules (fixture,
+							 "%rules {\n"
+							 "  after 5 \"do\";\n"
+							 "}\n"),
+				&test_common_cursor_functions,
+				&test_rules);
+  context.offset = 34;
+  g_assert_cmpint (2, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 45;
+  g_assert_cmpint (5, ==, smie_indenter_calculate (indenter, &context));
+  smie_indenter_unref (indenter);
+
+  /* A line continuing the list after "for" is aligned with its first
+     element, and "done" followed by another "done" is aligned with
+     the outer "while".  */
+  grammar = load_grammar_with_rules (fixture,
+				     "%rules {\n"
+				     "  list-intro \"for\";\n"
+				     "  close-all \"done\";\n"
+				     "}\n");
+  indenter = smie_indenter_new (grammar,
+				&test_common_cursor_functions,
+				&test_rules);
+  context.input = "\n"
+    " for a b\n"
+    "     c\n"
+    " while a ; do\n"
+    "   while b ; do\n"
+    "     c\n"
+    " done done\n";
+  context.offset = 11;
+  g_assert_cmpint (5, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 54;
+  g_assert_cmpint (1, ==, smie_indenter_calculate (indenter, &context));
+  smie_indenter_unref (indenter);
+
+  /* The rule functions give the same for a grammar without them.  */
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&test_common_cursor_functions,
+				&test_list_rules);
+  context.offset = 11;
+  g_assert_cmpint (5, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 54;
+  g_assert_cmpint (1, ==, smie_indenter_calculate (indenter, &context));
+  smie_indenter_unref (indenter);
+
+  /* Without either, the list is left undetermined, and the first
+     "done" is aligned with the inner "while".  */
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&test_common_cursor_functions,
+				&test_rules);
+  context.offset = 11;
+  g_assert_cmpint (-1, ==, smie_indenter_calculate (indenter, &context));
+  context.offset = 54;
+  g_assert_cmpint (3, ==, smie_indenter_calculate (indenter, &context));
+  smie_indenter_unref (indenter);
+}
+
+static void
+test_line_cache (struct fixture *fixture, gconstpointer user_data)
+{
+  static const gint columns[] = { 0, 2, 0, -1, 1, 1, 0 };
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+  gsize line;
+
+  functions = test_common_cursor_functions;
+  functions.backward_token = test_counting_backward_token;
+  grammar = smie_indenter_get_grammar (fixture->indenter);
+  indenter = smie_indenter_new (grammar, &functions, &test_rules);
+  smie_indenter_set_line_cache (indenter, TRUE);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = "if a ; then\n  b\nfi\nwhile c ; do\n  d ;\n  e\ndone\n";
+  for (line = 0; line < G_N_ELEMENTS (columns); line++)
+    {
+      g_assert_cmpint (columns[line], ==,
+		       smie_indenter_calculate (indenter, &context));
+      test_common_cursor_functions.forward_line (&context);
+    }
+
+  /* Known lines are answered without scanning.  */
+  backward_token_count = 0;
+  context.offset = 0;
+  for (line = 0; line < G_N_ELEMENTS (columns); line++)
+    {
+      g_assert_cmpint (columns[line], ==,
+		       smie_indenter_calculate (indenter, &context));
+      test_common_cursor_functions.forward_line (&context);
+    }
+  g_assert_cmpuint (0, ==, backward_token_count);
+
+  /* Editing the first block only affects the lines up to its end.  The
+     lines of the second block are moved.  */
+  context.input = "if a ; then\n  bbb\nfi\nwhile c ; do\n  d ;\n  e\ndone\n";
+  smie_indenter_invalidate (indenter, 15, 0, 2);
+  context.offset = 21;
+  backward_token_count = 0;
+  for (line = 3; line < G_N_ELEMENTS (columns); line++)
+    {
+      g_assert_cmpint (columns[line], ==,
+		       smie_indenter_calculate (indenter, &context));
+      test_common_cursor_functions.forward_line (&context);
+    }
+  g_assert_cmpuint (0, ==, backward_token_count);
+
+  context.offset = 0;
+  for (line = 0; line < 3; line++)
+    {
+      g_assert_cmpint (columns[line], ==,
+		       smie_indenter_calculate (indenter, &context));
+      test_common_cursor_functions.forward_line (&context);
+    }
+  g_assert_cmpuint (0, <, backward_token_count);
+
+  smie_indenter_unref (indenter);
+}
+
+static void
+test_virtual_chain (struct fixture *fixture, gconstpointer user_data)
+{
+  smie_cursor_functions_t functions;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  smie_grammar_t *grammar;
+  GString *input;
+  guint uncached_count, i;
+
+  /* Each line is indented relative to the line above, so the last line
+     ends a chain of 100000 lines, which took as many nested calls
+     before the chain was kept on the heap.  */
+  input = g_string_new (NULL);
+  for (i = 0; i < 100000; i++)
+    g_string_append (input, " while a ; do\n");
+  g_string_append (input, " b\n");
+
+  functions = test_common_cursor_functions;
+  functions.backward_token = test_counting_backward_token;
+  grammar = smie_indenter_get_grammar (fixture->indenter);
+  indenter = smie_indenter_new (grammar, &functions, &test_rules);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = input->str;
+  context.offset = input->len - 2;
+  backward_token_count = 0;
+  g_assert_cmpint (200000, ==, smie_indenter_calculate (indenter, &context));
+  uncached_count = backward_token_count;
+
+  /* A line in the chain whose indentation is known ends it early.  */
+  smie_indenter_set_line_cache (indenter, TRUE);
+  context.offset = 99990 * strlen (" while a ; do\n") + 1;
+  g_assert_cmpint (199980, ==, smie_indenter_calculate (indenter, &context));
+  backward_token_count = 0;
+  context.offset = input->len - 2;
+  g_assert_cmpint (200000, ==, smie_indenter_calculate (indenter, &context));
+  g_assert_cmpuint (backward_token_count, <, uncached_count / 1000);
+
+  smie_indenter_unref (indenter);
+  g_string_free (input, TRUE);
+}
+
+static void
+test_checkpoints (struct fixture *fixture, gconstpointer user_data)
+{
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  GString *input;
+  GArray *expected;
+  smie_scan_budget_t budget;
+  gint column;
+  guint i, line;
+
+  input = g_string_new (NULL);
+  for (i = 0; i < 50; i++)
+    g_string_append (input,
+		     "while c ; do\n  if a ; then\n    b\n  fi ;\n"
+		     "  d\ndone ;\n");
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = input->str;
+  expected = g_array_new (FALSE, FALSE, sizeof (gint));
+  do
+    {
+      column = smie_indenter_calculate (fixture->indenter, &context);
+      g_array_append_val (expected, column);
+    }
+  while (test_common_cursor_functions.forward_line (&context));
+
+  indenter = smie_indenter_new (smie_indenter_get_grammar (fixture->indenter),
+				&test_common_cursor_functions,
+				&test_rules);
+  smie_indenter_set_checkpoints (indenter, 4);
+
+  /* Scanning from the end first fills the table up to it.  */
+  for (i = expected->len; i > 0; i--)
+    {
+      context.offset = 0;
+      for (line = 0; line < i - 1; line++)
+	test_common_cursor_functions.forward_line (&context);
+      g_assert_cmpint (g_array_index (expected, gint, i - 1), ==,
+		       smie_indenter_calculate (indenter, &context));
+    }
+
+  /* Prepending a block drops every checkpoint after it, which are
+     added again from the start.  */
+  g_string_prepend (input, "if a ; then\n  b\nfi ;\n");
+  context.input = input->str;
+  smie_indenter_invalidate (indenter, 0, 0, 21);
+  context.offset = 0;
+  do
+    g_assert_cmpint (smie_indenter_calculate (fixture->indenter, &context),
+		     ==,
+		     smie_indenter_calculate (indenter, &context));
+  while (test_common_cursor_functions.forward_line (&context));
+
+  /* Filling the table counts against the scan budget, which is then
+     enough for a line.  */
+  smie_indenter_invalidate (indenter, 0, 0, 0);
+  smie_scan_budget_init (&budget, 100, 0);
+  context.offset = input->len - 2;
+  g_assert_cmpint (-1, ==, smie_indenter_calculate_bounded (indenter,
+							     &context,
+							     &budget));
+  g_assert (budget.exhausted);
+  column = smie_indenter_calculate (indenter, &context);
+  smie_scan_budget_init (&budget, 100, 0);
+  g_assert_cmpint (column, ==, smie_indenter_calculate_bounded (indenter,
+								 &context,
+								 &budget));
+  g_assert (!budget.exhausted);
+
+  smie_indenter_unref (indenter);
+  g_array_free (expected, TRUE);
+  g_string_free (input, TRUE);
+}
+
+static void
+test_bounded (struct fixture *fixture, gconstpointer user_data)
+{
+  struct test_common_context_t context;
+  smie_scan_budget_t budget;
+  gint column;
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+
+  /* "done" needs a backward scan over the loop body.  */
+  smie_scan_budget_init (&budget, 1, 0);
+  context.offset = 55;
+  column = smie_indenter_calculate_bounded (fixture->indenter,
+					    &context,
+					    &budget);
+  g_assert_cmpint (-1, ==, column);
+  g_assert (budget.exhausted);
+
+  smie_scan_budget_init (&budget, 1000, 0);
+  context.offset = 55;
+  column = smie_indenter_calculate_bounded (fixture->indenter,
+					    &context,
+					    &budget);
+  g_assert_cmpint (2, ==, column);
+  g_assert (!budget.exhausted);
+}
+
+struct load_async_data
+{
+  GMainLoop *loop;
+  smie_grammar_t *grammar;
+  GError *error;
+};
+
+static void
+load_async_ready (GObject *source_object, GAsyncResult *res,
+		  gpointer user_data)
+{
+  struct load_async_data *data = user_data;
+
+  data->grammar = smie_grammar_load_finish (res, &data->error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+test_load_async (struct fixture *fixture, gconstpointer user_data)
+{
+  struct load_async_data data;
+  struct test_common_context_t context;
+  smie_indenter_t *indenter;
+  GCancellable *cancellable;
+  gint column;
+
+  memset (&data, 0, sizeof (struct load_async_data));
+  data.loop = g_main_loop_new (NULL, FALSE);
+
+  smie_grammar_load_async (GRAMMAR_FILE, NULL, load_async_ready, &data);
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+  g_assert (data.grammar);
+
+  indenter = smie_indenter_new (data.grammar,
+				&test_common_cursor_functions,
+				&test_rules);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+  context.offset = 45;
+  column = smie_indenter_calculate (indenter, &context);
+  g_assert_cmpint (4, ==, column);
+  smie_indenter_unref (indenter);
+
+  /* A load cancelled before it starts reports G_IO_ERROR_CANCELLED.  */
+  data.grammar = NULL;
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  smie_grammar_load_async (GRAMMAR_FILE, cancellable, load_async_ready, &data);
+  g_main_loop_run (data.loop);
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert (!data.grammar);
+  g_error_free (data.error);
+  g_object_unref (cancellable);
+
+  g_main_loop_unref (data.loop);
+}
+
+struct calculate_async_data
+{
+  GMainLoop *loop;
+  smie_indenter_t *indenter;
+  gint indent;
+  GError *error;
+};
+
+static void
+calculate_async_ready (GObject *source_object, GAsyncResult *res,
+		       gpointer user_data)
+{
+  struct calculate_async_data *data = user_data;
+
+  data->indent = smie_indenter_calculate_finish (data->indenter, res,
+						 &data->error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+test_calculate_async (struct fixture *fixture, gconstpointer user_data)
+{
+  struct calculate_async_data data;
+  struct test_common_context_t context;
+  GCancellable *cancellable;
+
+  memset (&data, 0, sizeof (struct calculate_async_data));
+  data.loop = g_main_loop_new (NULL, FALSE);
+  data.indenter = fixture->indenter;
+
+  /* The context is copied, so moving the cursor afterwards does not
+     affect the result.  */
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+  context.offset = 45;
+  smie_indenter_calculate_async (fixture->indenter, &context, NULL,
+				 calculate_async_ready, &data);
+  context.offset = 0;
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+  g_assert_cmpint (4, ==, data.indent);
+  g_assert_cmpint (0, ==, context.offset);
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  context.offset = 45;
+  smie_indenter_calculate_async (fixture->indenter, &context, cancellable,
+				 calculate_async_ready, &data);
+  g_main_loop_run (data.loop);
+  g_assert_error (data.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_cmpint (-1, ==, data.indent);
+  g_error_free (data.error);
+  g_object_unref (cancellable);
+
+  g_main_loop_unref (data.loop);
+}
+
+static void
+monitor_reloaded (smie_grammar_monitor_t *monitor,
+		  const GError *error,
+		  gpointer user_data)
+{
+  struct load_async_data *data = user_data;
+
+  if (error)
+    data->error = g_error_copy (error);
+  g_main_loop_quit (data->loop);
+}
+
+static void
+test_monitor (struct fixture *fixture, gconstpointer user_data)
+{
+  struct load_async_data data;
+  struct test_common_context_t context;
+  smie_grammar_monitor_t *monitor;
+  smie_grammar_t *old_grammar, *new_grammar;
+  gchar *dir, *filename;
+  GError *error;
+  gint column;
+
+  dir = g_dir_make_tmp ("smie-test-XXXXXX", NULL);
+  g_assert (dir);
+  filename = g_build_filename (dir, "test.grammar", NULL);
+  g_assert (g_file_set_contents (filename,
+				 fixture->grammar_addr,
+				 fixture->grammar_size,
+				 NULL));
+
+  error = NULL;
+  monitor = smie_grammar_monitor_new (filename, &error);
+  g_assert_no_error (error);
+  g_assert (monitor);
+
+  memset (&data, 0, sizeof (struct load_async_data));
+  data.loop = g_main_loop_new (NULL, FALSE);
+  smie_grammar_monitor_set_func (monitor, monitor_reloaded, &data, NULL);
+  smie_grammar_monitor_add_indenter (monitor, fixture->indenter);
+
+  /* Hold the current grammar, as an in-flight calculation would.  */
+  old_grammar = smie_indenter_get_grammar (fixture->indenter);
+
+  smie_grammar_monitor_reload (monitor);
+  g_main_loop_run (data.loop);
+  g_assert_no_error (data.error);
+
+  new_grammar = smie_indenter_get_grammar (fixture->indenter);
+  g_assert (new_grammar != old_grammar);
+  g_assert (smie_grammar_get_left_prec (old_grammar,
+					smie_symbol_intern
+					(smie_grammar_get_symbol_pool
+					 (old_grammar),
+					 "fi",
+					 SMIE_SYMBOL_TERMINAL)) >= 0);
+  smie_grammar_unref (old_grammar);
+  smie_grammar_unref (new_grammar);
+
+  memset (&context, 0, sizeof (struct test_common_context_t));
+  context.input = fixture->input_addr;
+  context.offset = 45;
+  column = smie_indenter_calculate (fixture->indenter, &context);
+  g_assert_cmpint (4, ==, column);
+
+  /* A failed reload is reported and leaves the indenter alone.  */
+  old_grammar = smie_indenter_get_grammar (fixture->indenter);
+  g_unlink (filename);
+  smie_grammar_monitor_reload (monitor);
+  g_main_loop_run (data.loop);
+  g_assert (data.error);
+  g_error_free (data.error);
+  new_grammar = smie_indenter_get_grammar (fixture->indenter);
+  g_assert (new_grammar == old_grammar);
+  smie_grammar_unref (old_grammar);
+  smie_grammar_unref (new_grammar);
+
+  smie_grammar_monitor_remove_indenter (monitor, fixture->indenter);
+  smie_grammar_monitor_unref (monitor);
+  g_main_loop_unref (data.loop);
+
+  g_rmdir (dir);
+  g_free (filename);
+  g_free (dir);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -144,5 +1092,61 @@ main (int argc, char **argv)
 	      setup,
 	      test_basic,
 	      teardown);
+  g_test_add ("/indenter/bounded", struct fixture, NULL,
+	      setup,
+	      test_bounded,
+	      teardown);
+  g_test_add ("/indenter/calculate-async", struct fixture, NULL,
+	      setup,
+	      test_calculate_async,
+	      teardown);
+  g_test_add ("/indenter/checkpoints", struct fixture, NULL,
+	      setup,
+	      test_checkpoints,
+	      teardown);
+  g_test_add ("/indenter/context-stack", struct fixture, NULL,
+	      setup,
+	      test_context_stack,
+	      teardown);
+  g_test_add ("/indenter/grammar-rules", struct fixture, NULL,
+	      setup,
+	      test_grammar_rules,
+	      teardown);
+  g_test_add ("/indenter/line-cache", struct fixture, NULL,
+	      setup,
+	      test_line_cache,
+	      teardown);
+  g_test_add ("/indenter/load-async", struct fixture, NULL,
+	      setup,
+	      test_load_async,
+	      teardown);
+  g_test_add ("/indenter/monitor", struct fixture, NULL,
+	      setup,
+	      test_monitor,
+	      teardown);
+  g_test_add ("/indenter/region", struct fixture, NULL,
+	      setup,
+	      test_region,
+	      teardown);
+  g_test_add ("/indenter/region-linear", struct fixture, NULL,
+	      setup,
+	      test_region_linear,
+	      teardown);
+  g_test_add ("/indenter/region-parallel", struct fixture, NULL,
+	      setup,
+	      test_region_parallel,
+	      teardown);
+  g_test_add ("/indenter/sexp-memo", struct fixture, NULL,
+	      setup,
+	      test_sexp_memo,
+	      teardown);
+  g_test_add ("/indenter/strategies", struct fixture, NULL,
+	      setup,
+	      test_strategies,
+	      teardown);
+  g_test_add ("/indenter/virtual-chain", struct fixture, NULL,
+	      setup,
+	      test_virtual_chain,
+	      teardown);
   return g_test_run ();
 }